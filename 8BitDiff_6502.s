@@ -37,6 +37,34 @@
 // z8BDst = Address to decode updated data
 // jsr Patch_8BDiff
 //
+// A patch made with -inplace can be decoded over the
+// original data, only the original data and the patch
+// need to be in memory:
+// z8BDiff = Address of patch
+// z8BSrc = Address of original data (and updated data)
+// jsr Patch_8BDiff_InPlace
+//
+// DELTA FORMAT
+// ------------
+// A patch made with -delta starts with $ff, 3, the number
+// of deltas (1-4) and the deltas (2 bytes each, big endian)
+// before the 8BDIFF format. A source copy has one more bit
+// after the buffer bit, 1=delta copy: the length is the
+// number of words, each word follows a gap of bytes copied
+// from the source (coded as a length) and the index of
+// its delta (0, 1 or 2 bits). The source word is written
+// with the delta added.
+//
+// BACKWARD FORMAT
+// ---------------
+// An in place patch can start with $ff, 4, the source size
+// and the target size (4 bytes each, big endian) before the
+// 8BDIFF format. It is decoded from the end down: the source,
+// target and inject pointers start at the end of their
+// buffers and each instruction moves the pointer and the
+// destination down by its length before copying the bytes
+// from the last to the first.
+//
 
 .label zParam8B = $f0 		// 6 bytes
 .label zWork8B = $f6 		// 10 bytes
@@ -66,9 +94,71 @@
 !BitOk:
 }
 
+Patch_8BDiff_InPlace:
+	lda z8BSrc 			// decode over the source
+	sta z8BDst
+	lda z8BSrc+1
+	sta z8BDst+1
 Patch_8BDiff:
 	ldy #0 				// clear Y
+	lda #Src-DeltaFormat-2	// no delta bit unless the delta format
+	sta DeltaFormat+1
+	lda #<PageCopy 		// copy up unless the backward format
+	sta CopyDirection+1
+	lda #>PageCopy
+	sta CopyDirection+2
+	sty InjectDirection+1
 	lda (z8BDiff),y 	// first byte is prefix length bits | offset bits<<4
+	cmp #$ff 			// or $ff for the delta or backward format
+	bne NotDelta
+	iny
+	lda (z8BDiff),y 	// version: 3=delta, 4=backward
+	cmp #4
+	bne DeltaHeader
+	ldy #5 				// source size, low 2 bytes
+	ldx #z8BSrc 		// source pointer starts at the end
+	jsr AddSize
+	ldy #9 				// target size, low 2 bytes
+	ldx #z8BDst 		// destination starts at the end
+	jsr AddSize
+	lda #<BackCopy 		// copy down
+	sta CopyDirection+1
+	lda #>BackCopy
+	sta CopyDirection+2
+	inc InjectDirection+1	// inject buffer is read down from the end
+	ldx #z8BDiff
+	lda #10 			// skip the backward header
+	bne SkipHeader 		// always branch!
+DeltaHeader:
+	lda #DeltaBit-DeltaFormat-2	// source copies have a delta bit
+	sta DeltaFormat+1
+	ldy #2
+	lda (z8BDiff),y 	// number of deltas
+	pha
+	tax
+	lda #2 				// delta index bits: 0, 1 or 2
+	cpx #3
+	bcs DeltaBitsSet
+	dex
+	txa
+DeltaBitsSet:
+	sta DeltaIndexBits+1
+	lda #3 				// skip $ff, version and number of deltas
+	ldx #z8BDiff
+	jsr ApplyOffsetA
+	lda z8BDiff 		// store off address of the deltas
+	sta DeltaLo+1
+	sta DeltaHi+1
+	lda z8BDiff+1
+	sta DeltaLo+2
+	sta DeltaHi+2
+	pla 				// skip 2 bytes for each delta
+	asl
+SkipHeader:
+	jsr ApplyOffsetA
+	ldy #0
+	lda (z8BDiff),y 	// prefix length bits | offset bits<<4
+NotDelta:
 	tax
 	lsr
 	lsr
@@ -121,6 +211,18 @@ NotLastByte:
 	adc z8BDiff+1
 	sta DiffPtr+2 		// store off instruction start high
 	sta z8BInjEnd+1 	// store off inject buffer end high
+InjectDirection:
+	ldx #0 				// 1 for the backward format
+	beq InjectUp
+	ldx z8BInj 			// inject from the end, done at the start
+	ldy z8BInjEnd
+	stx z8BInjEnd
+	sty z8BInj
+	ldx z8BInj+1
+	ldy z8BInjEnd+1
+	stx z8BInjEnd+1
+	sty z8BInj+1
+InjectUp:
 
 	lda z8BDst 			// store off target buffer
 	sta z8BTrg
@@ -134,10 +236,10 @@ NextInstruction:
 	bcs SrcTrg
 	ldx z8BInj 			// check if complete
 	cpx z8BInjEnd
-	bcc NotEnd
+	bne NotEnd
 	ldx z8BInj+1
 	cpx z8BInjEnd+1
-	bcc NotEnd
+	bne NotEnd
 	rts 				// patching is complete, return to caller
 NotEnd:
 	jsr GetLen 			// number of bytes to inject y = 0 here
@@ -161,7 +263,8 @@ SrcTrg:
 PositiveOffs:
 	:GetBit()
 	ldx #z8BSrc 		// use source buffer
-	bcc Src
+DeltaFormat:
+	bcc Src 			// or DeltaBit for the delta format
 	ldx #z8BTrg 		// use target buffer
 Src:
 	pha 				// save bit shift byte
@@ -175,6 +278,8 @@ Src:
 
 MoveToDest:
 	stx BufferCopyTrg+1 // x = zero page source buffer to copy from
+CopyDirection:
+	jmp PageCopy 		// or BackCopy for the backward format
 
 PageCopy:				// copy pages (256 bytes) at a time
 	dec z8BLen+1 
@@ -198,6 +303,113 @@ NoLowLength:
 	bne NextInstruction
 	// PC will not cross this line
 
+DeltaBit:
+	:GetBit() 			// bit is 1 => delta copy, otherwise source copy
+	bcc Src
+DeltaCopy:
+	pha 				// save bit shift byte
+	clc
+	lda z8BOff 			// apply offset to source buffer
+	adc z8BSrc
+	sta z8BSrc
+	lda z8BOff+1
+	adc z8BSrc+1
+	sta z8BSrc+1
+	stx BufferCopyTrg+1 // x = z8BSrc, the gaps are copied from the source
+	lda z8BLen 			// number of words, GetLen does not change z8BOff+1
+	sta z8BOff+1
+	pla
+DeltaWord:
+	jsr GetLen 			// bytes before the word, y = 0 here
+	pha 				// save bit shift byte
+	ldy z8BLen
+	beq DeltaNoGap
+	jsr BufferCopy 		// Y returns unchanged
+	tya 				// apply the gap to source and destination
+	ldx #z8BSrc
+	jsr ApplyOffsetA
+	tya
+	ldx #z8BDst
+	jsr ApplyOffsetA
+DeltaNoGap:
+	pla
+	ldy #0
+	sty z8BTemp
+DeltaIndexBits:
+	ldy #0 				// bits of the delta index
+	beq DeltaIndex
+	jsr GetLenOffBits 	// delta index in Y
+DeltaIndex:
+	pha 				// save bit shift byte
+	tya
+	sec
+	rol 				// x = index*2+1, low byte of the big endian delta
+	tax
+	ldy #0
+	clc
+	lda (z8BSrc),y 		// read the word before writing it for in place patches
+DeltaLo:
+	adc $1234,x
+	sta (z8BDst),y
+	iny
+	dex
+	lda (z8BSrc),y
+DeltaHi:
+	adc $1234,x
+	sta (z8BDst),y
+	lda #2 				// apply the word to source and destination
+	ldx #z8BSrc
+	jsr ApplyOffsetA
+	lda #2
+	ldx #z8BDst
+	jsr ApplyOffsetA
+	pla 				// retrieve bit shift byte
+	dec z8BOff+1
+	bne DeltaWord
+	jmp NextInstruction
+
+// Backward format: move the buffer and destination down by the
+// length and copy from the last byte to the first
+BackCopy:
+	stx BackCopyTrg+1 	// x = zero page source buffer to copy from
+	sec
+	lda $00,x 			// move down by the bytes past the pages
+	sbc z8BLen
+	sta $00,x
+	bcs BackSrcPage
+	dec $01,x
+BackSrcPage:
+	sec
+	lda z8BDst
+	sbc z8BLen
+	sta z8BDst
+	bcs BackDstPage
+	dec z8BDst+1
+BackDstPage:
+	ldy z8BLen 			// copy the bytes past the pages first
+	beq BackPages
+	jsr BackCopyBytes
+BackPages:
+	dec z8BLen+1 		// then the pages from the last
+	bpl BackPage
+	pla 				// retrieve bit shift byte to parse next bit
+	jmp NextInstruction
+BackPage:
+	dec $01,x
+	dec z8BDst+1
+	jsr BackCopyBytes 	// y is 0 here so copy 256 bytes
+	beq BackPages 		// always branch, y returns 0
+
+// BackCopyBytes copies bytes backward from y-1 to 0 (256 if y is 0)
+BackCopyBytes:
+	dey
+BackCopyTrg:
+	lda (z8BInj),y
+	sta (z8BDst),y
+	tya
+	bne BackCopyBytes
+	rts
+
 // BufferCopy copies bytes forward from 0 to y (256 if y is 0)
 BufferCopy:
 	sty BufferCopyLength+1
@@ -278,6 +490,19 @@ BitXShift:
 	bpl BitXShift
 	rts
 
+// Add the low 2 bytes of a big endian size at (z8BDiff),y-1
+// to a zero page indirect address in X
+AddSize:
+	clc
+	lda (z8BDiff),y
+	adc $00,x
+	sta $00,x
+	dey
+	lda (z8BDiff),y
+	adc $01,x
+	sta $01,x
+	rts
+
 // Apply an offset to a zero page indirect address in X
 ApplyOffsetY:
 	tya
@@ -7,11 +7,41 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 #ifdef WIN32
 #define snprintf sprintf_s
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#define fseeko _fseeki64
+#define popen _popen
+#define pclose _pclose
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define E8_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define E8_TARGET_AVX2
+#else
+#define E8_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 #endif
 
 // 8BDIFF FORMAT
@@ -39,17 +69,111 @@
 // any pointer is set to the end of the run after
 // copy and the offset increments/decrements for source
 // for a negative offset, not the number, don't negate.
+//
+// LARGE FILE FORMAT (version 1)
+// -----------------------------
+// Used when the source or target is larger than 2 GB
+// 1 byte: 0xff (not a valid bit size byte)
+// 1 byte: version
+// 4 bits: size of offset bit sizes
+// 4 bits: size of length bit sizes
+// length bit sizes (up to 63 bits)
+// offset bit sizes (up to 63 bits)
+// 8 bytes: number of injected bytes
+// injected bytes
+// instructions as above
+//
+// BLOCK CONTAINER (-blocks size)
+// ------------------------------
+// The target is split into blocks with a patch each (bucket tables,
+// injected bytes and instructions as above) from the whole source,
+// target copies don't reach outside of the block.
+// 1 byte: 0xff
+// 1 byte: version (2)
+// 8 bytes: target size
+// 8 bytes: target bytes in each block (the last may be shorter)
+// 8 bytes for each block: end of its patch from the start of the container
+// block patches
+//
+// DELTA FORMAT (version 3, -delta)
+// ---------------------------------
+// Code rebuilt at another address has its absolute operands moved by
+// the same amount (another amount past code that grew or shrank), a delta
+// copy copies the source and adds a delta to the words at listed places.
+// 1 byte: 0xff
+// 1 byte: version (3)
+// 1 byte: number of deltas (1-4)
+// 2 bytes for each delta
+// header, injected bytes and instructions as the 8 bit format
+//  a source copy has one more bit after the buffer bit: 1=delta copy
+//  a delta copy has the number of words (1-255) as the length, then
+//  for each word:
+//   length bit cnt + length bits: bytes copied before the word (0-255)
+//   index of the delta (0, 1 or 2 bits for 1, 2 or 3-4 deltas)
+//  the source word (little endian) is written with the delta added,
+//  the copy ends after the last word.
+// 2 byte deltas are big endian.
+//
+// BACKWARD FORMAT (version 4, -inplace)
+// -------------------------------------
+// An in place patch decoded from the end of the target to the start,
+// so data inserted in the target doesn't make the source copies after
+// it read bytes that are already written.
+// 1 byte: 0xff
+// 1 byte: version (4)
+// 4 bytes: source size
+// 4 bytes: target size
+// header, injected bytes and instructions as the 8 bit format
+//  the source, target and inject pointers start at the end of their
+//  buffers, a copy or inject first moves the pointer and the output
+//  down by the length and then copies the bytes from the last to the
+//  first. The injected bytes are in memory order, the first inject
+//  instruction writes the last bytes.
+// sizes are big endian.
+//
+// CHECKSUM TRAILER (optional, -checksum)
+// --------------------------------------
+// Follows the last byte of the instructions, decoders stop
+// at the end of the instructions and don't read it.
+// 8 bytes: source size
+// 4 bytes: CRC-32 of the source
+// 8 bytes: target size
+// 4 bytes: CRC-32 of the target
+// 4 bytes: "8BDC"
+// sizes and checksums are little endian
 
 // Some limits
 #define E8_SIZE_BITS 3
 #define EB_SIZE_BITS_MAX 4
 #define E8_MIN_TRG_SRC_LEN 2
+#define E8_DEFAULT_WINDOW (16<<20)	// output kept in memory when decoding to a file
+#define E8_MIN_WINDOW 256
+#define E8_OPTIMAL_LONG_MATCH 256	// optimal parse takes matches this long without looking inside
+#define E8_OPTIMAL_REUSE 32			// optimal parse continues a match this long instead of searching
+#define E8_LARGE_LIMIT 0x7fffffff	// larger files need the large file format
+#define E8_LARGE_MARKER 0xff		// first byte of a large file format diff
+#define E8_LARGE_VERSION 1
+#define E8_BLOCK_VERSION 2			// block container, same marker as the large file format
+#define E8_BLOCK_HEADER 18			// block container size before the block ends
+#define E8_DELTA_VERSION 3			// delta copies, same marker as the large file format
+#define E8_DELTA_COUNT 4			// most deltas in a delta format header
+#define E8_BACKWARD_VERSION 4		// in place patch decoded from the end, same marker
+#define E8_BACKWARD_HEADER 10		// marker, version, source and target size
+#define E8_DELTA_WORDS 255			// most words in a delta copy
+#define E8_DELTA_GAP 255			// most bytes copied before a word of a delta copy
+#define E8_DELTA_VOTES 4			// copies that end at a word with the same delta to try it
+#define E8_DELTA_TRIES 4			// deltas with the most votes tried for each delta added
+#define E8_VALUE_BITS_MAX 63		// bits in a length or offset bucket
+#define E8_ANY_OFFSET 0x7fffffffffffffffLL	// copy offsets are not limited
+#define E8_TRAILER_SIZE 28			// checksum trailer after the instructions
+#define E8_TRAILER_MAGIC "8BDC"
+#define E8_VERIFY_WINDOW (1<<20)	// output kept in memory when comparing a patch with the target
 
-// accelerator
+// accelerator (default match engine, select with -engine)
 #define USE_BUFFER_ACCELERATOR
 
 // Get index of top bit in value
-int GetNumBits(int value)
+int GetNumBits(long long value)
 {
 	if (value==0)
 		return 0;
@@ -58,8 +182,8 @@ int GetNumBits(int value)
 		value = 1-value;
 
 	int ret = 1;
-	for (int b=16; b; b>>=1) {
-		if (value >= (1<<b)) {
+	for (int b=32; b; b>>=1) {
+		if (value >= (1LL<<b)) {
 			ret += b;
 			value >>= b;
 		}
@@ -68,202 +192,562 @@ int GetNumBits(int value)
 }
 
 // From a list of bit counts, find the lowest that can hold value
-int GetBitCountIndex(int value, char *buckets, int numBuckets)
+int GetBitCountIndex(long long value, const char *buckets, int numBuckets)
 {
 	if (value<0)
 		value = ~value;
 	for (int b=0; b<numBuckets; b++) {
-		if (value<(1<<int(buckets[b])))
+		if (value<(1LL<<int(buckets[b])))
 			return b;
 	}
 	return -1;
 }
 
-// Write a number of bits to a bit stream
-unsigned char* PushBits(unsigned char *out, unsigned char &mask, int value, int bits)
-{
-	unsigned char m = mask;
-	if (value<0)
-		value = ~value;
-	unsigned int f = 1<<(bits-1);
-	unsigned char o = *out;
-	for (int b=0; b<bits; b++) {
-		if (value & f)
-			o |= m;
-		else
-			o &= ~m;
-		m>>=1;
-		if (!m) {
-			m = 0x80;
-			*out++ = o;
-			o = 0;
+// Writes a bit stream into a buffer that grows as needed, bits are
+// collected in a 64 bit accumulator and written out as whole bytes
+struct BitWriter {
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	unsigned long long bits;	// pending bits in the low end
+	int count;					// number of pending bits
+
+	BitWriter(size_t reserve) : size(0), capacity(reserve>16 ? reserve : 16), bits(0), count(0) {
+		data = (unsigned char*)malloc(capacity);
+	}
+	~BitWriter() {
+		if (data)
+			free(data);
+	}
+
+	void Reserve(size_t num) {
+		if (size+num>capacity) {
+			while (size+num>capacity)
+				capacity *= 2;
+			data = (unsigned char*)realloc(data, capacity);
 		}
-		f>>=1;
 	}
-	*out = o;
-	mask = m;
-	return out;
+	// write out the pending whole bytes
+	void Flush() {
+		Reserve(8);
+		while (count>=8) {
+			count -= 8;
+			data[size++] = (unsigned char)(bits>>count);
+		}
+	}
+	// add num (0-63) bits, value must fit in num bits
+	void Put(unsigned long long value, int num) {
+		if (num>56) {
+			Put(value>>32, num-32);
+			value &= 0xffffffffULL;
+			num = 32;
+		}
+		if (count+num>64)
+			Flush();
+		bits = (bits<<num) | value;
+		count += num;
+	}
+	// add bytes at a byte boundary
+	void Bytes(const char *src, size_t num) {
+		Flush();
+		Reserve(num);
+		memcpy(data+size, src, num);
+		size += num;
+	}
+	// pad to a whole byte and hand over the buffer
+	unsigned char* Finish() {
+		if (count&7)
+			Put(0, 8-(count&7));
+		Flush();
+		unsigned char *done = data;
+		data = nullptr;
+		return done;
+	}
+};
+
+// Index of the lowest set bit (value must not be 0)
+int LowestBit(unsigned long long value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+#ifdef _M_X64
+	_BitScanForward64(&index, value);
+#else
+	if (!_BitScanForward(&index, (unsigned long)value)) {
+		_BitScanForward(&index, (unsigned long)(value>>32));
+		index += 32;
+	}
+#endif
+	return (int)index;
+#else
+	return __builtin_ctzll(value);
+#endif
 }
 
-#ifdef USE_BUFFER_ACCELERATOR
-// Accelerator for finding strings by matching initial pairs
-// (This makes finding patterns really fast but uses
-//  512 kb + (sum of file sizes) * 4)
-struct PairLookupTable {
-	enum { NUM_PAIRS = 256*256 };
-	unsigned int *pair_counts;      // number of each pair
-	unsigned int *offset_arrays;	// list of pairs
-	unsigned int *offset_start;		// index into the offset arrays for each pair
+// Number of bits needed to store value
+int CountBits(unsigned long long value)
+{
+	if (!value)
+		return 0;
+#ifdef _MSC_VER
+	unsigned long index;
+#ifdef _M_X64
+	_BitScanReverse64(&index, value);
+#else
+	if (_BitScanReverse(&index, (unsigned long)(value>>32)))
+		index += 32;
+	else
+		_BitScanReverse(&index, (unsigned long)value);
+#endif
+	return (int)index+1;
+#else
+	return 64-__builtin_clzll(value);
+#endif
+}
 
-	void AddBuffer(const char *b, size_t s);
-	unsigned int* GetPairs(const char *t, size_t &count);
-	int Match(const char *match, size_t match_left,
-			  const char *buffer, size_t buffer_size, size_t buffer_exp,
-			  int curr_offset, int &offs, int &size);
-
-	PairLookupTable() : pair_counts(nullptr),
-		offset_arrays(nullptr), offset_start(nullptr) {}
-	PairLookupTable(const char *b, size_t s) : pair_counts(nullptr),
-		offset_arrays(nullptr), offset_start(nullptr) { AddBuffer(b, s); }
-	~PairLookupTable() {
-		if (pair_counts)
-			free(pair_counts);
-		if (offset_arrays)
-			free(offset_arrays);
-		if (offset_start)
-			free(offset_start);
+// Number of equal bytes at the start of a and b, up to left bytes
+typedef size_t (*MatchLengthFunc)(const char *a, const char *b, size_t left);
+
+// one byte at a time
+size_t MatchLengthBytes(const char *a, const char *b, size_t left)
+{
+	size_t len = 0;
+	while (len<left && a[len]==b[len])
+		len++;
+	return len;
+}
+
+// 8 bytes at a time, first different byte from the lowest different bit
+size_t MatchLengthWords(const char *a, const char *b, size_t left)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+	return MatchLengthBytes(a, b, left);
+#else
+	size_t len = 0;
+	while (len+8<=left) {
+		unsigned long long wa, wb;
+		memcpy(&wa, a+len, 8);
+		memcpy(&wb, b+len, 8);
+		if (unsigned long long diff = wa^wb)
+			return len + (LowestBit(diff)>>3);
+		len += 8;
 	}
-};
+	return len + MatchLengthBytes(a+len, b+len, left-len);
+#endif
+}
 
-// get an array of matching byte pair offsets
-unsigned int* PairLookupTable::GetPairs(const char *t, size_t &count)
+#ifdef E8_X86
+// 16 bytes at a time
+size_t MatchLengthSSE2(const char *a, const char *b, size_t left)
 {
-	unsigned int pair = ((unsigned char)t[0])<<8 | (unsigned char)t[1];
-	if (offset_start[pair]!=~0U) {
-		count = pair_counts[pair];
-		return offset_arrays + offset_start[pair];
+	size_t len = 0;
+	while (len+16<=left) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a+len));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b+len));
+		unsigned int diff = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+		if (diff)
+			return len + LowestBit(diff);
+		len += 16;
 	}
-	return nullptr;
+	return len + MatchLengthWords(a+len, b+len, left-len);
+}
+
+// 32 bytes at a time
+E8_TARGET_AVX2 size_t MatchLengthAVX2(const char *a, const char *b, size_t left)
+{
+	size_t len = 0;
+	while (len+32<=left) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a+len));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b+len));
+		unsigned int diff = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (diff)
+			return len + LowestBit(diff);
+		len += 32;
+	}
+	return len + MatchLengthSSE2(a+len, b+len, left-len);
+}
+
+// check that the cpu and os support avx2
+bool HasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	if (!(info[2] & (1<<27)) || !(info[2] & (1<<28)))
+		return false;	// no osxsave or avx
+	if ((_xgetbv(0) & 6)!=6)
+		return false;	// ymm state not enabled by the os
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1<<5))!=0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2")!=0;
+#endif
+}
+#endif
+
+// Compare functions from narrowest to widest
+enum MatchLengthKernel {
+	KERNEL_BYTES,
+	KERNEL_WORDS,
+#ifdef E8_X86
+	KERNEL_SSE2,
+	KERNEL_AVX2,
+#endif
+	KERNEL_COUNT
+};
+
+const char *aKernelNames[] = {
+	"bytes",
+	"words",
+#ifdef E8_X86
+	"sse2",
+	"avx2",
+#endif
+	nullptr
+};
+
+const MatchLengthFunc aKernels[] = {
+	MatchLengthBytes,
+	MatchLengthWords,
+#ifdef E8_X86
+	MatchLengthSSE2,
+	MatchLengthAVX2,
+#endif
+};
+
+// Widest compare function supported by this cpu
+MatchLengthKernel BestKernel()
+{
+#ifdef E8_X86
+	return HasAVX2() ? KERNEL_AVX2 : KERNEL_SSE2;
+#else
+	return KERNEL_WORDS;
+#endif
+}
+
+MatchLengthFunc MatchLength = aKernels[BestKernel()];
+
+// Estimate the number of bits saved by copying len bytes at offset
+// instead of adding them to the inject buffer
+long long MatchSaving(long long offset, long long len)
+{
+	// note: weight on offset since we probably need to swap
+	// back to this point which might not have been necessary
+	int instr_size = 1 + 1 + 1; // instruction src/trg + sign + src/trg
+	// estimate bits per size and actual bits of offset plus half cost of returning pointer
+	instr_size += E8_SIZE_BITS + 3*GetNumBits(offset)/2;
+	// estimate bits per size and actual bits of length
+	instr_size += E8_SIZE_BITS + GetNumBits(len-1);
+	// bits accounted for minus bits needed for this instruction
+	return len*8 - instr_size;
 }
 
+// Available methods for finding matches in the source and target buffers
+enum MatchEngine {
+	ENGINE_PAIRS,		// PairLookupTable
+	ENGINE_SUFFIX,		// SuffixArrayLookup
+	ENGINE_STRING,		// MatchString (no lookup table)
+	ENGINE_CHAIN,		// HashChainLookup (bounded by level)
+
+	ENGINE_COUNT
+};
+
+const char *aEngineNames[] = {
+	"pairs",
+	"suffix",
+	"string",
+	"chain",
+	nullptr
+};
+
+// Search limits for the hash chain engine per compression level (-1 .. -9)
+struct ChainLevel {
+	int good_length;	// reduce the remaining search when a match is this long
+	int nice_length;	// stop searching when a match is this long
+	int max_chain;		// max number of candidates to check
+};
+
+#define E8_DEFAULT_LEVEL 6
+
+const ChainLevel aChainLevels[] = {
+	{    4,     16,     4 },	// 1
+	{   16,     32,     8 },	// 2
+	{   16,     64,    16 },	// 3
+	{   16,    128,    32 },	// 4
+	{   32,    128,    64 },	// 5
+	{   64,    256,    96 },	// 6
+	{   64,   1024,   256 },	// 7
+	{   64,   4096,  2048 },	// 8
+	{  256,   8192,  4096 },	// 9
+};
+
+// Match lookups and candidates visited, counted while profiling
+struct MatchCounter {
+	std::atomic<long long> lookups;
+	std::atomic<long long> candidates;
+
+	MatchCounter() : lookups(0), candidates(0) {}
+	void Add(long long visited) {
+		lookups.fetch_add(1, std::memory_order_relaxed);
+		candidates.fetch_add(visited, std::memory_order_relaxed);
+	}
+};
+
+// Common interface for finding the best match for a string within a buffer
+// buffer_exp is how much the buffer can grow along with match
+// (is of the same buffer as match), skipped is the number of bytes
+// parsed since curr_offset was last moved by a copy from this buffer.
+// The result only depends on the arguments so matches can be found
+// ahead of the parse on other threads.
+struct MatchFinder {
+	MatchCounter *counter;		// counts lookups if set
+	long long min_offset;		// copy offsets a decoder can add to a buffer pointer
+	long long max_offset;
+
+	MatchFinder() : counter(nullptr), min_offset(-E8_ANY_OFFSET), max_offset(E8_ANY_OFFSET) {}
+	virtual ~MatchFinder() {}
+	bool Reach(long long offset) const { return offset>=min_offset && offset<=max_offset; }
+	// first buffer offset in reach of the pointer at curr_offset
+	size_t ReachFrom(long long curr_offset) const {
+		return min_offset<=-curr_offset ? 0 : size_t(curr_offset+min_offset);
+	}
+	// end of the buffer offsets in reach of the pointer at curr_offset
+	size_t ReachTo(long long curr_offset, size_t end) const {
+		if (max_offset>=((long long)end-curr_offset))
+			return end;
+		return (curr_offset+max_offset)<0 ? 0 : size_t(curr_offset+max_offset+1);
+	}
+	virtual long long Match(const char *match, size_t match_left,
+							const char *buffer, size_t buffer_size, size_t buffer_exp,
+							long long curr_offset, size_t skipped, long long &offs, long long &size) = 0;
+	// false if Match changes the lookup and each thread needs its own
+	virtual bool Shared() const { return true; }
+	// drop the offsets from offset on that a growing buffer added
+	virtual void Rewind(size_t) {}
+	// write the index arrays to a cache file, false if the index can't be saved
+	virtual bool Save(FILE *) const { return false; }
+};
+
+// Accelerator for finding strings by matching initial pairs
+// (This makes finding patterns really fast but uses 256 kb + (file size) * 3
+//  for files below 16 mb. When the table grows with the cursor another 256 kb
+//  is used and only offsets before the cursor are added, so future offsets
+//  are never visited. Index is unsigned int unless the file is above 4 gb)
+template<typename Index> struct PairLookupTable : public MatchFinder {
+	enum {
+		NUM_PAIRS = 256*256,
+		SMALL_BUFFER = 1<<24		// offsets fit in 3 bytes
+	};
+	const unsigned char *data;
+	size_t data_size;
+	Index *pair_start;				// index of the first offset of each pair (NUM_PAIRS+1)
+	Index *pair_end;				// end of offsets added so far for each pair if growing
+	unsigned char *offsets;			// offsets of each pair in order (3, 4 or 5 bytes each)
+	int offset_bytes;
+	size_t added;					// offsets before this are in the table
+	bool grow;
+	bool mapped;					// arrays are in a cache file, not allocated
+
+	void AddBuffer(const char *b, size_t s);
+	void AddUntil(size_t offset);
+	void Rewind(size_t offset);
+	size_t GetOffset(size_t index) const {
+		const unsigned char *o = offsets + index * offset_bytes;
+		unsigned int offset = o[0] | (o[1]<<8) | (o[2]<<16);
+		if (offset_bytes<4)
+			return offset;
+		offset |= unsigned(o[3])<<24;
+		return offset_bytes>4 ? size_t(offset | ((unsigned long long)o[4]<<32)) : offset;
+	}
+	void SetOffset(size_t index, size_t offset) {
+		unsigned char *o = offsets + index * offset_bytes;
+		for (int b=0; b<offset_bytes; b++)
+			o[b] = (unsigned char)((unsigned long long)offset>>(8*b));
+	}
+	bool Shared() const { return !grow; }
+	bool Save(FILE *f) const;
+	static bool Valid(size_t s, const char *index, size_t index_size);
+	long long Match(const char *match, size_t match_left,
+					const char *buffer, size_t buffer_size, size_t buffer_exp,
+					long long curr_offset, size_t skipped, long long &offs, long long &size);
+
+	PairLookupTable(const char *b, size_t s, bool g) : data(nullptr), data_size(0),
+		pair_start(nullptr), pair_end(nullptr), offsets(nullptr), offset_bytes(3),
+		added(0), grow(g), mapped(false) { AddBuffer(b, s); }
+	// use an index saved by Save (checked by Valid)
+	PairLookupTable(const char *b, size_t s, const char *index) : data((const unsigned char*)b), data_size(s),
+		pair_start((Index*)index), pair_end(nullptr),
+		offsets((unsigned char*)index + sizeof(Index) * (NUM_PAIRS+1)),
+		offset_bytes(s<=SMALL_BUFFER ? 3 : ((unsigned long long)s<=0xffffffffULL ? 4 : 5)),
+		added(s), grow(false), mapped(true) {}
+	~PairLookupTable() {
+		if (mapped)
+			return;
+		if (pair_start)
+			free(pair_start);
+		if (pair_end)
+			free(pair_end);
+		if (offsets)
+			free(offsets);
+	}
+};
+
 // make a lookup table from a buffer
-void PairLookupTable::AddBuffer(const char *b, size_t s)
+template<typename Index> void PairLookupTable<Index>::AddBuffer(const char *b, size_t s)
 {
-	// index counts
-	size_t pair_intsize = sizeof(unsigned int) * NUM_PAIRS;
+	data = (const unsigned char*)b;
+	data_size = s;
+	offset_bytes = s<=SMALL_BUFFER ? 3 : ((unsigned long long)s<=0xffffffffULL ? 4 : 5);
 
-	pair_counts = (unsigned int*)malloc(pair_intsize);
-	offset_start = (unsigned int*)malloc(pair_intsize);
-	memset(pair_counts, 0, sizeof(unsigned int) * NUM_PAIRS);
-	size_t num_pairs = s-1;
-	unsigned const char *r = (unsigned const char*)b;
+	// count each pair, pairs that only occur once are never matched
+	pair_start = (Index*)calloc(NUM_PAIRS+1, sizeof(Index));
+	size_t num_pairs = s>1 ? s-1 : 0;
+	unsigned const char *r = data;
 	for (size_t p=num_pairs; p; --p) {
 		unsigned int pair = r[0]<<8 | r[1];
-		pair_counts[pair]++;
+		pair_start[pair]++;
 		r++;
 	}
-
-	unsigned int curr_start = 0, sum_pairs_gt1 = 0;
+	Index curr_start = 0;
 	for (unsigned int p=0; p<NUM_PAIRS; p++) {
-		if (pair_counts[p]>1) {
-			offset_start[p] = curr_start;
-			curr_start += pair_counts[p];
-			sum_pairs_gt1 += pair_counts[p];
-			pair_counts[p] = 0; // clear pair_counts and start over to fill out cache buffer
-		} else
-			offset_start[p] = 0xffffffff;
+		Index count = pair_start[p];
+		pair_start[p] = curr_start;
+		if (count>1)
+			curr_start += count;
 	}
+	pair_start[NUM_PAIRS] = curr_start;
 
-	// allocate a buffer to hold integer offsets
-	offset_arrays = (unsigned int*)malloc(sizeof(unsigned int) * sum_pairs_gt1);
-	r = (unsigned const char*)b;
-	for (size_t o=0; o<num_pairs; o++) {
-		unsigned int pair = r[0]<<8 | r[1];
-		if (offset_start[pair]!=0xffffffff)
-			offset_arrays[offset_start[pair]+pair_counts[pair]] = (unsigned int)o;
-		pair_counts[pair]++;
-		r++;
+	// allocate a buffer to hold the offsets
+	offsets = (unsigned char*)malloc(curr_start ? size_t(curr_start) * offset_bytes : 1);
+	pair_end = (Index*)malloc(sizeof(Index) * NUM_PAIRS);
+	memcpy(pair_end, pair_start, sizeof(Index) * NUM_PAIRS);
+	if (!grow) {
+		AddUntil(data_size);
+		free(pair_end);
+		pair_end = nullptr;
 	}
 }
 
-int PairLookupTable::Match(const char *match, size_t match_left,
+// add the pairs starting before offset to the table
+template<typename Index> void PairLookupTable<Index>::AddUntil(size_t offset)
+{
+	if (offset+1>data_size)
+		offset = data_size ? data_size-1 : 0;
+	for (; added<offset; added++) {
+		unsigned int pair = data[added]<<8 | data[added+1];
+		if (pair_start[pair+1]>pair_start[pair])
+			SetOffset(pair_end[pair]++, added);
+	}
+}
+
+// remove the latest pairs first so each pair ends where it was at offset
+template<typename Index> void PairLookupTable<Index>::Rewind(size_t offset)
+{
+	if (!grow)
+		return;
+	while (added>offset) {
+		added--;
+		unsigned int pair = data[added]<<8 | data[added+1];
+		if (pair_start[pair+1]>pair_start[pair])
+			pair_end[pair]--;
+	}
+}
+
+// the pair starts followed by the offsets, only a complete table is saved
+template<typename Index> bool PairLookupTable<Index>::Save(FILE *f) const
+{
+	if (grow)
+		return false;
+	size_t offsets_size = size_t(pair_start[NUM_PAIRS]) * offset_bytes;
+	return fwrite(pair_start, sizeof(Index) * (NUM_PAIRS+1), 1, f)==1 &&
+		(!offsets_size || fwrite(offsets, offsets_size, 1, f)==1);
+}
+
+// check that a saved table has the size that the pair starts add up to
+template<typename Index> bool PairLookupTable<Index>::Valid(size_t s, const char *index, size_t index_size)
+{
+	size_t starts_size = sizeof(Index) * (NUM_PAIRS+1);
+	if (index_size<starts_size)
+		return false;
+	Index count = ((const Index*)index)[NUM_PAIRS];
+	int bytes = s<=SMALL_BUFFER ? 3 : ((unsigned long long)s<=0xffffffffULL ? 4 : 5);
+	return count<=s && index_size==starts_size + size_t(count) * bytes;
+}
+
+template<typename Index> long long PairLookupTable<Index>::Match(const char *match, size_t match_left,
 	const char *buffer, size_t buffer_size, size_t buffer_exp,
-	int curr_offset, int &offs, int &size)
+	long long curr_offset, size_t, long long &offs, long long &size)
 {
-	int value = -1;
-	size_t count = 0;
+	long long value = -1;
 	if (match_left<2)
 		return value;
-	if (unsigned int *l = GetPairs(match, count)) {
-		for (size_t pair=0; pair<count; pair++) {
-			const char* start = buffer + *l++;
-			if (buffer<=match && start>=match)
-				break; // same buffer as match but not caught up
-			size_t left = (buffer+buffer_size+buffer_exp)-start;
-			if (left>match_left)
-				left = match_left;
-			int len = 0;
-			const char *a = match;
-			const char *b = start;
-			for (size_t c=0; c<left; c++) {
-				if (*a++!=*b++)
-					break;
-				len++;
-			}
-			int offset = int(start-buffer-curr_offset);
-			if (len>E8_MIN_TRG_SRC_LEN) {
-				// note: weight on offset since we probably need to swap
-				// back to this point which might not have been necessary
-				int instr_size = 1 + 1 + 1; // instruction src/trg + sign + src/trg
-				// estimate bits per size and actual bits of offset plus half cost of returning pointer
-				instr_size += E8_SIZE_BITS + 3*GetNumBits(offset)/2;
-				// estimate bits per size and actual bits of length
-				instr_size += E8_SIZE_BITS + GetNumBits(len-1);
-				// bits accounted for minus bits needed for this instruction
-				int saving = len*8 - instr_size;
-				if (saving>value) {
-					value = saving;
-					offs = offset;
-					size = len;
-				}
+	const unsigned char *m = (const unsigned char*)match;
+	if (grow && m>=data && m<(data+data_size))
+		AddUntil(m-data);
+	unsigned int pair = m[0]<<8 | m[1];
+	size_t first = pair_start[pair];
+	size_t last = pair_end ? pair_end[pair] : pair_start[pair+1];
+	// offsets are in order, skip to the first one in reach
+	size_t from = ReachFrom(curr_offset), to = ReachTo(curr_offset, buffer_size+buffer_exp);
+	if (from) {
+		size_t hi = last;
+		while (first<hi) {
+			size_t mid = first + (hi-first)/2;
+			if (GetOffset(mid)<from)
+				first = mid+1;
+			else
+				hi = mid;
+		}
+	}
+	size_t index = first;
+	for (; index<last; index++) {
+		size_t at = GetOffset(index);
+		if (at>=to)
+			break;
+		const char* start = buffer + at;
+		if (buffer<=match && start>=match)
+			break; // same buffer as match but not caught up
+		size_t left = (buffer+buffer_size+buffer_exp)-start;
+		if (left>match_left)
+			left = match_left;
+		long long len = (long long)MatchLength(match, start, left);
+		long long offset = (long long)(start-buffer)-curr_offset;
+		if (len>E8_MIN_TRG_SRC_LEN) {
+			long long saving = MatchSaving(offset, len);
+			if (saving>value) {
+				value = saving;
+				offs = offset;
+				size = len;
 			}
 		}
 	}
+	if (counter)
+		counter->Add(index-first);
 	return value;
 }
-#else
+
 // Find the best string match starting at match within buffer
 // buffer_exp is how much the buffer can grow along with match
 // (is of the same buffer as match)
-int MatchString(const char *match, size_t match_left,
-				const char *buffer, size_t buffer_size, size_t buffer_exp,
-				int curr_offset, int &offs, int &size)
+// (visited is increased by the number of positions compared if set)
+long long MatchString(const char *match, size_t match_left,
+					  const char *buffer, size_t buffer_size, size_t buffer_exp,
+					  long long curr_offset, long long &offs, long long &size, long long *visited = nullptr,
+					  size_t from = 0, size_t to = ~size_t(0))
 {
-	int value = -1;
+	long long value = -1;
 	char first = *match;
-	for (size_t src_offs = 0; src_offs<buffer_size; src_offs++) {
+	for (size_t src_offs = from; src_offs<buffer_size && src_offs<to; src_offs++) {
 		if (buffer[src_offs] == first) {
+			if (visited)
+				++*visited;
 			size_t src_left = buffer_size + buffer_exp - src_offs;
-			const char *chk = buffer + src_offs;
-			const char *trg = match;
-			int len = 1;
 			size_t left = match_left<src_left ? match_left : src_left;
-			for (size_t src_chk = left-1; src_chk; --src_chk) {
-				if (*++chk!=*++trg)
-					break;
-				len++;
-			}
-			int offset = int(src_offs-curr_offset);
+			long long len = (long long)MatchLength(match, buffer + src_offs, left);
+			long long offset = (long long)src_offs-curr_offset;
 			if (len>E8_MIN_TRG_SRC_LEN) {
-				// note: weight on offset since we probably need to swap
-				// back to this point which might not have been necessary
-				int instr_size = 1 + 1 + 1; // instruction src/trg + sign + src/trg
-				// estimate bits per size and actual bits of offset plus half cost of returning pointer
-				instr_size += E8_SIZE_BITS + 3*GetNumBits(offset)/2;
-				// estimate bits per size and actual bits of length
-				instr_size += E8_SIZE_BITS + GetNumBits(len-1);
-				// bits accounted for minus bits needed for this instruction
-				int saving = len*8 - instr_size;
+				long long saving = MatchSaving(offset, len);
 				if (saving>value) {
 					value = saving;
 					offs = offset;
@@ -274,576 +758,6731 @@ int MatchString(const char *match, size_t match_left,
 	}
 	return value;
 }
-#endif
-
-// Encoder data
-struct Encoder {
-	enum EncType {
-		LENGTH,
-		OFFSET,
-		TYPES
-	};
-
-	enum E8Instr {
-		E8I_INJ,
-		E8I_SRC,
-		E8I_TRG,
-		E8I_END
-	};
 
-	int bitCounts[TYPES][32];
-	int count[TYPES];
-	int instr[E8I_END];
-	int inject_size;
-	int bitSizesCount[TYPES]; // how many bits per size lookup
-	char besti2b[TYPES][1<<EB_SIZE_BITS_MAX]; // lookup bit size
-
-	char *instructions;
-	char *inject;
-	int *values;
-
-	char *result;
-	size_t result_size;
-
-	Encoder() : instructions(nullptr), inject(nullptr),
-				values(nullptr), inject_size(0),
-				result(nullptr), result_size(0)
-	{
-		for (int t=0; t<TYPES; t++) {
-			count[t] = 0;
-			for (int b=0; b<32; b++)
-				bitCounts[t][b] = 0;
-		}
-		for (int i=0; i<E8I_END; i++)
-			instr[i] = 0;
+// Brute force search without a lookup table (slow but no extra memory)
+struct StringMatcher : public MatchFinder {
+	long long Match(const char *match, size_t match_left,
+					const char *buffer, size_t buffer_size, size_t buffer_exp,
+					long long curr_offset, size_t, long long &offs, long long &size) {
+		size_t from = ReachFrom(curr_offset), to = ReachTo(curr_offset, buffer_size);
+		if (!counter)
+			return MatchString(match, match_left, buffer, buffer_size,
+							   buffer_exp, curr_offset, offs, size, nullptr, from, to);
+		long long visited = 0;
+		long long value = MatchString(match, match_left, buffer, buffer_size,
+									  buffer_exp, curr_offset, offs, size, &visited, from, to);
+		counter->Add(visited);
+		return value;
 	}
+};
 
-	~Encoder() { Reset(); }
+// Suffix array with longest common prefix array for finding matches
+// in O(log n) + the number of neighbours visited in sorted order.
+// (uses (buffer size) * 12 bytes, and * 16 bytes while building,
+//  twice that with a 64 bit Index for buffers above 4 gb)
+template<typename Index> struct SuffixArrayLookup : public MatchFinder {
+	enum { MAX_STEPS = 256 };		// max suffixes visited in each direction
+	const unsigned char *data;
+	size_t data_size;
+	Index *suffixes;				// buffer offsets in sorted order
+	Index *ranks;					// sorted index of each buffer offset
+	Index *lcp;						// common prefix length of suffix and previous suffix
+	bool mapped;					// arrays are in a cache file, not allocated
 
-	void Reset() {
-		if (instructions)
-			free(instructions);
-		instructions = nullptr;
-		if (inject)
-			free(inject);
-		inject = nullptr;
-		if (values)
-			free(values);
-		values = nullptr;
-		if (result)
-			free(result);
-		result = nullptr;
-		inject_size = 0;
-		result_size = 0;
+	void AddBuffer(const char *b, size_t s);
+	bool Save(FILE *f) const {
+		return !data_size || (fwrite(suffixes, sizeof(Index) * data_size, 1, f)==1 &&
+			fwrite(ranks, sizeof(Index) * data_size, 1, f)==1 &&
+			fwrite(lcp, sizeof(Index) * data_size, 1, f)==1);
 	}
+	static bool Valid(size_t s, const char *, size_t index_size) {
+		return index_size==sizeof(Index) * 3 * s;
+	}
+	size_t Common(const unsigned char *match, size_t match_left, size_t offset, size_t skip);
+	size_t Find(const unsigned char *match, size_t match_left, size_t &lcp_found);
+	int Walk(size_t rank, int dir, size_t common, size_t before, const char *buffer,
+			 long long curr_offset, long long &value, long long &offs, long long &size);
+	long long Match(const char *match, size_t match_left,
+					const char *buffer, size_t buffer_size, size_t buffer_exp,
+					long long curr_offset, size_t skipped, long long &offs, long long &size);
 
-	void Build(const char *source, size_t source_size, const char *target, size_t target_size);
-	void Optimize();
-	void Generate();
+	SuffixArrayLookup(const char *b, size_t s) : data(nullptr), data_size(0),
+		suffixes(nullptr), ranks(nullptr), lcp(nullptr), mapped(false) { AddBuffer(b, s); }
+	// use arrays saved by Save (checked by Valid)
+	SuffixArrayLookup(const char *b, size_t s, const char *index) : data((const unsigned char*)b),
+		data_size(s), suffixes((Index*)index), ranks((Index*)index + s), lcp((Index*)index + 2*s),
+		mapped(true) {}
+	~SuffixArrayLookup() {
+		if (mapped)
+			return;
+		if (suffixes)
+			free(suffixes);
+		if (ranks)
+			free(ranks);
+		if (lcp)
+			free(lcp);
+	}
 };
 
-void Encoder::Build(const char *source, size_t source_size, const char *target, size_t target_size)
+// sort all suffixes by prefix doubling with a radix sort for each pass
+// and then generate the longest common prefix array (Kasai et al.)
+template<typename Index> void SuffixArrayLookup<Index>::AddBuffer(const char *b, size_t s)
 {
-	inject = (char*)malloc(target_size);
-	values = (int*)malloc(sizeof(int) * target_size * 3 / 2);
-	instructions = (char*)malloc(target_size);
-	char *next_inj = inject;
-	int *next_offs = values;
-	char *next_instr = instructions;
-	size_t inject_count = 0;
-	size_t cursor = 0;
-	int src_offs_prev = 0;
-	int trg_offs_prev = 0;
+	data = (const unsigned char*)b;
+	data_size = s;
+	if (!s)
+		return;
 
-#ifdef USE_BUFFER_ACCELERATOR
-	// lookup tables for the buffers
-	PairLookupTable srcLookup(source, source_size);
-	PairLookupTable trgLookup(target, target_size);
-#endif
+	Index n = (Index)s;
+	suffixes = (Index*)malloc(sizeof(Index) * n);
+	ranks = (Index*)malloc(sizeof(Index) * n);
+	lcp = (Index*)malloc(sizeof(Index) * n);
+	Index *temp = (Index*)malloc(sizeof(Index) * n);
+	Index num_counts = n>256 ? n : 256;
+	Index *counts = (Index*)calloc(num_counts, sizeof(Index));
 
-	// first find patterns
-	while (cursor < target_size) {
-		int src_offs, trg_offs;
-		int src_size, trg_size;
-#ifdef USE_BUFFER_ACCELERATOR
-		int save_src = srcLookup.Match(target+cursor, target_size-cursor, source, source_size,
-						0, src_offs_prev, src_offs, src_size);
-		int save_trg = trgLookup.Match(target+cursor, target_size-cursor, target, cursor,
-						target_size-cursor, trg_offs_prev, trg_offs, trg_size);
-#else
-		int save_src = MatchString(target+cursor, target_size-cursor, source, source_size,
-								   0, src_offs_prev, src_offs, src_size);
-		int save_trg = MatchString(target+cursor, target_size-cursor, target, cursor,
-								   target_size-cursor, trg_offs_prev, trg_offs, trg_size);
-#endif
-		int save = save_src > save_trg ? save_src : save_trg;
-		// if no match then push byte to inject buffer
-		if (save<=0 || (save<8 && inject_count)) {
-			inject_count++;
-			cursor++;
-		} else {
-			// add skipped bytes into injection table
-			if (inject_count) {
-				const char *read = target+cursor-inject_count;
-				for (size_t i=0; i<inject_count; i++)
-					*next_inj++ = *read++;
-				*next_instr++ = E8I_INJ;
-				instr[E8I_INJ]++;
-				bitCounts[LENGTH][GetNumBits((int)inject_count)]++;
-				count[LENGTH]++;
-				*next_offs++ = (int)inject_count;
-				inject_count = 0;
-			}
-			// copy bytes from source or target window
-			if (save_src>save_trg) {
-				*next_instr++ = E8I_SRC;
-				instr[E8I_SRC]++;
-				bitCounts[LENGTH][GetNumBits(src_size)]++;
-				count[LENGTH]++;
-				*next_offs++ = src_size;
-				bitCounts[OFFSET][GetNumBits(src_offs)]++;
-				count[OFFSET]++;
-				*next_offs++ = src_offs;
-				cursor += src_size;
-				src_offs_prev += src_offs + src_size;
-			} else {
-				*next_instr++ = E8I_TRG;
-				instr[E8I_TRG]++;
-				bitCounts[LENGTH][GetNumBits(trg_size)]++;
-				count[LENGTH]++;
-				*next_offs++ = trg_size;
-				bitCounts[OFFSET][GetNumBits(trg_offs)]++;
-				count[OFFSET]++;
-				*next_offs++ = trg_offs;
-				cursor += trg_size;
-				trg_offs_prev += trg_offs + trg_size;
-			}
+	// initial order by first byte
+	for (Index i=0; i<n; i++)
+		counts[data[i]]++;
+	for (Index c=1; c<256; c++)
+		counts[c] += counts[c-1];
+	for (Index i=n; i; --i)
+		suffixes[--counts[data[i-1]]] = i-1;
+	for (Index i=0; i<n; i++)
+		ranks[i] = data[i];
+	Index classes = 256;
+
+	for (Index k=1; k<n; k<<=1) {
+		// order by second half, suffixes shorter than k sort first
+		Index p = 0;
+		for (Index i=n-k; i<n; i++)
+			temp[p++] = i;
+		for (Index i=0; i<n; i++) {
+			if (suffixes[i]>=k)
+				temp[p++] = suffixes[i]-k;
 		}
+		// stable sort by first half
+		memset(counts, 0, sizeof(Index) * classes);
+		for (Index i=0; i<n; i++)
+			counts[ranks[i]]++;
+		for (Index c=1; c<classes; c++)
+			counts[c] += counts[c-1];
+		for (Index i=n; i; --i)
+			suffixes[--counts[ranks[temp[i-1]]]] = temp[i-1];
+		// assign new ranks
+		temp[suffixes[0]] = 0;
+		classes = 1;
+		for (Index i=1; i<n; i++) {
+			Index a = suffixes[i-1], c = suffixes[i];
+			bool same = ranks[a]==ranks[c] && (a+k<n) && (c+k<n) &&
+						ranks[a+k]==ranks[c+k];
+			temp[c] = same ? classes-1 : classes++;
+		}
+		Index *swap = ranks;
+		ranks = temp;
+		temp = swap;
+		if (classes==n)
+			break;
 	}
-	// add trailing injection bytes
-	if (inject_count) {
-		const char *read = target+cursor-inject_count;
-		for (size_t i=0; i<inject_count; i++)
-			*next_inj++ = *read++;
-		*next_instr++ = E8I_INJ;
-		instr[E8I_INJ]++;
-		bitCounts[LENGTH][GetNumBits((int)inject_count)]++;
-		count[LENGTH]++;
-		*next_offs++ = (int)inject_count;
+	if (n==1)
+		ranks[0] = 0;
+	free(counts);
+	free(temp);
+
+	// longest common prefix between each suffix and the previous suffix in order
+	Index h = 0;
+	lcp[0] = 0;
+	for (Index i=0; i<n; i++) {
+		if (ranks[i]) {
+			Index j = suffixes[ranks[i]-1];
+			while (i+h<n && j+h<n && data[i+h]==data[j+h])
+				h++;
+			lcp[ranks[i]] = h;
+			if (h)
+				h--;
+		} else
+			h = 0;
 	}
-	inject_size = (int)(next_inj - inject);
 }
 
-void Encoder::Optimize()
+// number of matching bytes between match and the suffix at offset, skipping known bytes
+template<typename Index> size_t SuffixArrayLookup<Index>::Common(const unsigned char *match, size_t match_left, size_t offset, size_t skip)
 {
-	// check stats
-	int total[TYPES];
+	size_t left = data_size-offset;
+	if (left>match_left)
+		left = match_left;
+	if (skip>=left)
+		return left;
+	const unsigned char *d = data + offset;
+	return skip + MatchLength((const char*)match+skip, (const char*)d+skip, left-skip);
+}
+
+// binary search for the first suffix that is not less than match
+template<typename Index> size_t SuffixArrayLookup<Index>::Find(const unsigned char *match, size_t match_left, size_t &lcp_found)
+{
+	size_t lo = 0, hi = data_size;
+	size_t lo_common = 0, hi_common = 0;
+	while (lo<hi) {
+		size_t mid = (lo+hi)>>1;
+		size_t offset = suffixes[mid];
+		// all suffixes between lo and hi share the smaller prefix
+		size_t skip = lo_common<hi_common ? lo_common : hi_common;
+		size_t c = Common(match, match_left, offset, skip);
+		bool less;	// suffix is less than match
+		if (c==match_left)
+			less = false;
+		else if (c==data_size-offset)
+			less = true;
+		else
+			less = data[offset+c]<match[c];
+		if (less) {
+			lo = mid+1;
+			lo_common = c;
+		} else {
+			hi = mid;
+			hi_common = c;
+		}
+	}
+	lcp_found = hi_common;
+	return lo;
+}
+
+// visit suffixes in one direction of sorted order while a better match is possible
+// returns the number of suffixes visited
+template<typename Index> int SuffixArrayLookup<Index>::Walk(size_t rank, int dir, size_t common,
+	size_t before, const char *, long long curr_offset, long long &value, long long &offs, long long &size)
+{
+	for (int step=0; step<MAX_STEPS; step++) {
+		if (common<=E8_MIN_TRG_SRC_LEN || MatchSaving(0, (long long)common)<=value)
+			return step;	// shorter from here on, no better match is possible
+		size_t offset = suffixes[rank];
+		if (offset<before && Reach((long long)offset-curr_offset)) {
+			long long off = (long long)offset-curr_offset;
+			long long saving = MatchSaving(off, (long long)common);
+			if (saving>value) {
+				value = saving;
+				offs = off;
+				size = (long long)common;
+			}
+		}
+		if (dir>0) {
+			if (++rank>=data_size)
+				return step+1;
+			if (lcp[rank]<common)
+				common = lcp[rank];
+		} else {
+			if (!rank)
+				return step+1;
+			if (lcp[rank]<common)
+				common = lcp[rank];
+			--rank;
+		}
+	}
+	return MAX_STEPS;
+}
+
+template<typename Index> long long SuffixArrayLookup<Index>::Match(const char *match, size_t match_left,
+	const char *buffer, size_t, size_t,
+	long long curr_offset, size_t, long long &offs, long long &size)
+{
+	long long value = -1;
+	if (!data_size || match_left<=E8_MIN_TRG_SRC_LEN)
+		return value;
+	const unsigned char *m = (const unsigned char*)match;
+	int visited = 0;
+	if (m>=data && m<(data+data_size)) {
+		// same buffer as match, only earlier suffixes can be used
+		size_t cursor = m-data;
+		size_t rank = ranks[cursor];
+		if (rank+1<data_size)
+			visited += Walk(rank+1, 1, lcp[rank+1], cursor, buffer, curr_offset, value, offs, size);
+		if (rank)
+			visited += Walk(rank-1, -1, lcp[rank], cursor, buffer, curr_offset, value, offs, size);
+	} else {
+		size_t common;
+		size_t rank = Find(m, match_left, common);
+		if (rank<data_size)
+			visited += Walk(rank, 1, common, data_size, buffer, curr_offset, value, offs, size);
+		if (rank) {
+			common = Common(m, match_left, suffixes[rank-1], 0);
+			visited += Walk(rank-1, -1, common, data_size, buffer, curr_offset, value, offs, size);
+		}
+	}
+	if (counter)
+		counter->Add(visited);
+	return value;
+}
+
+// Accelerator for finding strings by hashing the first bytes and following
+// a chain of earlier offsets with the same hash. The number of candidates
+// is bounded by the level so the search time is predictable.
+// A buffer that doesn't grow is sorted by hash and offset instead so the
+// search starts at the pointer and walks out to either side, a growing
+// buffer is chained from the most recent offset as the cursor moves.
+// (uses 256 kb + (file size) * 4, twice that with a 64 bit Index for
+//  files above 4 gb)
+template<typename Index> struct HashChainLookup : public MatchFinder {
+	enum {
+		HASH_BITS = 16,
+		HASH_SIZE = 1<<HASH_BITS,
+		HASH_BYTES = E8_MIN_TRG_SRC_LEN+1	// shortest useful match
+	};
+	static const Index NO_OFFSET = Index(~Index(0));
+	const unsigned char *data;
+	size_t data_size;
+	size_t added;				// offsets before this are in the chains
+	Index *head;				// most recent offset for each hash, or first sorted offset (HASH_SIZE+1)
+	Index *chain;				// previous offset with the same hash, or offsets sorted by hash
+	ChainLevel limits;
+	bool grow;
+
+	static unsigned int Hash(const unsigned char *b) {
+		return ((b[0]<<16 | b[1]<<8 | b[2]) * 2654435761U) >> (32-HASH_BITS);
+	}
+	size_t Hashed() const { return data_size>=HASH_BYTES ? data_size-HASH_BYTES+1 : 0; }
+	void AddUntil(size_t offset);
+	void Rewind(size_t offset);
+	void Sort();
+	bool Shared() const { return !grow; }
+	long long Check(size_t o, const unsigned char *m, size_t match_left, const unsigned char *end,
+					long long curr_offset, bool jump, long long &rank,
+					long long &value, long long &offs, long long &size);
+	long long Match(const char *match, size_t match_left,
+					const char *buffer, size_t buffer_size, size_t buffer_exp,
+					long long curr_offset, size_t skipped, long long &offs, long long &size);
+
+	HashChainLookup(const char *b, size_t s, int level, bool g) : data((const unsigned char*)b),
+		data_size(s), added(0), limits(aChainLevels[level-1]), grow(g) {
+		head = (Index*)malloc(sizeof(Index) * (HASH_SIZE+1));
+		memset(head, 0xff, sizeof(Index) * (HASH_SIZE+1));
+		chain = s ? (Index*)malloc(sizeof(Index) * s) : nullptr;
+		if (!grow)
+			Sort();
+	}
+	~HashChainLookup() {
+		free(head);
+		if (chain)
+			free(chain);
+	}
+};
+
+// link offsets up to (not including) offset into the hash chains
+template<typename Index> void HashChainLookup<Index>::AddUntil(size_t offset)
+{
+	if (offset>Hashed())
+		offset = Hashed();
+	for (; added<offset; added++) {
+		unsigned int hash = Hash(data+added);
+		chain[added] = head[hash];
+		head[hash] = (Index)added;
+	}
+}
+
+// unlink the latest offsets first, each was the head of its chain when added
+template<typename Index> void HashChainLookup<Index>::Rewind(size_t offset)
+{
+	if (!grow)
+		return;
+	while (added>offset) {
+		added--;
+		head[Hash(data+added)] = chain[added];
+	}
+}
+
+// count the offsets of each hash and place them in order of hash then offset
+template<typename Index> void HashChainLookup<Index>::Sort()
+{
+	size_t hashed = Hashed();
+	memset(head, 0, sizeof(Index) * (HASH_SIZE+1));
+	for (size_t o = 0; o<hashed; o++)
+		head[Hash(data+o)+1]++;
+	for (size_t h = 0; h<HASH_SIZE; h++)
+		head[h+1] += head[h];
+	for (size_t o = 0; o<hashed; o++)
+		chain[head[Hash(data+o)]++] = (Index)o;
+	// placing moved each start to the next hash
+	for (size_t h = HASH_SIZE; h; h--)
+		head[h] = head[h-1];
+	head[0] = 0;
+	added = hashed;
+}
+
+// compare one candidate offset and keep it if it saves the most, a jump
+// away from the pointer also pays the other half of returning it so a
+// deeper search doesn't trade a continuous copy for a slightly longer one
+// elsewhere. Returns the match length.
+template<typename Index> long long HashChainLookup<Index>::Check(size_t o,
+	const unsigned char *m, size_t match_left, const unsigned char *end,
+	long long curr_offset, bool jump, long long &rank,
+	long long &value, long long &offs, long long &size)
+{
+	const unsigned char *start = data + o;
+	size_t left = end-start;
+	if (left>match_left)
+		left = match_left;
+	long long len = (long long)MatchLength((const char*)start, (const char*)m, left);
+	if (len>E8_MIN_TRG_SRC_LEN) {
+		long long offset = (long long)o-curr_offset;
+		long long saving = MatchSaving(offset, len);
+		long long ranked = jump && value>=0 ? saving - GetNumBits(offset)/2 : saving;
+		if (ranked>rank) {
+			rank = ranked;
+			value = saving;
+			offs = offset;
+			size = len;
+		}
+	}
+	return len;
+}
+
+template<typename Index> long long HashChainLookup<Index>::Match(const char *match, size_t match_left,
+	const char *buffer, size_t buffer_size, size_t buffer_exp,
+	long long curr_offset, size_t skipped, long long &offs, long long &size)
+{
+	long long value = -1;
+	if (match_left<HASH_BYTES)
+		return value;
+	const unsigned char *m = (const unsigned char*)match;
+	// same buffer as match only has earlier offsets, otherwise use the whole buffer
+	if (grow)
+		AddUntil((m>=data && m<(data+data_size)) ? size_t(m-data) : data_size);
+
+	const unsigned char *end = (const unsigned char*)buffer+buffer_size+buffer_exp;
+	size_t from = ReachFrom(curr_offset), to = ReachTo(curr_offset, buffer_size);
+	long long best_len = 0, rank = -1;
+	int chain_left = limits.max_chain;
+	int visited = 0;
+	// check the pointer and the offset lined up with the previous copy from
+	// this buffer before the hashes, changes between files usually leave the
+	// rest in place
+	long long aligned = curr_offset + (long long)skipped;
+	for (int a = 0; a<(skipped ? 2 : 1); a++) {
+		long long o = a ? curr_offset : aligned;
+		if (o>=0 && size_t(o)>=from && size_t(o)<to) {
+			visited++;
+			long long len = Check(size_t(o), m, match_left, end, curr_offset, false, rank, value, offs, size);
+			if (len>best_len)
+				best_len = len;
+		}
+	}
+	if (best_len>=limits.nice_length) {
+		if (counter)
+			counter->Add(visited);
+		return value;
+	}
+	unsigned int hash = Hash(m);
+	if (grow) {
+		// chains go from later to earlier offsets, stop when out of reach
+		for (Index o = head[hash]; o!=NO_OFFSET && chain_left; o = chain[o], --chain_left) {
+			if (size_t(o)<from)
+				break;
+			visited++;
+			if (size_t(o)>=to || (long long)o==aligned || (long long)o==curr_offset)
+				continue;
+			long long len = Check(size_t(o), m, match_left, end, curr_offset, true, rank, value, offs, size);
+			if (len>best_len) {
+				best_len = len;
+				if (len>=limits.nice_length)
+					break;
+				if (len>=limits.good_length && chain_left>4)
+					chain_left >>= 2;
+			}
+		}
+	} else {
+		// find the aligned offset among the sorted offsets of the hash and
+		// take the nearest remaining one on either side until out of reach
+		size_t first = head[hash], last = head[hash+1];
+		size_t center = aligned<0 ? 0 : size_t(aligned);
+		size_t lo = first, hi = last;
+		while (lo<hi) {
+			size_t mid = lo + (hi-lo)/2;
+			if (size_t(chain[mid])<center)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		size_t down = lo, up = lo;	// next candidates are chain[down-1] and chain[up]
+		for (; chain_left; --chain_left) {
+			bool below = down>first && size_t(chain[down-1])>=from;
+			bool above = up<last && size_t(chain[up])<to;
+			if (!below && !above)
+				break;
+			size_t o;
+			if (below && (!above || center-size_t(chain[down-1])<=size_t(chain[up])-center))
+				o = chain[--down];
+			else
+				o = chain[up++];
+			visited++;
+			if ((long long)o==aligned || (long long)o==curr_offset)
+				continue;
+			long long len = Check(o, m, match_left, end, curr_offset, true, rank, value, offs, size);
+			if (len>best_len) {
+				best_len = len;
+				if (len>=limits.nice_length)
+					break;
+				if (len>=limits.good_length && chain_left>4)
+					chain_left >>= 2;
+			}
+		}
+	}
+	if (counter)
+		counter->Add(visited);
+	return value;
+}
+
+// Create the lookup for a buffer with the selected method,
+// grow is set for the target buffer which is added to as it is parsed
+// (tables hold 32 bit offsets unless the buffer is above 4 gb)
+MatchFinder* CreateMatchFinder(MatchEngine engine, int level, const char *buffer, size_t size, bool grow)
+{
+	if ((unsigned long long)size>0xffffffffULL) {
+		switch (engine) {
+			case ENGINE_PAIRS: return new PairLookupTable<unsigned long long>(buffer, size, grow);
+			case ENGINE_SUFFIX: return new SuffixArrayLookup<unsigned long long>(buffer, size);
+			case ENGINE_CHAIN: return new HashChainLookup<unsigned long long>(buffer, size, level, grow);
+			default: return new StringMatcher;
+		}
+	}
+	switch (engine) {
+		case ENGINE_PAIRS: return new PairLookupTable<unsigned int>(buffer, size, grow);
+		case ENGINE_SUFFIX: return new SuffixArrayLookup<unsigned int>(buffer, size);
+		case ENGINE_CHAIN: return new HashChainLookup<unsigned int>(buffer, size, level, grow);
+		default: return new StringMatcher;
+	}
+}
+
+// Matches found ahead of the parse at one target position
+// for the source (0) and target (1) buffers
+// (matches too far apart for 32 bits are left to the parse)
+struct MatchAhead {
+	int prev[2];			// buffer pointer the match was found for
+	unsigned int skipped[2];
+	int offs[2];
+	int size[2];			// 0 if not searched, -1 if nothing found
+
+	bool Same(int b, long long p, size_t s) const {
+		return size[b] && prev[b]==p && skipped[b]==s;
+	}
+	long long Get(int b, long long &o, long long &l) const {
+		if (size[b]<0)
+			return -1;
+		o = offs[b];
+		l = size[b];
+		return MatchSaving(o, l);
+	}
+	void Set(int b, long long p, size_t s, long long save, long long o, long long l) {
+		if (p!=int(p) || s!=(unsigned int)s || (save>=0 && (o!=int(o) || l!=int(l)))) {
+			size[b] = 0;
+			return;
+		}
+		prev[b] = (int)p;
+		skipped[b] = (unsigned int)s;
+		offs[b] = (int)o;
+		size[b] = save<0 ? -1 : (int)l;
+	}
+};
+
+// Decode cycles of the bundled decoders, the 6502 model is fitted to
+// -emulate runs and the Z80 and 68000 models are counted from the source
+struct CycleModel {
+	const char *cpu;
+	int setup;		// reading the header
+	int bit;		// per bit of the instruction stream
+	int inject;		// per inject instruction besides its bits and bytes
+	int copy;		// per copy instruction besides its bits and bytes
+	int byte;		// per byte written
+};
+
+const CycleModel aCycleModels[] = {
+	{ "6502", 240, 25, 142, 201, 18 },
+	{ "z80", 400, 50, 300, 480, 21 },
+	{ "68k", 200, 40, 150, 260, 22 },
+	{ nullptr, 0, 0, 0, 0, 0 }
+};
+
+// What the bundled decoders can address, selected with -limits. The 6502
+// and Z80 decoders use 16 bit pointers, lengths and inject size (the 6502
+// page copy stops at lengths from $8100). The 68000 decoder adds offsets
+// as sign extended words and counts copies with dbne. Only the 6502 decoder
+// reads the delta format, and it needs at least one bit for the bucket index
+// (it reads 256 bits for a 0 bit field).
+struct AddressWindow {
+	const char *name;
+	unsigned long long memory;		// source, target and patch together (0 = no limit)
+	long long max_length;			// longest copy or inject instruction
+	long long min_offset;			// copy offsets the decoder can add to a buffer pointer
+	long long max_offset;
+	unsigned long long max_inject;	// injected bytes in the patch
+	bool delta;						// delta copies
+	bool backward;					// in place patches decoded from the end
+	int index_bits;					// fewest bits of a length or offset bucket index
+};
+
+const AddressWindow aAddressWindows[] = {	// same order as the emulated cpus (EmuCpu)
+	{ "6502-64k", 0x10000, 0x7fff, -0xffff, 0xffff, 0x7fff, true, true, 1 },
+	{ "z80-64k", 0x10000, 0xffff, -0xffff, 0xffff, 0x7fff, false, false, 0 },
+	{ "68k-flat", 0, 0xffff, -0x8000, 0x7fff, 0x7fffffff, false, false, 0 },
+	{ nullptr, 0, 0, 0, 0, 0, false, false, 0 }
+};
+
+#define E8_CYCLE_WEIGHT 0.0625	// default bits of patch one decode cycle is worth
+
+// Aggregate statistics of a patch, filled in by Encoder::Generate as the
+// bits are written (or read back from a patch) and saved as json
+struct PatchStats {
+	enum Field {
+		INSTR,				// inject or copy bit of each instruction and the end
+		LEN_BUCKET,
+		LEN_VALUE,
+		OFF_BUCKET,
+		OFF_VALUE,
+		SIGN,
+		BUFFER,				// source or target bit of a copy, the delta bit and delta indices
+		FIELDS
+	};
+	enum { REGIONS = 64, BUCKETS = 1<<EB_SIZE_BITS_MAX };
+
+	long long target_size;
+	long long region_size;		// target bytes in each region
+	long long pos;				// target position of the next instruction
+	long long start;			// target position of the last instruction
+	long long header_bits;		// format marker, bucket tables and inject size
+	long long field_bits[FIELDS];
+	long long count[3];			// instructions of each type (inject, source, target)
+	long long bytes[3];			// target bytes written by each type
+	int index_bits[2];			// length and offset bucket index bits
+	unsigned char bucket_bits[2][BUCKETS];
+	long long histogram[2][BUCKETS];
+	long long region_bytes[REGIONS][3];
+	long long region_bits[REGIONS];
+	bool delta_format;			// source copies have a delta bit
+
+	void Begin(long long size) {
+		memset(this, 0, sizeof(PatchStats));
+		target_size = size;
+		region_size = size>REGIONS ? (size+REGIONS-1)/REGIONS : 1;
+	}
+	void Tables(long long bits, int len_idx_bits, const char *len_bits, int off_idx_bits, const char *off_bits) {
+		header_bits = bits;
+		index_bits[0] = len_idx_bits;
+		index_bits[1] = off_idx_bits;
+		for (int b=0; b<BUCKETS; b++) {
+			bucket_bits[0][b] = b<(1<<len_idx_bits) ? (unsigned char)len_bits[b] : 0;
+			bucket_bits[1][b] = b<(1<<off_idx_bits) ? (unsigned char)off_bits[b] : 0;
+		}
+	}
+	// an instruction of type 0 (inject), 1 (source) or 2 (target), 3 (delta copy,
+	// counted as a source copy, len is the bytes it writes and its words follow),
+	// off_bucket is not used for injects
+	void Instr(int type, long long len, int len_bucket, int off_bucket) {
+		long long bits[FIELDS] = { 0 };
+		if (delta_format && (type==1 || type==3))
+			bits[BUFFER]++;
+		if (type==3)
+			type = 1;
+		bits[INSTR] = 1;
+		bits[LEN_BUCKET] = index_bits[0];
+		bits[LEN_VALUE] = bucket_bits[0][len_bucket];
+		histogram[0][len_bucket]++;
+		if (type) {
+			bits[OFF_BUCKET] = index_bits[1];
+			bits[OFF_VALUE] = bucket_bits[1][off_bucket];
+			bits[SIGN] = 1;
+			bits[BUFFER]++;
+			histogram[1][off_bucket]++;
+		}
+		long long sum = type ? 0 : len*8;	// injected bytes count where they are used
+		for (int f=0; f<FIELDS; f++) {
+			field_bits[f] += bits[f];
+			sum += bits[f];
+		}
+		count[type]++;
+		bytes[type] += len;
+		// bits count for the region the instruction starts in, bytes for each region written
+		start = pos;
+		long long region = pos/region_size;
+		if (region<REGIONS)
+			region_bits[region] += sum;
+		long long end = pos+len;
+		for (; pos<end && region<REGIONS; region++) {
+			long long stop = (region+1)*region_size<end ? (region+1)*region_size : end;
+			region_bytes[region][type] += stop-pos;
+			pos = stop;
+		}
+		pos = end;
+	}
+	// a word of the last delta copy, the gap is coded as a length
+	void Word(int gap_bucket, int delta_index_bits) {
+		long long bits = index_bits[0] + bucket_bits[0][gap_bucket] + delta_index_bits;
+		field_bits[LEN_BUCKET] += index_bits[0];
+		field_bits[LEN_VALUE] += bucket_bits[0][gap_bucket];
+		field_bits[BUFFER] += delta_index_bits;
+		histogram[0][gap_bucket]++;
+		long long region = start/region_size;
+		if (region<REGIONS)
+			region_bits[region] += bits;
+	}
+	void End() { field_bits[INSTR]++; }
+	// bytes of patch the stats add up to
+	long long PatchSize() const {
+		long long bits = header_bits + bytes[0]*8;
+		for (int f=0; f<FIELDS; f++)
+			bits += field_bits[f];
+		return (bits+7)>>3;
+	}
+	bool Write(const char *filename) const;
+};
+
+// Phases of an encode timed by -profile
+enum ProfilePhase {
+	PROFILE_LOAD,			// opening the input files
+	PROFILE_INDEX,		// building or loading the match finders
+	PROFILE_MATCH,		// finding matches and adding instructions
+	PROFILE_OPTIMIZE,		// bucket tables
+	PROFILE_GENERATE,		// writing the patch
+	PROFILE_VERIFY,		// decoding the patch and comparing with the target
+	PROFILE_COUNT
+};
+
+const char *aProfilePhaseNames[PROFILE_COUNT] = {
+	"load", "index", "match", "optimize", "generate", "verify"
+};
+
+// Wall time, cpu time (all threads) and resident memory of each phase,
+// a phase that runs more than once (-optimal, -budget) adds up
+struct EncodeProfile {
+	struct Phase {
+		double wall_ms;
+		double cpu_ms;
+		long long memory_kb;	// change in resident memory
+		size_t peak_kb;			// peak resident memory at the end of the phase
+		int runs;
+	};
+	Phase phases[PROFILE_COUNT];
+	MatchCounter counter;
+	std::chrono::steady_clock::time_point wall_start;
+	double cpu_start;
+	size_t memory_start;
+
+	EncodeProfile() : cpu_start(0.0), memory_start(0) { memset(phases, 0, sizeof(phases)); }
+	void Start();
+	void Stop(ProfilePhase phase);
+};
+
+// Deltas added to the words of delta copies, code rebuilt at another address
+// has its absolute operands moved, by another amount after code that grew or shrank
+struct DeltaTable {
+	int count;
+	unsigned int add[E8_DELTA_COUNT];	// 16 bit
+
+	DeltaTable() : count(0) {}
+	int IndexBits() const { return count>2 ? 2 : count-1; }
+	size_t HeaderSize() const { return 3 + 2*count; }
+	// index of the delta that moves the word at read to the word at target or -1
+	int Index(const char *read, const char *target) const {
+		unsigned int sw = (unsigned char)read[0] | ((unsigned char)read[1]<<8);
+		unsigned int tw = (unsigned char)target[0] | ((unsigned char)target[1]<<8);
+		for (int d=0; d<count; d++) {
+			if (((sw+add[d]) & 0xffff)==tw)
+				return d;
+		}
+		return -1;
+	}
+	// write the word at read moved by a delta to out, it is read before it is written
+	void Word(char *out, const char *read, int index) const {
+		unsigned int word = (unsigned char)read[0] | ((unsigned char)read[1]<<8);
+		word += add[index];
+		out[0] = (char)word;
+		out[1] = (char)(word>>8);
+	}
+	// Target bytes a delta copy from read matches up to left bytes, it ends after
+	// its last word. A word starts at the first byte that differs or the byte
+	// before it. The gap before each word and its delta index are added to words
+	// if set (2 values for each of num words).
+	size_t Match(const char *read, const char *target, size_t left, int *words, int &num) const {
+		size_t last = 0;	// end of the last word
+		size_t i = 0;
+		num = 0;
+		while (num<E8_DELTA_WORDS) {
+			while (i<left && read[i]==target[i])
+				i++;
+			if (i>=left)
+				break;
+			size_t w = i;
+			int d = -1;
+			if (i>last)
+				d = Index(read+i-1, target+i-1);
+			if (d>=0)
+				w = i-1;
+			else if ((i+2)<=left)
+				d = Index(read+i, target+i);
+			if (d<0 || (w-last)>E8_DELTA_GAP)
+				break;
+			if (words) {
+				words[num*2] = int(w-last);
+				words[num*2+1] = d;
+			}
+			num++;
+			i = last = w+2;
+		}
+		return last;
+	}
+};
+
+// Encoder data
+struct Encoder {
+	enum EncType {
+		LENGTH,
+		OFFSET,
+		TYPES
+	};
+
+	enum E8Instr {
+		E8I_INJ,
+		E8I_SRC,
+		E8I_TRG,
+		E8I_DLT,	// source copy that relocates words (delta format)
+		E8I_END
+	};
+
+	int bitCounts[TYPES][E8_VALUE_BITS_MAX+1];
+	int count[TYPES];
+	int instr[E8I_END];
+	size_t inject_size;
+	int bitSizesCount[TYPES]; // how many bits per size lookup
+	char besti2b[TYPES][1<<EB_SIZE_BITS_MAX]; // lookup bit size
+
+	char *instructions;
+	char *inject;
+	int *values;
+	long long *large_values;	// instead of values in the large file format
+
+	char *result;
+	size_t result_size;
+
+	MatchEngine engine;
+	int level;		// search limits for ENGINE_CHAIN (1-9)
+	bool optimal;	// shortest path parse priced by the bucket tables
+	int threads;	// threads for finding matches ahead of the greedy parse
+	bool large;		// large file format (set by Begin for files above 2 gb)
+	const CycleModel *cycle_model;	// trade patch size for decode cycles on this cpu
+	double cycle_weight;			// bits of patch one decode cycle is worth
+	MatchFinder *source_index;		// shared source lookup for many targets (not owned)
+	PatchStats *stats;				// filled in by Generate if set
+	EncodeProfile *profile;			// phase times and match counts if set
+	const AddressWindow *limits;	// offsets and lengths the decoder can use if set
+	bool delta;						// delta format (set by Delta if it finds relocated code)
+	DeltaTable delta_table;
+	bool backward;					// backward format (set by InPlace if it is smaller)
+	size_t backward_sizes[2];		// source and target size in the backward header
+
+	// write pointers while building the instruction list
+	char *next_inj;
+	size_t num_values;
+	char *next_instr;
+
+	Encoder() : inject_size(0), instructions(nullptr), inject(nullptr),
+				values(nullptr), large_values(nullptr),
+				result(nullptr), result_size(0),
+#ifdef USE_BUFFER_ACCELERATOR
+				engine(ENGINE_PAIRS),
+#else
+				engine(ENGINE_STRING),
+#endif
+				level(E8_DEFAULT_LEVEL), optimal(false), threads(1), large(false),
+				cycle_model(nullptr), cycle_weight(E8_CYCLE_WEIGHT), source_index(nullptr),
+				stats(nullptr), profile(nullptr), limits(nullptr), delta(false), backward(false)
+	{
+		ClearStats();
+	}
+
+	void ClearStats() {
+		for (int t=0; t<TYPES; t++) {
+			count[t] = 0;
+			for (int b=0; b<=E8_VALUE_BITS_MAX; b++)
+				bitCounts[t][b] = 0;
+		}
+		for (int i=0; i<E8I_END; i++)
+			instr[i] = 0;
+	}
+
+	~Encoder() { Reset(); }
+
+	void Reset() {
+		if (instructions)
+			free(instructions);
+		instructions = nullptr;
+		if (inject)
+			free(inject);
+		inject = nullptr;
+		if (values)
+			free(values);
+		values = nullptr;
+		if (large_values)
+			free(large_values);
+		large_values = nullptr;
+		if (result)
+			free(result);
+		result = nullptr;
+		inject_size = 0;
+		result_size = 0;
+		delta = false;
+		backward = false;
+	}
+
+	size_t Greedy(const char *source, size_t source_size, const char *target, size_t target_size,
+				  MatchFinder *srcLookup, MatchFinder *trgLookup, size_t cursor, size_t end,
+				  MatchAhead *ahead, bool record, size_t &visited);
+	void Build(const char *source, size_t source_size, const char *target, size_t target_size);
+	void BuildOptimal(const char *source, size_t source_size, const char *target, size_t target_size);
+	void BuildBudget(const char *source, size_t source_size, const char *target, size_t target_size,
+					 long long budget, bool optimal);
+	void Parse(const char *source, size_t source_size, const char *target, size_t target_size);
+	void InPlace(const char *source, size_t source_size, const char *target, size_t target_size,
+				 bool optimal, size_t &copies, size_t &bytes);
+	void Overwrite(const char *source, size_t source_size, const char *target, size_t target_size,
+				   long long shift, bool reverse, size_t &copies, size_t &bytes);
+	void Swap(Encoder &other);
+	void Delta(const char *source, size_t source_size, const char *target, size_t target_size,
+			   bool in_place, size_t &copies, size_t &bytes);
+	void Begin(size_t source_size, size_t target_size);
+	void AddValue(long long value) {
+		if (large)
+			large_values[num_values++] = value;
+		else
+			values[num_values++] = (int)value;
+	}
+	long long Value(size_t index) const { return large ? large_values[index] : values[index]; }
+	void AddInject(const char *bytes, size_t num);
+	void AddCopy(E8Instr buffer, long long size, long long offs);
+	void AddDelta(long long offs, int num, const int *words);
+	// target bytes of a delta copy of num words, the first gap is the value at val
+	long long DeltaBytes(size_t val, long long num) const {
+		long long bytes = 2*num;
+		for (long long w=0; w<num; w++)
+			bytes += Value(val+2*w);
+		return bytes;
+	}
+	void Reach(MatchFinder *finder) const {
+		finder->min_offset = limits ? limits->min_offset : -E8_ANY_OFFSET;
+		finder->max_offset = limits ? limits->max_offset : E8_ANY_OFFSET;
+	}
+	// offset the decoder can add to a buffer pointer
+	bool InReach(long long offs) const {
+		return !limits || (offs>=limits->min_offset && offs<=limits->max_offset);
+	}
+	int FieldCost(EncType type, long long value) const;
+	long long InstrPenalty(E8Instr type, long long bits) const;
+	long long CopyPenalty(long long offs, long long len) const;
+	long long Cycles() const;
+	void BucketIndex(EncType type, char *index) const;
+	void Optimize();
+	size_t Measure() const;
+	void Generate();
+	void AddTrailer(const char *source, size_t source_size, const char *target, size_t target_size);
+};
+
+// allocate the instruction buffers for a target and clear the stats,
+// lengths and offsets are 64 bit if either file needs the large file format
+void Encoder::Begin(size_t source_size, size_t target_size)
+{
+	Reset();
+	ClearStats();
+	if (source_size>E8_LARGE_LIMIT || target_size>E8_LARGE_LIMIT)
+		large = true;
+	inject = (char*)malloc(target_size);
+	if (large)
+		large_values = (long long*)malloc(sizeof(long long) * target_size * 3 / 2);
+	else
+		values = (int*)malloc(sizeof(int) * target_size * 3 / 2);
+	instructions = (char*)malloc(target_size);
+	next_inj = inject;
+	num_values = 0;
+	next_instr = instructions;
+}
+
+// add a run of bytes to the inject buffer
+void Encoder::AddInject(const char *bytes, size_t num)
+{
+	// split runs that are longer than the decoder can copy
+	for (; limits && (long long)num>limits->max_length; num -= (size_t)limits->max_length) {
+		AddInject(bytes, (size_t)limits->max_length);
+		bytes += limits->max_length;
+	}
+	memcpy(next_inj, bytes, num);
+	next_inj += num;
+	*next_instr++ = E8I_INJ;
+	instr[E8I_INJ]++;
+	bitCounts[LENGTH][GetNumBits((long long)num)]++;
+	count[LENGTH]++;
+	AddValue((long long)num);
+	inject_size = size_t(next_inj - inject);
+}
+
+// add a copy from the source or target buffer
+void Encoder::AddCopy(E8Instr buffer, long long size, long long offs)
+{
+	// split copies that are longer than the decoder can copy, the pointer continues
+	for (; limits && size>limits->max_length; size -= limits->max_length) {
+		AddCopy(buffer, limits->max_length, offs);
+		offs = 0;
+	}
+	*next_instr++ = buffer;
+	instr[buffer]++;
+	bitCounts[LENGTH][GetNumBits(size)]++;
+	count[LENGTH]++;
+	AddValue(size);
+	bitCounts[OFFSET][GetNumBits(offs)]++;
+	count[OFFSET]++;
+	AddValue(offs);
+}
+
+// add a delta copy of num words, the gap before each word and its delta index
+void Encoder::AddDelta(long long offs, int num, const int *words)
+{
+	*next_instr++ = E8I_DLT;
+	instr[E8I_DLT]++;
+	bitCounts[LENGTH][GetNumBits(num)]++;
+	count[LENGTH]++;
+	AddValue(num);
+	bitCounts[OFFSET][GetNumBits(offs)]++;
+	count[OFFSET]++;
+	AddValue(offs);
+	for (int w=0; w<num; w++) {
+		bitCounts[LENGTH][GetNumBits(words[w*2])]++;
+		count[LENGTH]++;
+		AddValue(words[w*2]);
+		AddValue(words[w*2+1]);
+	}
+}
+
+// Greedy parse of the target from cursor until end is reached.
+// Worker threads record the matches found at each visited position in ahead
+// (guessing the pointers at the start of the range) without adding
+// instructions. Otherwise instructions are added and matches found ahead
+// are used where they were found for the same pointers.
+// Returns the number of lookups, visited is increased by the positions parsed.
+size_t Encoder::Greedy(const char *source, size_t source_size, const char *target, size_t target_size,
+	MatchFinder *srcLookup, MatchFinder *trgLookup, size_t cursor, size_t end,
+	MatchAhead *ahead, bool record, size_t &visited)
+{
+	size_t inject_count = 0;
+	long long src_offs_prev = record ? (long long)(cursor<source_size ? cursor : source_size) : 0;
+	long long trg_offs_prev = 0;
+	size_t src_moved = cursor;	// cursor when a pointer was last moved
+	size_t trg_moved = cursor;
+	size_t lookups = 0;
+
+	// first find patterns
+	while (cursor < end) {
+		long long src_offs, trg_offs;
+		long long src_size, trg_size;
+		long long save_src, save_trg;
+		MatchAhead *found = ahead ? ahead + cursor : nullptr;
+		if (found && !record && found->Same(0, src_offs_prev, cursor-src_moved))
+			save_src = found->Get(0, src_offs, src_size);
+		else {
+			save_src = srcLookup->Match(target+cursor, target_size-cursor, source, source_size,
+							0, src_offs_prev, cursor-src_moved, src_offs, src_size);
+			lookups++;
+		}
+		if (found && !record && found->Same(1, trg_offs_prev, cursor-trg_moved))
+			save_trg = found->Get(1, trg_offs, trg_size);
+		else {
+			save_trg = trgLookup->Match(target+cursor, target_size-cursor, target, cursor,
+							target_size-cursor, trg_offs_prev, cursor-trg_moved, trg_offs, trg_size);
+			lookups++;
+		}
+		visited++;
+		if (record) {
+			found->Set(0, src_offs_prev, cursor-src_moved, save_src, src_offs, src_size);
+			found->Set(1, trg_offs_prev, cursor-trg_moved, save_trg, trg_offs, trg_size);
+		}
+		if (cycle_model) {
+			if (save_src>0)
+				save_src -= CopyPenalty(src_offs, src_size);
+			if (save_trg>0)
+				save_trg -= CopyPenalty(trg_offs, trg_size);
+		}
+		long long save = save_src > save_trg ? save_src : save_trg;
+		// if no match then push byte to inject buffer
+		if (save<=0 || (save<8 && inject_count)) {
+			inject_count++;
+			cursor++;
+		} else {
+			// add skipped bytes into injection table
+			if (inject_count) {
+				if (!record)
+					AddInject(target+cursor-inject_count, inject_count);
+				inject_count = 0;
+			}
+			// copy bytes from source or target window
+			if (save_src>save_trg) {
+				if (!record)
+					AddCopy(E8I_SRC, src_size, src_offs);
+				cursor += src_size;
+				src_offs_prev += src_offs + src_size;
+				src_moved = cursor;
+			} else {
+				if (!record)
+					AddCopy(E8I_TRG, trg_size, trg_offs);
+				cursor += trg_size;
+				trg_offs_prev += trg_offs + trg_size;
+				trg_moved = cursor;
+			}
+		}
+	}
+	// add trailing injection bytes
+	if (inject_count && !record)
+		AddInject(target+cursor-inject_count, inject_count);
+	return lookups;
+}
+
+void Encoder::Build(const char *source, size_t source_size, const char *target, size_t target_size)
+{
+	Begin(source_size, target_size);
+
+	// lookup tables for the buffers
+	if (profile)
+		profile->Start();
+	MatchFinder *srcLookup = source_index ? source_index : CreateMatchFinder(engine, level, source, source_size, false);
+	MatchFinder *trgLookup = CreateMatchFinder(engine, level, target, target_size, true);
+	Reach(srcLookup);
+	Reach(trgLookup);
+	if (profile) {
+		profile->Stop(PROFILE_INDEX);
+		srcLookup->counter = trgLookup->counter = &profile->counter;
+		profile->Start();
+	}
+
+	double threaded_ms = -1.0;	// wall time of the match search on threads
+	if (threads<=1 || target_size<2) {
+		size_t visited = 0;
+		Greedy(source, source_size, target, target_size, srcLookup, trgLookup,
+			   0, target_size, nullptr, false, visited);
+	} else {
+		// find matches ahead on worker threads in chunks, each chunk guesses the pointers
+		// at its start and the parse uses the matches found for the same pointers
+		// so the result is the same as without threads.
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		MatchAhead *ahead = (MatchAhead*)calloc(target_size, sizeof(MatchAhead));
+		size_t num_chunks = threads * 8;
+		size_t chunk_size = (target_size + num_chunks-1) / num_chunks;
+		std::atomic<size_t> next_chunk(0);
+		std::atomic<size_t> ahead_lookups(0);
+		std::atomic<long long> busy_us(0);
+		std::thread *workers = new std::thread[threads];
+		for (int t=0; t<threads; t++) {
+			workers[t] = std::thread([&]() {
+				std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+				MatchFinder *src = srcLookup->Shared() ? srcLookup : CreateMatchFinder(engine, level, source, source_size, false);
+				MatchFinder *trg = trgLookup->Shared() ? trgLookup : CreateMatchFinder(engine, level, target, target_size, true);
+				if (src!=srcLookup)
+					src->counter = srcLookup->counter;
+				if (trg!=trgLookup)
+					trg->counter = trgLookup->counter;
+				Reach(src);
+				Reach(trg);
+				size_t lookups = 0, visited = 0;
+				for (size_t c = next_chunk++; c<num_chunks; c = next_chunk++) {
+					size_t first = c*chunk_size;
+					size_t last = first+chunk_size < target_size ? first+chunk_size : target_size;
+					// a copy that ran past the end of the last chunk may have added offsets
+					// past the start of this one, they would take up chain candidates
+					trg->Rewind(first);
+					if (first<last)
+						lookups += Greedy(source, source_size, target, target_size, src, trg,
+										  first, last, ahead, true, visited);
+				}
+				if (src!=srcLookup)
+					delete src;
+				if (trg!=trgLookup)
+					delete trg;
+				ahead_lookups += lookups;
+				busy_us += std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now()-begin).count();
+			});
+		}
+		for (int t=0; t<threads; t++)
+			workers[t].join();
+		delete[] workers;
+		std::chrono::steady_clock::time_point parse = std::chrono::steady_clock::now();
+		size_t visited = 0;
+		size_t lookups = Greedy(source, source_size, target, target_size, srcLookup, trgLookup,
+								0, target_size, ahead, false, visited);
+		std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+		free(ahead);
+
+		// estimate the single thread time from the time per lookup in the parse
+		// (or on the workers if all lookups were done ahead)
+		size_t reused = 2*visited - lookups;
+		double ahead_ms = std::chrono::duration_cast<std::chrono::microseconds>(parse-start).count() / 1000.0;
+		double parse_ms = std::chrono::duration_cast<std::chrono::microseconds>(done-parse).count() / 1000.0;
+		double lookup_ms = lookups ? parse_ms / lookups :
+			(ahead_lookups ? busy_us / 1000.0 / ahead_lookups : 0.0);
+		double single_ms = parse_ms + reused * lookup_ms;
+		printf("Match search on %d threads: %.1f ms (%.1f ms ahead + %.1f ms parse), "
+			   "%d%% of lookups done ahead\n", threads, ahead_ms+parse_ms, ahead_ms, parse_ms,
+			   visited ? int(100 * reused / (2*visited)) : 0);
+		threaded_ms = ahead_ms+parse_ms;
+		if (!profile)
+			printf("Estimated single thread match search: %.1f ms (%.2fx speedup estimated from "
+				   "the time per lookup, -profile measures it)\n", single_ms, single_ms / threaded_ms);
+	}
+	if (profile) {
+		profile->Stop(PROFILE_MATCH);
+		srcLookup->counter = nullptr;
+	}
+	if (profile && threaded_ms>=0) {
+		// time the same lookups on one thread, outside of the profiled phases
+		MatchAhead *single = (MatchAhead*)calloc(target_size, sizeof(MatchAhead));
+		MatchFinder *trg = trgLookup->Shared() ? trgLookup : CreateMatchFinder(engine, level, target, target_size, true);
+		Reach(trg);
+		size_t visited = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Greedy(source, source_size, target, target_size, srcLookup, trg, 0, target_size, single, true, visited);
+		double single_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now()-start).count() / 1000.0;
+		if (trg!=trgLookup)
+			delete trg;
+		free(single);
+		printf("Single thread match search: %.1f ms, %.2fx speedup\n",
+			   single_ms, threaded_ms>0 ? single_ms / threaded_ms : 0.0);
+	}
+	if (srcLookup!=source_index)
+		delete srcLookup;
+	delete trgLookup;
+}
+
+// Bits needed for a length or offset with the current bucket tables
+// (values beyond the largest bucket are priced as if the bucket grew)
+int Encoder::FieldCost(EncType type, long long value) const
+{
+	int index = GetBitCountIndex(value, besti2b[type], 1<<bitSizesCount[type]);
+	if (index<0)
+		return bitSizesCount[type] + GetNumBits(value);
+	return bitSizesCount[type] + besti2b[type][index];
+}
+
+// Decode cycles of an instruction with bits in the instruction stream
+// weighed as bits of patch, bytes are written either way so they are left out
+long long Encoder::InstrPenalty(E8Instr type, long long bits) const
+{
+	if (!cycle_model)
+		return 0;
+	long long cycles = (type==E8I_INJ ? cycle_model->inject : cycle_model->copy) + cycle_model->bit * bits;
+	return (long long)(cycle_weight * cycles + 0.5);
+}
+
+// Decode cycles of a copy over adding the bytes to an inject run, weighed
+// as bits of patch (bits estimated as in MatchSaving)
+long long Encoder::CopyPenalty(long long offs, long long len) const
+{
+	int bits = 1 + 1 + 1 + 2*E8_SIZE_BITS + GetNumBits(offs) + GetNumBits(len-1);
+	return InstrPenalty(E8I_SRC, bits);
+}
+
+// Estimated decode cycles of the instructions with the current bucket tables
+long long Encoder::Cycles() const
+{
+	if (!cycle_model)
+		return 0;
+	long long bits = 0, bytes = 0, cycles = cycle_model->setup;
+	size_t v = 0;
+	for (const char *i = instructions; i<next_instr; i++) {
+		long long len = Value(v++);
+		bits += 1 + FieldCost(LENGTH, len);
+		if (*i==E8I_INJ)
+			cycles += cycle_model->inject;
+		else {
+			bits += 1 + 1 + FieldCost(OFFSET, Value(v++)) + (delta && *i!=E8I_TRG);
+			cycles += cycle_model->copy;
+		}
+		if (*i==E8I_DLT) {
+			bytes += DeltaBytes(v, len);
+			for (long long w=0; w<len; w++, v+=2)
+				bits += FieldCost(LENGTH, Value(v)) + delta_table.IndexBits();
+		} else
+			bytes += len;
+	}
+	return cycles + bits * cycle_model->bit + bytes * cycle_model->byte;
+}
+
+// Shortest path parse of the target, each position is reached by the
+// cheapest sequence of instructions priced with the current bucket tables.
+// The source and target pointers of the cheapest path to each position are
+// used to price the offsets of the matches found from there.
+// The copies of the previous parse (greedy at first) are tried at the
+// positions they started at with the pointers of the path there, so the
+// previous parse is always one of the paths. While a match found earlier
+// has E8_OPTIMAL_REUSE bytes left it is continued instead of searched again.
+// (steps are 32 bit, so files above 2 gb use the greedy parse)
+void Encoder::Parse(const char *source, size_t source_size, const char *target, size_t target_size)
+{
+	struct Step {
+		long long cost;		// bits to reach this position
+		unsigned int from;	// start of the last instruction (or inject run)
+		int offs;			// offset of the last instruction if copy
+		int src_prev;		// source pointer at this position
+		int trg_prev;		// target pointer at this position
+		unsigned int src_moved;	// position where the pointers were last moved
+		unsigned int trg_moved;
+		char instr;			// last instruction
+	};
+	struct Seed {
+		unsigned int at;	// target position of a copy of the previous parse
+		unsigned int len;
+		int addr;			// copied from this position of the buffer
+		char instr;
+	};
+	// copies of the previous parse with the offsets made absolute
+	size_t num_seeds = 0;
+	Seed *seeds = (Seed*)malloc(sizeof(Seed) * ((next_instr-instructions)+1));
+	{
+		size_t v = 0, pos = 0;
+		long long prev[2] = { 0, 0 };
+		for (const char *i = instructions; i<next_instr && *i!=E8I_DLT; i++) {
+			long long len = Value(v++);
+			if (*i!=E8I_INJ) {
+				long long &p = prev[*i==E8I_TRG];
+				p += Value(v++);
+				Seed &seed = seeds[num_seeds++];
+				seed.at = (unsigned int)pos;
+				seed.len = (unsigned int)len;
+				seed.addr = (int)p;
+				seed.instr = *i;
+				p += len;
+			}
+			pos += (size_t)len;
+		}
+	}
+	Step *steps = (Step*)malloc(sizeof(Step) * (target_size+1));
+	for (size_t i=1; i<=target_size; i++)
+		steps[i].cost = -1;
+	steps[0].cost = 0;
+	steps[0].from = 0;
+	steps[0].src_prev = 0;
+	steps[0].trg_prev = 0;
+	steps[0].src_moved = 0;
+	steps[0].trg_moved = 0;
+	steps[0].instr = E8I_END;
+
+	if (profile)
+		profile->Start();
+	MatchFinder *srcLookup = source_index ? source_index : CreateMatchFinder(engine, level, source, source_size, false);
+	MatchFinder *trgLookup = CreateMatchFinder(engine, level, target, target_size, true);
+	Reach(srcLookup);
+	Reach(trgLookup);
+	if (profile) {
+		profile->Stop(PROFILE_INDEX);
+		srcLookup->counter = trgLookup->counter = &profile->counter;
+		profile->Start();
+	}
+
+	// add a copy of len from addr in buffer b at cursor with the pointers of at
+	auto relax = [&](size_t cursor, const Step &at, int b, long long addr, long long size) {
+		int prev = b==E8I_SRC ? at.src_prev : at.trg_prev;
+		long long offs = addr - prev;
+		int offs_cost = 1 + 1 + 1 + FieldCost(OFFSET, offs);
+		// also try shorter lengths that fit in smaller buckets
+		for (int len = (int)size; len>E8_MIN_TRG_SRC_LEN; len = (1<<(GetNumBits(len)-1))-1) {
+			int copy_bits = offs_cost + FieldCost(LENGTH, len);
+			long long cost = at.cost + copy_bits + InstrPenalty(E8I_SRC, copy_bits);
+			Step &dest = steps[cursor+len];
+			if (dest.cost<0 || cost<dest.cost) {
+				dest.cost = cost;
+				dest.from = (unsigned int)cursor;
+				dest.offs = (int)offs;
+				dest.src_prev = b==E8I_SRC ? int(addr+len) : at.src_prev;
+				dest.trg_prev = b==E8I_TRG ? int(addr+len) : at.trg_prev;
+				dest.src_moved = b==E8I_SRC ? unsigned(cursor+len) : at.src_moved;
+				dest.trg_moved = b==E8I_TRG ? unsigned(cursor+len) : at.trg_moved;
+				dest.instr = (char)b;
+			}
+		}
+	};
+
+	// positions inside a long match are not expanded
+	size_t skip_to = 0;
+	int long_match = engine==ENGINE_CHAIN ? aChainLevels[level-1].nice_length : E8_OPTIMAL_LONG_MATCH;
+	long long reuse_addr[2] = { 0, 0 };	// match found earlier for each buffer
+	size_t reuse_at[2] = { 0, 0 }, reuse_end[2] = { 0, 0 };
+	size_t seed = 0;
+	for (size_t cursor = 0; cursor<target_size; cursor++) {
+		while (seed<num_seeds && seeds[seed].at<cursor)
+			seed++;
+		if (steps[cursor].cost<0)
+			continue;
+		const Step &at = steps[cursor];
+		for (; seed<num_seeds && seeds[seed].at==cursor; seed++) {
+			const Seed &copy = seeds[seed];
+			MatchFinder *lookup = copy.instr==E8I_SRC ? srcLookup : trgLookup;
+			if (lookup->Reach(copy.addr - (copy.instr==E8I_SRC ? at.src_prev : at.trg_prev)))
+				relax(cursor, at, copy.instr, copy.addr, copy.len);
+		}
+		if (cursor<skip_to)
+			continue;
+		// extend or start an inject run
+		size_t run = at.instr==E8I_INJ ? at.from : cursor;
+		int inj_bits = 1 + FieldCost(LENGTH, int(cursor+1-run));
+		long long cost = steps[run].cost + inj_bits + 8*(long long)(cursor+1-run) + InstrPenalty(E8I_INJ, inj_bits);
+		Step &next = steps[cursor+1];
+		if (next.cost<0 || cost<next.cost) {
+			next.cost = cost;
+			next.from = (unsigned int)run;
+			next.src_prev = at.src_prev;
+			next.trg_prev = at.trg_prev;
+			next.src_moved = at.src_moved;
+			next.trg_moved = at.trg_moved;
+			next.instr = E8I_INJ;
+		}
+		// copy from source or target
+		for (int b=E8I_SRC; b<=E8I_TRG; b++) {
+			int i = b==E8I_TRG;
+			MatchFinder *lookup = b==E8I_SRC ? srcLookup : trgLookup;
+			int prev = b==E8I_SRC ? at.src_prev : at.trg_prev;
+			long long addr = reuse_addr[i] + (long long)(cursor-reuse_at[i]);
+			if (reuse_end[i]>=cursor+E8_OPTIMAL_REUSE && lookup->Reach(addr - prev)) {
+				relax(cursor, at, b, addr, (long long)(reuse_end[i]-cursor));
+				continue;
+			}
+			long long offs, size;
+			size_t skipped = cursor - (b==E8I_SRC ? at.src_moved : at.trg_moved);
+			long long save = b==E8I_SRC ?
+				srcLookup->Match(target+cursor, target_size-cursor, source, source_size,
+								 0, prev, skipped, offs, size) :
+				trgLookup->Match(target+cursor, target_size-cursor, target, cursor,
+								 target_size-cursor, prev, skipped, offs, size);
+			if (save<0)
+				continue;
+			if (size>=long_match && (cursor+size)>skip_to)
+				skip_to = cursor+size;
+			reuse_addr[i] = prev+offs;
+			reuse_at[i] = cursor;
+			reuse_end[i] = cursor+(size_t)size;
+			relax(cursor, at, b, prev+offs, size);
+		}
+	}
+	if (profile)
+		srcLookup->counter = nullptr;
+	if (srcLookup!=source_index)
+		delete srcLookup;
+	delete trgLookup;
+	free(seeds);
+
+	// reverse the cheapest path into a list of instruction start positions
+	size_t num_steps = 0;
+	for (size_t pos = target_size; pos; pos = steps[pos].from)
+		num_steps++;
+	unsigned int *path = (unsigned int*)malloc(sizeof(unsigned int) * (num_steps+1));
+	size_t n = num_steps;
+	for (size_t pos = target_size; pos; pos = steps[pos].from)
+		path[n--] = (unsigned int)pos;
+
+	Begin(source_size, target_size);
+	for (size_t p=1; p<=num_steps; p++) {
+		const Step &step = steps[path[p]];
+		int len = int(path[p]-step.from);
+		if (step.instr==E8I_INJ)
+			AddInject(target+step.from, len);
+		else
+			AddCopy((E8Instr)step.instr, len, step.offs);
+	}
+	free(path);
+	free(steps);
+	if (profile)
+		profile->Stop(PROFILE_MATCH);
+}
+
+// Start with a greedy parse and repeat the shortest path parse with the
+// bucket tables from the previous parse until the tables stop changing
+void Encoder::BuildOptimal(const char *source, size_t source_size, const char *target, size_t target_size)
+{
+	enum { MAX_PASSES = 8 };
+	int parseSizesCount[TYPES];		// tables used by the parse
+	char parse_i2b[TYPES][1<<EB_SIZE_BITS_MAX];
+	int bestSizesCount[TYPES];		// tables used by the smallest parse
+	char best_i2b[TYPES][1<<EB_SIZE_BITS_MAX];
+	int best_pass = 0;
+
+	Build(source, source_size, target, target_size);
+	if (source_size>E8_LARGE_LIMIT || target_size>E8_LARGE_LIMIT) {
+		printf("Optimal parse is limited to 2 GB files, using the greedy parse\n");
+		return;
+	}
+	Optimize();
+	size_t best_size = Measure();
+	for (int pass=1; pass<=MAX_PASSES; pass++) {
+		memcpy(parseSizesCount, bitSizesCount, sizeof(parseSizesCount));
+		memcpy(parse_i2b, besti2b, sizeof(parse_i2b));
+		Parse(source, source_size, target, target_size);
+		Optimize();
+		size_t size = Measure();
+		if (size<best_size) {
+			best_size = size;
+			best_pass = pass;
+			memcpy(bestSizesCount, parseSizesCount, sizeof(bestSizesCount));
+			memcpy(best_i2b, parse_i2b, sizeof(best_i2b));
+		}
+		if (!memcmp(parseSizesCount, bitSizesCount, sizeof(parseSizesCount)) &&
+			!memcmp(parse_i2b, besti2b, sizeof(parse_i2b)))
+			break;	// tables are stable
+		if (pass!=best_pass && pass>best_pass+1)
+			break;	// not improving
+	}
+	// repeat the smallest parse if the last one was not it
+	if (Measure()>best_size) {
+		if (best_pass) {
+			memcpy(bitSizesCount, bestSizesCount, sizeof(bitSizesCount));
+			memcpy(besti2b, best_i2b, sizeof(besti2b));
+			Parse(source, source_size, target, target_size);
+		} else
+			Build(source, source_size, target, target_size);
+		Optimize();
+	}
+}
+
+// Smallest patch estimated to decode within budget cycles, the weight of
+// decode cycles is doubled until the budget is met and then narrowed down
+void Encoder::BuildBudget(const char *source, size_t source_size, const char *target, size_t target_size,
+						  long long budget, bool optimal)
+{
+	enum { STEPS = 8 };
+	auto build = [&](double weight) -> long long {
+		cycle_weight = weight;
+		if (optimal)
+			BuildOptimal(source, source_size, target, target_size);
+		else
+			Build(source, source_size, target, target_size);
+		Optimize();
+		return Cycles();
+	};
+	if (build(0.0)<=budget)
+		return;
+	double low = 0.0, high = 1.0/64;
+	for (long long cycles = build(high); cycles>budget; cycles = build(high)) {
+		if (high>=64.0) {
+			printf("Budget of %lld cycles can't be met, estimate is %lld cycles\n", budget, cycles);
+			return;
+		}
+		low = high;
+		high *= 2.0;
+	}
+	for (int step=0; step<STEPS; step++) {
+		double mid = (low+high) * 0.5;
+		if (build(mid)<=budget)
+			high = mid;
+		else
+			low = mid;
+	}
+	if (cycle_weight!=high)
+		build(high);
+}
+
+// Make the instructions safe to decode over the source (the target is written
+// at the address of the source). A source copy reading from before the output
+// position (moved by shift) reads bytes the target has already replaced, unless
+// they are the same it is turned into injected bytes, as is a copy whose offset
+// from the pointer is out of reach of the decoder after the copies before it
+// changed. The buffers are reversed for the backward format, the source bytes
+// before shift are past the end of the target and never replaced and the copy
+// offsets are written negated for the pointers moving down from the ends.
+// Returns the copies and bytes injected.
+void Encoder::Overwrite(const char *source, size_t source_size, const char *target, size_t target_size,
+						long long shift, bool reverse, size_t &copies, size_t &bytes)
+{
+	copies = bytes = 0;
+	char *old_instructions = instructions;
+	char *old_inject = inject;
+	int *old_values = values;
+	long long *old_large_values = large_values;
+	bool old_large = large;
+	int num_instr = instr[E8I_INJ] + instr[E8I_SRC] + instr[E8I_TRG] + instr[E8I_DLT];
+	instructions = inject = nullptr;
+	values = nullptr;
+	large_values = nullptr;
+	Begin(source_size, target_size);
+
+	size_t val = 0;
+	long long pos = 0;							// output position
+	long long src = 0, trg = 0;					// buffer pointers of the old instructions
+	long long new_src = 0, new_trg = 0;			// and of the new instructions
+	long long inj = 0, inj_len = 0;				// injected bytes waiting to be added
+	long long sign = reverse ? -1 : 1;
+	for (int i=0; i<num_instr; i++) {
+		E8Instr type = (E8Instr)old_instructions[i];
+		long long length = old_large ? old_large_values[val] : old_values[val];
+		val++;
+		bool safe = true;
+		long long at = 0;
+		if (type!=E8I_INJ) {
+			long long offs = old_large ? old_large_values[val] : old_values[val];
+			val++;
+			if (type==E8I_SRC) {
+				at = src + offs;
+				src = at + length;
+				long long kept = shift-at<0 ? 0 : (shift-at<length ? shift-at : length);
+				safe = (at>=pos+shift || !memcmp(source+at+kept, target+at+kept-shift, size_t(length-kept))) &&
+					InReach(sign * (at - new_src));
+			} else {
+				at = trg + offs;
+				trg = at + length;
+				safe = InReach(sign * (at - new_trg));
+			}
+		}
+		if (type==E8I_SRC && !safe) {
+			// the source at the output position is read just before it is
+			// written so the parts of the copy that match there are kept
+			size_t injected = 0;
+			for (long long done = 0; done<length;) {
+				long long here = pos + done + shift;
+				long long left = (long long)source_size - here;
+				long long run = 0;
+				if (here>=0 && left>0 && InReach(sign * (here - new_src)))
+					run = (long long)MatchLength(source+here, target+pos+done,
+												 size_t(left<length-done ? left : length-done));
+				if (run>E8_MIN_TRG_SRC_LEN && MatchSaving(here - new_src, run)>0) {
+					if (inj_len)
+						AddInject(target+inj, (size_t)inj_len);
+					inj_len = 0;
+					AddCopy(E8I_SRC, run, sign * (here - new_src));
+					new_src = here + run;
+					done += run;
+				} else {
+					if (!inj_len)
+						inj = pos + done;
+					inj_len++;
+					injected++;
+					done++;
+				}
+			}
+			if (injected) {
+				copies++;
+				bytes += injected;
+			}
+		} else if (type==E8I_INJ || !safe) {
+			if (!safe) {
+				copies++;
+				bytes += (size_t)length;
+			}
+			if (!inj_len)
+				inj = pos;
+			inj_len += length;
+		} else {
+			if (inj_len)
+				AddInject(target+inj, (size_t)inj_len);
+			inj_len = 0;
+			if (type==E8I_SRC) {
+				AddCopy(type, length, sign * (at - new_src));
+				new_src = at + length;
+			} else {
+				AddCopy(type, length, sign * (at - new_trg));
+				new_trg = at + length;
+			}
+		}
+		pos += length;
+	}
+	if (inj_len)
+		AddInject(target+inj, (size_t)inj_len);
+	free(old_instructions);
+	free(old_inject);
+	free(old_values);
+	free(old_large_values);
+}
+
+// Make the patch decode over the source, forward or backward from the ends
+// of the buffers if that injects fewer bytes. Inserted data makes the source
+// copies after it read from before the output going forward but not going
+// backward, removed data the other way around. The backward patch is parsed
+// again from the reversed buffers with the same settings. Returns the copies
+// and bytes injected.
+void Encoder::InPlace(const char *source, size_t source_size, const char *target, size_t target_size,
+					  bool optimal, size_t &copies, size_t &bytes)
+{
+	Overwrite(source, source_size, target, target_size, 0, false, copies, bytes);
+	Optimize();
+	if (!copies || large || delta || (limits && !limits->backward))
+		return;
+	char *reversed = (char*)malloc(source_size+target_size ? source_size+target_size : 1);
+	char *rev_source = reversed, *rev_target = reversed + source_size;
+	for (size_t i=0; i<source_size; i++)
+		rev_source[i] = source[source_size-1-i];
+	for (size_t i=0; i<target_size; i++)
+		rev_target[i] = target[target_size-1-i];
+	Encoder back;
+	back.engine = engine;
+	back.level = level;
+	back.threads = threads;
+	back.cycle_model = cycle_model;
+	back.cycle_weight = cycle_weight;
+	back.limits = limits;
+	back.profile = profile;
+	if (optimal)
+		back.BuildOptimal(rev_source, source_size, rev_target, target_size);
+	else
+		back.Build(rev_source, source_size, rev_target, target_size);
+	back.Optimize();
+	size_t back_copies, back_bytes;
+	back.Overwrite(rev_source, source_size, rev_target, target_size,
+				   (long long)source_size-(long long)target_size, true, back_copies, back_bytes);
+	back.backward = true;
+	back.Optimize();
+	if (back.Measure()<Measure()) {
+		Swap(back);
+		// the injected bytes are read down from the end
+		std::reverse(inject, inject+inject_size);
+		backward = true;
+		backward_sizes[0] = source_size;
+		backward_sizes[1] = target_size;
+		copies = back_copies;
+		bytes = back_bytes;
+		Optimize();
+	}
+	free(reversed);
+}
+
+// Exchange the instruction lists of two encoders
+void Encoder::Swap(Encoder &other)
+{
+	std::swap(instructions, other.instructions);
+	std::swap(inject, other.inject);
+	std::swap(values, other.values);
+	std::swap(large_values, other.large_values);
+	std::swap(inject_size, other.inject_size);
+	std::swap(num_values, other.num_values);
+	std::swap(next_inj, other.next_inj);
+	std::swap(next_instr, other.next_instr);
+	std::swap(large, other.large);
+	std::swap(bitCounts, other.bitCounts);
+	std::swap(count, other.count);
+	std::swap(instr, other.instr);
+}
+
+// Turn source copies into delta copies that continue over relocated words.
+// Deltas are voted for where source copies end: the copy stops at the low byte
+// of a word that moves, or at the high byte if the low byte is the same. The
+// deltas with the most votes that let copies reach furthest are kept. A source
+// copy becomes a delta copy if it reaches past the next instruction, the start
+// of a copy longer than a gap stays a source copy. The instructions a delta copy
+// covers are dropped or shortened. In place a delta copy must not read from
+// before the output. Returns the copies made delta copies and the bytes they
+// added, the patch stays in the 8 bit format if none are or it isn't smaller.
+void Encoder::Delta(const char *source, size_t source_size, const char *target, size_t target_size,
+					bool in_place, size_t &copies, size_t &bytes)
+{
+	copies = bytes = 0;
+	if (large || delta || backward)
+		return;
+	int num_instr = instr[E8I_INJ] + instr[E8I_SRC] + instr[E8I_TRG];
+	unsigned int *votes = (unsigned int*)calloc(0x10000, sizeof(unsigned int));
+	size_t val = 0;
+	long long pos = 0, src = 0;
+	for (int i=0; i<num_instr; i++) {
+		E8Instr type = (E8Instr)instructions[i];
+		long long length = Value(val++);
+		if (type!=E8I_INJ) {
+			long long offs = Value(val++);
+			if (type==E8I_SRC) {
+				src += offs + length;
+				for (long long b=-1; b<=0; b++) {
+					long long s = src+b, t = pos+length+b;
+					if (s<0 || (size_t)(s+2)>source_size || (size_t)(t+2)>target_size)
+						continue;
+					unsigned int sw = (unsigned char)source[s] | ((unsigned char)source[s+1]<<8);
+					unsigned int tw = (unsigned char)target[t] | ((unsigned char)target[t+1]<<8);
+					votes[(tw-sw) & 0xffff]++;
+				}
+			}
+		}
+		pos += length;
+	}
+	votes[0] = 0;
+
+	// bytes the source copies would add as delta copies with a delta table
+	auto Gain = [&](const DeltaTable &tried) {
+		long long gained = 0, covered = 0, pos = 0, src = 0;
+		size_t val = 0;
+		int num;
+		for (int i=0; i<num_instr; i++) {
+			E8Instr type = (E8Instr)instructions[i];
+			long long length = Value(val++);
+			long long next = pos + length;
+			if (type!=E8I_INJ) {
+				long long at = src + Value(val++);
+				if (type==E8I_SRC) {
+					src = at + length;
+					long long p = length>E8_DELTA_GAP ? next-E8_DELTA_GAP : pos;
+					if (p<covered)
+						p = covered;
+					at += p - pos;
+					if (p<next && (!in_place || at>=p)) {
+						size_t left = source_size-(size_t)at < target_size-(size_t)p ?
+							source_size-(size_t)at : target_size-(size_t)p;
+						long long end = p + (long long)tried.Match(source+at, target+p, left, nullptr, num);
+						if (end>next) {
+							gained += end-next;
+							covered = end;
+						}
+					}
+				}
+			}
+			pos = next;
+		}
+		return gained;
+	};
+
+	// a delta is added for the one that gains the most of the deltas with the
+	// most votes, a copy that reads past the low byte of a moved word also votes
+	// for a delta made from the high byte and the next byte
+	DeltaTable table;
+	long long best = 0;
+	while (table.count<E8_DELTA_COUNT) {
+		unsigned int pick = 0;
+		long long gain = best;
+		unsigned int tried[E8_DELTA_TRIES];
+		for (int t=0; t<E8_DELTA_TRIES; t++) {
+			unsigned int d = 0;
+			for (unsigned int v=1; v<0x10000; v++) {
+				if (votes[v]<E8_DELTA_VOTES || votes[v]<=votes[d])
+					continue;
+				int p = 0;
+				while (p<t && tried[p]!=v)
+					p++;
+				if (p==t)
+					d = v;
+			}
+			if (!d)
+				break;
+			tried[t] = d;
+			DeltaTable more = table;
+			more.add[more.count++] = d;
+			long long gained = Gain(more);
+			if (gained>gain) {
+				gain = gained;
+				pick = d;
+			}
+		}
+		if (!pick)
+			break;
+		best = gain;
+		table.add[table.count++] = pick;
+		votes[pick] = 0;
+	}
+	free(votes);
+	if (!table.count)
+		return;
+
+	// the instructions are kept if the delta format is not smaller
+	Optimize();
+	size_t regular = Measure();
+	int old_bitCounts[TYPES][E8_VALUE_BITS_MAX+1], old_count[TYPES], old_instr[E8I_END];
+	memcpy(old_bitCounts, bitCounts, sizeof(bitCounts));
+	memcpy(old_count, count, sizeof(count));
+	memcpy(old_instr, instr, sizeof(instr));
+	size_t old_inject_size = inject_size, old_num_values = num_values;
+	char *old_next_inj = next_inj, *old_next_instr = next_instr;
+	char *old_instructions = instructions;
+	char *old_inject = inject;
+	int *old_values = values;
+	instructions = inject = nullptr;
+	values = nullptr;
+	Begin(source_size, target_size);
+	// a delta copy has 2 values for each word and 2 more
+	values = (int*)realloc(values, sizeof(int) * (target_size*2 + 2));
+
+	int words[E8_DELTA_WORDS*2];
+	val = 0;
+	pos = 0;
+	src = 0;
+	long long trg = 0;						// buffer pointers of the old instructions
+	long long new_src = 0, new_trg = 0;		// and of the new instructions
+	long long covered = 0;					// output written by the new instructions
+	for (int i=0; i<num_instr; i++) {
+		E8Instr type = (E8Instr)old_instructions[i];
+		long long length = old_values[val++];
+		long long at = 0;
+		if (type!=E8I_INJ) {
+			long long offs = old_values[val++];
+			long long &ptr = type==E8I_TRG ? trg : src;
+			at = ptr + offs;
+			ptr = at + length;
+		}
+		long long next = pos + length;
+		if (next<=covered) {
+			pos = next;
+			continue;
+		}
+		// the start of an instruction covered by a delta copy is dropped
+		long long p = pos>covered ? pos : covered;
+		at += p - pos;
+		length = next - p;
+		if (type==E8I_SRC && (i+1)<num_instr) {
+			long long q = length>E8_DELTA_GAP ? next-E8_DELTA_GAP : p;
+			long long from = at + q - p;
+			if ((!in_place || from>=q) && InReach(q>p ? at - new_src : from - new_src)) {
+				size_t left = source_size-(size_t)from < target_size-(size_t)q ?
+					source_size-(size_t)from : target_size-(size_t)q;
+				int num;
+				long long end = q + (long long)table.Match(source+from, target+q, left, words, num);
+				if (end>=(next+old_values[val])) {
+					if (q>p) {
+						AddCopy(E8I_SRC, q-p, at - new_src);
+						new_src = from;
+					}
+					AddDelta(from - new_src, num, words);
+					new_src = from + end - q;
+					copies++;
+					bytes += (size_t)(end-next);
+					covered = end;
+					pos = next;
+					continue;
+				}
+			}
+		}
+		// a copy out of reach after the pointer moved is injected
+		if (type==E8I_INJ || !InReach(at - (type==E8I_TRG ? new_trg : new_src)))
+			AddInject(target+p, (size_t)length);
+		else if (type==E8I_TRG) {
+			AddCopy(type, length, at - new_trg);
+			new_trg = at + length;
+		} else {
+			AddCopy(type, length, at - new_src);
+			new_src = at + length;
+		}
+		covered = next;
+		pos = next;
+	}
+	delta = copies>0;
+	delta_table = table;
+	Optimize();
+	if (delta && Measure()<regular) {
+		free(old_instructions);
+		free(old_inject);
+		free(old_values);
+		return;
+	}
+	Reset();
+	instructions = old_instructions;
+	inject = old_inject;
+	values = old_values;
+	memcpy(bitCounts, old_bitCounts, sizeof(bitCounts));
+	memcpy(count, old_count, sizeof(count));
+	memcpy(instr, old_instr, sizeof(instr));
+	inject_size = old_inject_size;
+	num_values = old_num_values;
+	next_inj = old_next_inj;
+	next_instr = old_next_instr;
+	copies = bytes = 0;
+	Optimize();
+}
+
+void Encoder::Optimize()
+{
+	if (profile)
+		profile->Start();
+	// check stats
 	int top[TYPES];
 
-	for (int i=0; i<TYPES; i++) {
-		int totes = 0;
-		int tops = 0;
-		for (int b = 0; b<32; b++) {
-			totes += bitCounts[i][b];
-			if (bitCounts[i][b])
-				tops = b;
+	for (int i=0; i<TYPES; i++) {
+		int tops = 0;
+		for (int b = 0; b<=E8_VALUE_BITS_MAX; b++) {
+			if (bitCounts[i][b])
+				tops = b;
+		}
+		top[i] = tops;
+	}
+
+	// find an optimal distribution of bit buckets to represent the sizes
+	// 1) bounded by 0 and top
+	for (int i=0; i<TYPES; i++) {
+		long long minCost = -1;
+		bitSizesCount[i] = 0;
+		// number of bits to represent the size (0 = constant)
+		for (int b = limits ? limits->index_bits : 0; b<=EB_SIZE_BITS_MAX; b++) {
+			char i2b[1<<EB_SIZE_BITS_MAX] = { 0 };
+			int last = (1<<b)-1;
+			for (int j=0; j<last; j++)
+				i2b[j] = j+1; // min valid amount of bits = 1
+			i2b[last] = top[i];
+
+			bool shuffled = false;
+			do {
+				// calculate size at current setup
+				int s = 0;
+				long long bits = 0;
+				for (int n=0; n<=top[i]; n++) {
+					if (n>i2b[s])
+						s++;
+					bits += (long long)bitCounts[i][n] * (i2b[s] + b);
+				}
+				if (minCost<0 || bits < minCost) {
+					minCost = bits;
+					bitSizesCount[i] = b;
+					for (int c=0; c<(1<<EB_SIZE_BITS_MAX); c++)
+						besti2b[i][c] = i2b[c];
+				}
+				shuffled = false;
+				// now attempt to shuffle..
+				for (int bi=last-1; bi>=0; --bi) {
+					int v = i2b[bi];
+					if ((i2b[bi+1]-v)>1) {
+						v++;
+						i2b[bi] = v;
+						shuffled = true;
+						for (int b2=bi+1; b2<last; b2++) {
+							++v;
+							i2b[b2] = v;
+						}
+						break;
+					}
+				}
+			} while (shuffled);
+		}
+	}
+	if (profile)
+		profile->Stop(PROFILE_OPTIMIZE);
+}
+
+// Bucket index for each number of bits in a value (E8_VALUE_BITS_MAX+2 entries),
+// the first bucket that is large enough or -1
+void Encoder::BucketIndex(EncType type, char *index) const
+{
+	int last = 1<<bitSizesCount[type];
+	int b = 0;
+	for (int n=0; n<=E8_VALUE_BITS_MAX+1; n++) {
+		while (b<last && besti2b[type][b]<n)
+			b++;
+		index[n] = b<last ? (char)b : -1;
+	}
+}
+
+// Size of the diff with the current instructions and bucket tables
+size_t Encoder::Measure() const
+{
+	int num_instr = instr[E8I_INJ] + instr[E8I_SRC] + instr[E8I_TRG] + instr[E8I_DLT];
+	char lenIndex[E8_VALUE_BITS_MAX+2], offIndex[E8_VALUE_BITS_MAX+2];
+	BucketIndex(LENGTH, lenIndex);
+	BucketIndex(OFFSET, offIndex);
+	// figure out size of diff
+	size_t diff_size = 1;	// 1 byte for bit counts of offs/len tables
+	diff_size += (1<<bitSizesCount[LENGTH]) + (1<<bitSizesCount[OFFSET]);
+	if (large)
+		diff_size += 2 + 8;	// marker, version and 8 byte inject size
+	else
+		diff_size += inject_size<(1<<15) ? 2 : 4;
+	if (delta)
+		diff_size += delta_table.HeaderSize();
+	else if (backward)
+		diff_size += E8_BACKWARD_HEADER;
+	diff_size += inject_size;
+	size_t instruction_bits = 0;
+	// go through the instructions and add up the bits
+
+	size_t val = 0;
+	for (int i=0; i<num_instr; i++) {
+		instruction_bits += 1; // instructions use at least 1 bit
+		char instr = instructions[i];
+		// add length
+		long long length = Value(val++);
+		instruction_bits += bitSizesCount[LENGTH]; // length bit length
+		instruction_bits += besti2b[LENGTH][(int)lenIndex[CountBits(length)]];
+		if (instr!=E8I_INJ) { // inject instruction doesn't have an offset
+			long long offset = Value(val++);
+			instruction_bits += bitSizesCount[OFFSET]; // offset bit length
+			instruction_bits += besti2b[OFFSET][(int)offIndex[CountBits(offset<0 ? ~offset : offset)]];
+			instruction_bits += 1; // offset buffer requires 1 sign bit
+			instruction_bits += 1; // source and target buffers use 1 extra instruction bit
+			if (delta && instr!=E8I_TRG)
+				instruction_bits += 1; // source copies have a delta bit in the delta format
+		}
+		for (long long w=0; instr==E8I_DLT && w<length; w++) {
+			instruction_bits += bitSizesCount[LENGTH]; // gap coded as a length
+			instruction_bits += besti2b[LENGTH][(int)lenIndex[CountBits(Value(val))]];
+			instruction_bits += delta_table.IndexBits();
+			val += 2;
+		}
+	}
+	instruction_bits += 1; // the diff is terminated by an injection that goes beyond the end
+
+	diff_size += (instruction_bits+7)/8;
+	return diff_size;
+}
+
+// Build a binary diff buffer in one pass
+void Encoder::Generate()
+{
+	if (profile)
+		profile->Start();
+	int num_instr = instr[E8I_INJ] + instr[E8I_SRC] + instr[E8I_TRG] + instr[E8I_DLT];
+	char lenIndex[E8_VALUE_BITS_MAX+2], offIndex[E8_VALUE_BITS_MAX+2];
+	BucketIndex(LENGTH, lenIndex);
+	BucketIndex(OFFSET, offIndex);
+	int lenIdxBits = bitSizesCount[LENGTH];
+	int offIdxBits = bitSizesCount[OFFSET];
+	const char *lenBits = besti2b[LENGTH];
+	const char *offBits = besti2b[OFFSET];
+
+	// most instructions fit in 4 bytes, the writer grows if not
+	BitWriter out(64 + inject_size + size_t(num_instr) * 4);
+	if (large) {
+		out.Put(E8_LARGE_MARKER, 8);
+		out.Put(E8_LARGE_VERSION, 8);
+	} else if (delta) {
+		out.Put(E8_LARGE_MARKER, 8);
+		out.Put(E8_DELTA_VERSION, 8);
+		out.Put(delta_table.count, 8);
+		for (int d=0; d<delta_table.count; d++)
+			out.Put(delta_table.add[d], 16);
+	} else if (backward) {
+		out.Put(E8_LARGE_MARKER, 8);
+		out.Put(E8_BACKWARD_VERSION, 8);
+		out.Put(backward_sizes[0], 32);
+		out.Put(backward_sizes[1], 32);
+	}
+	// write # bits per category
+	out.Put((offIdxBits<<4) | lenIdxBits, 8);
+
+	// write # bits per bucket
+	for (int siz=0; siz<TYPES; siz++) {
+		for (int b=0; b<(1<<bitSizesCount[siz]); b++)
+			out.Put((unsigned char)besti2b[siz][b], 8);
+	}
+
+	// write inject buffer size
+	if (large) {
+		out.Put((unsigned long long)inject_size>>32, 32);
+		out.Put(inject_size & 0xffffffff, 32);
+	} else if (inject_size>=0x8000)
+		out.Put(0x80000000 | inject_size, 32);
+	else
+		out.Put(inject_size, 16);
+
+	if (stats) {
+		stats->Tables((long long)out.size*8 + out.count, lenIdxBits, lenBits, offIdxBits, offBits);
+		stats->delta_format = delta;
+	}
+
+	// write inject buffer
+	out.Bytes(inject, inject_size);
+
+	// write instructions
+	size_t val = 0;
+	for (int i=0; i<num_instr; i++) {
+		char instr = instructions[i];
+		// first bit of instruction (0=inject, 1=source or target copy) and length bucket
+		long long length = Value(val++);
+		int lenIndexValue = lenIndex[CountBits(length)];
+		out.Put((instr!=E8I_INJ)<<lenIdxBits | lenIndexValue, 1+lenIdxBits);
+		out.Put(length, lenBits[lenIndexValue]);
+		// add offset, injection buffer doesn't use offset
+		if (instr!=E8I_INJ) {
+			long long offset = Value(val++);
+			unsigned long long bits = offset<0 ? ~offset : offset;
+			int offIndexValue = offIndex[CountBits(bits)];
+			out.Put(offIndexValue, offIdxBits);
+			out.Put(bits, offBits[offIndexValue]);
+			out.Put((offset<0)<<1 | (instr==E8I_TRG), 2);
+			if (delta && instr!=E8I_TRG)
+				out.Put(instr==E8I_DLT, 1);
+			if (instr==E8I_DLT) {
+				// gap before each word coded as a length and the delta index
+				if (stats)
+					stats->Instr(instr, DeltaBytes(val, length), lenIndexValue, offIndexValue);
+				for (long long w=0; w<length; w++) {
+					long long gap = Value(val++);
+					int gapIndexValue = lenIndex[CountBits(gap)];
+					out.Put(gapIndexValue, lenIdxBits);
+					out.Put(gap, lenBits[gapIndexValue]);
+					out.Put(Value(val++), delta_table.IndexBits());
+					if (stats)
+						stats->Word(gapIndexValue, delta_table.IndexBits());
+				}
+			} else if (stats)
+				stats->Instr(instr, length, lenIndexValue, offIndexValue);
+		} else if (stats)
+			stats->Instr(instr, length, lenIndexValue, 0);
+	}
+	out.Put(0, 1); // terminate the file!
+	if (stats)
+		stats->End();
+	result = (char*)out.Finish();
+	result_size = out.size;
+	if (profile)
+		profile->Stop(PROFILE_GENERATE);
+}
+
+// Read a number of bits from the bit stream into a value
+long long DecodeBits(const unsigned char **read, unsigned char &mask, int bits)
+{
+	const unsigned char *r = *read;
+	char c = *r;
+	unsigned char m = mask;
+	long long value = 0;
+	for (int b=0; b<bits; b++) {
+		value <<= 1;
+		if (c&m)
+			value |= 1;
+		m >>= 1;
+		if (!m) {
+			m = 0x80;
+			c = *++r;
+		}
+	}
+	mask = m;
+	*read = r;
+	return value;
+}
+
+// Read a single bit from a bit stream and return it
+int DecodeBit(const unsigned char **read, unsigned char &mask)
+{
+	const unsigned char *r = *read;
+	char c = *r;
+	unsigned char m = mask;
+
+	int ret = (c&m) ? 1 : 0;
+	m>>=1;
+	if (!m) {
+		mask = 0x80;
+		*read = r+1;
+		return ret;
+	}
+	mask = m;
+	return ret;
+}
+
+// Header of a diff: bucket tables and the inject buffer
+struct DiffHeader {
+	int lenIdxBits;					// bits for the length bucket index
+	int offIdxBits;					// bits for the offset bucket index
+	const unsigned char *lenBits;	// bits in each length bucket
+	const unsigned char *offBits;	// bits in each offset bucket
+	const char *inject;
+	const char *inject_end;
+	const unsigned char *instructions;
+	const unsigned char *diff_end;
+	bool large;						// large file format
+	bool delta;						// delta format, source copies have a delta bit
+	DeltaTable deltas;				// added by delta copies
+	bool backward;					// backward format, decoded from the ends of the buffers
+	size_t source_size;				// sizes in the backward format header
+	size_t target_size;
+
+	// returns false if the diff is too small to hold the header
+	bool Read(const char *diff, size_t diff_size) {
+		const unsigned char *du = (const unsigned char*)diff;
+		diff_end = du + diff_size;
+		if (diff_size<4)
+			return false;
+		large = *du==E8_LARGE_MARKER && du[1]==E8_LARGE_VERSION;
+		delta = *du==E8_LARGE_MARKER && du[1]==E8_DELTA_VERSION;
+		backward = *du==E8_LARGE_MARKER && du[1]==E8_BACKWARD_VERSION;
+		if (large)
+			du += 2;
+		else if (backward) {
+			if (diff_size<E8_BACKWARD_HEADER+4)
+				return false;
+			source_size = size_t(du[2])<<24 | size_t(du[3])<<16 | size_t(du[4])<<8 | du[5];
+			target_size = size_t(du[6])<<24 | size_t(du[7])<<16 | size_t(du[8])<<8 | du[9];
+			du += E8_BACKWARD_HEADER;
+		}
+		else if (delta) {
+			deltas.count = du[2];
+			if (deltas.count<1 || deltas.count>E8_DELTA_COUNT || diff_size<deltas.HeaderSize()+4)
+				return false;
+			du += 3;
+			for (int d=0; d<deltas.count; d++, du += 2)
+				deltas.add[d] = (du[0]<<8) | du[1];
+		} else if (*du==E8_LARGE_MARKER)
+			return false;
+		lenIdxBits = *du & 0xf;
+		offIdxBits = (*du++>>4) & 0xf;
+		if (lenIdxBits>EB_SIZE_BITS_MAX || offIdxBits>EB_SIZE_BITS_MAX)
+			return false;
+		lenBits = du;
+		du += 1<<lenIdxBits;
+		offBits = du;
+		du += 1<<offIdxBits;
+		if ((du+(large ? 8 : 2))>diff_end)
+			return false;
+		int maxBits = large ? E8_VALUE_BITS_MAX : 31;
+		for (const unsigned char *b = lenBits; b<du; b++) {
+			if (*b>maxBits)
+				return false;
+		}
+		unsigned long long inject_size = 0;
+		if (large) {
+			for (int b=0; b<8; b++)
+				inject_size = (inject_size<<8) | *du++;
+		} else {
+			if (*du & 0x80) {
+				inject_size = ((int(du[0]&0x7f)<<8) | int(du[1]))<<16;
+				du += 2;
+				if ((du+2)>diff_end)
+					return false;
+			}
+			inject_size |= ((unsigned char)(du[0])<<8) | (unsigned char)du[1];
+			du += 2;
+		}
+		if ((unsigned long long)(diff_end-du)<inject_size)
+			return false;
+		inject = (const char*)du;
+		inject_end = inject + inject_size;
+		instructions = du + inject_size;
+		return true;
+	}
+
+	// gap before a word of a delta copy (coded as a length) and its delta index
+	long long DeltaWord(const unsigned char **du, unsigned char &mask, int &bucket, int &index) const {
+		bucket = (int)DecodeBits(du, mask, lenIdxBits);
+		long long gap = DecodeBits(du, mask, lenBits[bucket]);
+		index = (int)DecodeBits(du, mask, deltas.IndexBits());
+		return gap;
+	}
+
+	// instruction bit and length bucket index in one lookup:
+	// top bit of entry = copy, lower bits = bits in length
+	int HeadTable(unsigned char *head) const {
+		int headBits = 1 + lenIdxBits;
+		for (int i=0; i<(1<<headBits); i++)
+			head[i] = (unsigned char)((i>>lenIdxBits ? 0x80 : 0) | lenBits[i & ((1<<lenIdxBits)-1)]);
+		return headBits;
+	}
+};
+
+// Block container index, each block is a patch that decodes on its own
+struct BlockIndex {
+	unsigned long long target_size;
+	unsigned long long block_size;		// target bytes in each block
+	size_t count;
+	const char *container;
+	const unsigned char *ends;			// 8 bytes per block
+
+	static unsigned long long Get(const unsigned char *in) {
+		unsigned long long value = 0;
+		for (int b=0; b<8; b++)
+			value = (value<<8) | in[b];
+		return value;
+	}
+	// false if the diff isn't a block container or the index is broken
+	bool Read(const char *diff, size_t diff_size) {
+		const unsigned char *du = (const unsigned char*)diff;
+		if (diff_size<E8_BLOCK_HEADER || du[0]!=E8_LARGE_MARKER || du[1]!=E8_BLOCK_VERSION)
+			return false;
+		target_size = Get(du+2);
+		block_size = Get(du+10);
+		if (target_size && !block_size)
+			return false;
+		unsigned long long blocks = target_size ? (target_size-1)/block_size+1 : 0;
+		if (blocks>(diff_size-E8_BLOCK_HEADER)/8)
+			return false;
+		count = (size_t)blocks;
+		container = diff;
+		ends = du + E8_BLOCK_HEADER;
+		unsigned long long prev = E8_BLOCK_HEADER + 8*blocks;
+		for (size_t b=0; b<count; b++) {
+			unsigned long long end = Get(ends + 8*b);
+			if (end<prev || end>diff_size)
+				return false;
+			prev = end;
+		}
+		return true;
+	}
+	const char *Block(size_t b, size_t &size) const {
+		size_t start = b ? (size_t)Get(ends + 8*(b-1)) : E8_BLOCK_HEADER + 8*count;
+		size = (size_t)Get(ends + 8*b) - start;
+		return container + start;
+	}
+	size_t BlockTarget(size_t b) const {
+		unsigned long long start = b * block_size;
+		return (size_t)((target_size-start)<block_size ? target_size-start : block_size);
+	}
+	size_t Size() const { return count ? (size_t)Get(ends + 8*(count-1)) : E8_BLOCK_HEADER; }
+};
+
+// Decode a bit stream
+long long DecodeBackward(char *out, const char *source, size_t source_size, const DiffHeader &hdr);
+
+size_t Decode(char *out, const char *source, const char *diff, size_t diff_size)
+{
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size))
+		return 0;
+	if (hdr.backward) {
+		long long decoded = DecodeBackward(out, source, hdr.source_size, hdr);
+		return decoded<0 ? 0 : size_t(decoded);
+	}
+	int bitSizeCnt[2] = { hdr.lenIdxBits, hdr.offIdxBits };
+	const unsigned char *bitSize[2] = { hdr.lenBits, hdr.offBits };
+	const char *buf[3];
+	const char *end = hdr.inject_end;
+	const char *start = out;
+	const unsigned char *du = hdr.instructions;
+
+	buf[0] = hdr.inject;
+	buf[1] = source;
+	buf[2] = out;
+	unsigned char mask = 0x80;
+	for (;;) {
+		int buffer = DecodeBit(&du, mask);
+		if (!buffer && buf[0]>=end)
+			break;
+		int lbits = (int)DecodeBits(&du, mask, bitSizeCnt[0]);
+		long long length = DecodeBits(&du, mask, bitSize[0][lbits]);
+		bool delta = false;
+		if (buffer) {
+			int obits = (int)DecodeBits(&du, mask, bitSizeCnt[1]);
+			long long offset = DecodeBits(&du, mask, bitSize[1][obits]);
+			if (DecodeBit(&du, mask))
+				offset = ~offset;
+			if (DecodeBit(&du, mask))
+				buffer = 2;
+			else if (hdr.delta)
+				delta = DecodeBit(&du, mask)!=0;
+			buf[buffer] += offset;
+		}
+		const char *read = buf[buffer];
+		if (delta) {
+			// length is the words, each after a gap of bytes copied as they are
+			for (long long w=0; w<length; w++) {
+				int bucket, index;
+				long long gap = hdr.DeltaWord(&du, mask, bucket, index);
+				for (; gap; --gap)
+					*out++ = *read++;
+				hdr.deltas.Word(out, read, index);
+				out += 2;
+				read += 2;
+			}
+		} else {
+			for (long long move=length; move; --move)
+				*out++ = *read++;
+		}
+		buf[buffer] = read;
+	}
+	return out-start;
+}
+
+// Bit reader for fast decoding, the next bits are kept in the top of a 64 bit
+// buffer that is refilled 8 bytes at a time (zeros after the end of the stream)
+struct BitReader {
+	unsigned long long bits;	// next bit is the top bit
+	int count;					// number of valid bits
+	const unsigned char *read;
+	const unsigned char *end;
+	size_t padding;				// zero bytes added after the end
+
+	BitReader(const unsigned char *r, const unsigned char *e) : bits(0), count(0), read(r), end(e), padding(0) {}
+
+	// make sure there are at least 56 bits in the buffer
+	void Refill() {
+		if (read+8<=end) {
+			unsigned long long word = 0;
+			for (int b=0; b<8; b++)
+				word = (word<<8) | read[b];
+			bits |= word >> count;
+			read += (63-count)>>3;
+			count |= 56;
+		} else {
+			while (count<=56) {
+				if (read<end)
+					bits |= (unsigned long long)*read++ << (56-count);
+				else
+					padding++;
+				count += 8;
+			}
+		}
+	}
+	// look at the next 1-32 bits
+	unsigned int Peek(int num) const { return (unsigned int)(bits >> (64-num)); }
+	void Skip(int num) {
+		bits <<= num;
+		count -= num;
+	}
+	// read 0-32 bits
+	unsigned int Get(int num) {
+		if (!num)
+			return 0;
+		unsigned int value = Peek(num);
+		Skip(num);
+		return value;
+	}
+	// read 0-63 bits (refills between the top and the low 32 bits)
+	unsigned long long GetLong(int num) {
+		if (num<=32)
+			return Get(num);
+		unsigned long long high = Get(num-32);
+		Refill();
+		return (high<<32) | Get(32);
+	}
+	// true if more bits were read than the stream holds
+	bool Overrun() const { return padding*8 > size_t(count); }
+};
+
+// Copy a run within the same buffer where the read may overlap the write,
+// repeating the bytes between read and out in growing chunks
+char* CopyOverlap(char *out, const char *read, size_t length)
+{
+	while (length) {
+		size_t chunk = size_t(out-read);
+		if (chunk>length)
+			chunk = length;
+		memcpy(out, read, chunk);
+		out += chunk;
+		length -= chunk;
+	}
+	return out;
+}
+
+// Decode a backward format patch from the ends of the buffers down, one byte
+// at a time so it decodes over its source. Returns the number of bytes decoded
+// or -1 if the patch reads outside the source, the injected bytes or the output.
+long long DecodeBackward(char *out, const char *source, size_t source_size, const DiffHeader &hdr)
+{
+	if (hdr.source_size>source_size)
+		return -1;
+	const char *buf[3] = { hdr.inject, source, out };
+	long long ptr[3];		// end of the next bytes read from each buffer
+	ptr[0] = hdr.inject_end-hdr.inject;
+	ptr[1] = (long long)hdr.source_size;
+	ptr[2] = (long long)hdr.target_size;
+	long long write = (long long)hdr.target_size;
+	unsigned char head[1<<(1+EB_SIZE_BITS_MAX)];
+	int headBits = hdr.HeadTable(head);
+	BitReader bits(hdr.instructions, hdr.diff_end);
+	for (;;) {
+		bits.Refill();
+		unsigned char h = head[bits.Peek(headBits)];
+		if (!(h & 0x80) && ptr[0]<=0)
+			break;
+		bits.Skip(headBits);
+		long long length = (long long)bits.GetLong(h & 0x7f);
+		int buffer = 0;
+		if (h & 0x80) {
+			bits.Refill();
+			long long offset = (long long)bits.GetLong(hdr.offBits[bits.Get(hdr.offIdxBits)]);
+			if (bits.Get(1))
+				offset = ~offset;
+			buffer = bits.Get(1) ? 2 : 1;
+			ptr[buffer] += offset;
+		}
+		// target copies read bytes already written above the output
+		long long read = ptr[buffer];
+		if (!length || length>write || read<length || (buffer==1 && read>(long long)hdr.source_size) ||
+			(buffer==2 && (read<=write || read>(long long)hdr.target_size)))
+			return -1;
+		const char *r = buf[buffer] + read;
+		char *w = out + write;
+		for (long long move=length; move; --move)
+			*--w = *--r;
+		ptr[buffer] = read-length;
+		write -= length;
+	}
+	return (long long)hdr.target_size - write;
+}
+
+// Decode a patch made with -inplace over its source, the buffer holds the source
+// and is large enough for the target. Decode copies forward one byte at a time
+// so a source copy may read from the bytes it is about to write (backward format
+// patches are decoded from the end down).
+size_t DecodeInPlace(char *buffer, const char *diff, size_t diff_size)
+{
+	return Decode(buffer, buffer, diff, diff_size);
+}
+
+// Decode a bit stream with a 64 bit reader and block copies, same result as Decode
+size_t DecodeFast(char *out, const char *source, const char *diff, size_t diff_size)
+{
+	const char *start = out;
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size))
+		return 0;
+	if (hdr.backward) {
+		long long decoded = DecodeBackward(out, source, hdr.source_size, hdr);
+		return decoded<0 ? 0 : size_t(decoded);
+	}
+	int offIdxBits = hdr.offIdxBits;
+	const unsigned char *offBits = hdr.offBits;
+	const char *inject = hdr.inject;
+	const char *inject_end = hdr.inject_end;
+	unsigned char head[1<<(1+EB_SIZE_BITS_MAX)];
+	int headBits = hdr.HeadTable(head);
+
+	const char *src = source;
+	const char *trg = out;
+	BitReader bits(hdr.instructions, hdr.diff_end);
+	for (;;) {
+		bits.Refill();
+		unsigned char h = head[bits.Peek(headBits)];
+		if (!(h & 0x80) && inject>=inject_end)
+			break;
+		bits.Skip(headBits);
+		size_t length = (size_t)bits.GetLong(h & 0x7f);
+		if (!(h & 0x80)) {
+			memcpy(out, inject, length);
+			inject += length;
+			out += length;
+			continue;
+		}
+		bits.Refill();
+		long long offset = (long long)bits.GetLong(offBits[bits.Get(offIdxBits)]);
+		if (bits.Get(1))
+			offset = ~offset;
+		if (bits.Get(1)) {
+			// target buffer
+			trg += offset;
+			if (size_t(out-trg)>=length)
+				memcpy(out, trg, length);
+			else
+				CopyOverlap(out, trg, length);
+			trg += length;
+		} else if (hdr.delta && bits.Get(1)) {
+			// delta copy of length words
+			src += offset;
+			for (size_t w=0; w<length; w++) {
+				bits.Refill();
+				size_t gap = bits.Get(hdr.lenBits[bits.Get(hdr.lenIdxBits)]);
+				int index = (int)bits.Get(hdr.deltas.IndexBits());
+				memcpy(out, src, gap);
+				hdr.deltas.Word(out+gap, src+gap, index);
+				out += gap+2;
+				src += gap+2;
+			}
+			continue;
+		} else {
+			src += offset;
+			memcpy(out, src, length);
+			src += length;
+		}
+		out += length;
+	}
+	return out-start;
+}
+
+// Receives decoded output in chunks
+struct DecodeSink {
+	virtual ~DecodeSink() {}
+	virtual bool Write(const char *data, size_t size) = 0;
+	// read back earlier output that is no longer in the window, false if not possible
+	virtual bool ReadBack(size_t, char *, size_t) { return false; }
+};
+
+// Write decoded output to a file, target copies beyond the window are read back
+struct FileSink : public DecodeSink {
+	FILE *f;
+	FileSink(FILE *file) : f(file) {}
+	bool Write(const char *data, size_t size) {
+		return fwrite(data, 1, size, f)==size;
+	}
+	bool ReadBack(size_t offset, char *data, size_t size) {
+		fflush(f);
+		bool ok = fseeko(f, (long long)offset, SEEK_SET)==0 && fread(data, 1, size, f)==size;
+		fseek(f, 0, SEEK_END);
+		return ok;
+	}
+};
+
+// Pass decoded output to a function
+struct CallbackSink : public DecodeSink {
+	bool (*write)(void *user, const char *data, size_t size);
+	void *user;
+	CallbackSink(bool (*w)(void*, const char*, size_t), void *u) : write(w), user(u) {}
+	bool Write(const char *data, size_t size) { return write(user, data, size); }
+};
+
+// Decoded output is kept in a window of the most recent bytes and
+// flushed to a sink when full. Returns false if a write fails or a
+// target copy reaches beyond the window and the sink can't read back.
+struct DecodeWindow {
+	DecodeSink &sink;
+	char *ring;			// most recent output
+	char *copy;			// bytes being copied from earlier output
+	size_t size;		// size of ring
+	size_t total;		// bytes decoded
+	size_t flushed;		// bytes written to the sink
+
+	DecodeWindow(DecodeSink &s, size_t window) : sink(s), size(window), total(0), flushed(0) {
+		ring = (char*)malloc(size);
+		copy = (char*)malloc(size/2);
+	}
+	~DecodeWindow() {
+		free(ring);
+		free(copy);
+	}
+
+	bool Flush() {
+		while (flushed<total) {
+			size_t at = flushed % size;
+			size_t chunk = total-flushed;
+			if (chunk>(size-at))
+				chunk = size-at;
+			if (!sink.Write(ring+at, chunk))
+				return false;
+			flushed += chunk;
+		}
+		return true;
+	}
+	bool Emit(const char *data, size_t length) {
+		while (length) {
+			size_t chunk = length<(size/2) ? length : size/2;
+			if ((total+chunk-flushed)>size && !Flush())
+				return false;
+			size_t at = total % size;
+			size_t first = chunk<(size-at) ? chunk : size-at;
+			memcpy(ring+at, data, first);
+			memcpy(ring, data+first, chunk-first);
+			total += chunk;
+			data += chunk;
+			length -= chunk;
+		}
+		return true;
+	}
+	// copy earlier output, may overlap with the bytes being added
+	bool Repeat(size_t offset, size_t length) {
+		while (length) {
+			size_t chunk = total-offset;
+			if (chunk>length)
+				chunk = length;
+			if (chunk>(size/2))
+				chunk = size/2;
+			if ((offset+size)>=total) {
+				size_t at = offset % size;
+				size_t first = chunk<(size-at) ? chunk : size-at;
+				memcpy(copy, ring+at, first);
+				memcpy(copy+first, ring, chunk-first);
+			} else if (!Flush() || !sink.ReadBack(offset, copy, chunk))
+				return false;
+			if (!Emit(copy, chunk))
+				return false;
+			offset += chunk;
+			length -= chunk;
+		}
+		return true;
+	}
+};
+
+// Decode a bit stream into a sink keeping only a window of the output in memory.
+// Returns the number of bytes decoded or -1 if the output could not be completed
+// (or the patch reads outside the source, the injected bytes or the output).
+long long DecodeStream(DecodeSink &sink, const char *source, size_t source_size,
+					   const char *diff, size_t diff_size, size_t window)
+{
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size) || window<2)
+		return -1;
+	if (hdr.backward) {
+		// the output is written from the end so all of it is kept in memory
+		char *out = (char*)malloc(hdr.target_size ? hdr.target_size : 1);
+		long long decoded = DecodeBackward(out, source, source_size, hdr);
+		if (decoded>=0 && !sink.Write(out, size_t(decoded)))
+			decoded = -1;
+		free(out);
+		return decoded;
+	}
+	const char *inject = hdr.inject;
+	unsigned char head[1<<(1+EB_SIZE_BITS_MAX)];
+	int headBits = hdr.HeadTable(head);
+
+	DecodeWindow out(sink, window);
+	long long src = 0;		// source copies read from the source position
+	long long trg = 0;		// target copies read from the output position
+	BitReader bits(hdr.instructions, hdr.diff_end);
+	for (;;) {
+		bits.Refill();
+		unsigned char h = head[bits.Peek(headBits)];
+		if (!(h & 0x80) && inject>=hdr.inject_end)
+			break;
+		bits.Skip(headBits);
+		size_t length = (size_t)bits.GetLong(h & 0x7f);
+		bool ok;
+		if (!(h & 0x80)) {
+			ok = length<=size_t(hdr.inject_end-inject) && out.Emit(inject, length);
+			inject += length;
+		} else {
+			bits.Refill();
+			long long offset = (long long)bits.GetLong(hdr.offBits[bits.Get(hdr.offIdxBits)]);
+			if (bits.Get(1))
+				offset = ~offset;
+			if (bits.Get(1)) {
+				trg += offset;
+				ok = trg>=0 && size_t(trg)<out.total && out.Repeat(size_t(trg), length);
+				trg += length;
+			} else if (hdr.delta && bits.Get(1)) {
+				// delta copy of length words
+				src += offset;
+				ok = src>=0;
+				for (size_t w=0; ok && w<length; w++) {
+					bits.Refill();
+					size_t gap = bits.Get(hdr.lenBits[bits.Get(hdr.lenIdxBits)]);
+					int index = (int)bits.Get(hdr.deltas.IndexBits());
+					if (size_t(src)+gap+2>source_size)
+						return -1;
+					char word[2];
+					hdr.deltas.Word(word, source+src+gap, index);
+					ok = out.Emit(source+src, gap) && out.Emit(word, 2);
+					src += gap+2;
+				}
+			} else {
+				src += offset;
+				ok = src>=0 && size_t(src)<=source_size && length<=source_size-size_t(src) &&
+					out.Emit(source+src, length);
+				src += length;
+			}
+		}
+		if (!ok || bits.Overrun())
+			return -1;
+	}
+	if (!out.Flush())
+		return -1;
+	return (long long)out.total;
+}
+
+// Get size of a bit stream without the source
+size_t GetLength(const char *diff, size_t diff_size)
+{
+	BlockIndex blocks;
+	if (blocks.Read(diff, diff_size))
+		return (size_t)blocks.target_size;
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size) || hdr.instructions>=hdr.diff_end)
+		return 0;
+	int bitSizeCnt[2] = { hdr.lenIdxBits, hdr.offIdxBits };
+	const unsigned char *bitSize[2] = { hdr.lenBits, hdr.offBits };
+	const char *inject = hdr.inject;
+	const char *end = hdr.inject_end;
+	const unsigned char *du = hdr.instructions;
+
+	size_t target_size = 0;
+
+	unsigned char mask = 0x80;
+	//	int num = 0;
+	for (;;) {
+		int buffer = DecodeBit(&du, mask);
+		if (!buffer && inject>=end)
+			break;
+		long long len = DecodeBits(&du, mask, bitSize[0][DecodeBits(&du, mask, bitSizeCnt[0])]);
+		if (buffer) {
+			DecodeBits(&du, mask, bitSize[1][DecodeBits(&du, mask, bitSizeCnt[1])]);
+			if (!(DecodeBits(&du, mask, 2) & 1) && hdr.delta && DecodeBit(&du, mask)) {
+				// delta copy, len is the words
+				int bucket, index;
+				long long words = len;
+				for (len = 2*words; words; --words)
+					len += hdr.DeltaWord(&du, mask, bucket, index);
+			}
+		}
+		else
+			inject += len;
+		target_size += len;
+	}
+	return target_size;
+}
+
+// Block container
+// ---------------
+// Blocks of the target are encoded on their own from the whole source so
+// they can be decoded in any order, on host threads or one bank at a time.
+
+// Run work(i) for i in 0..count-1 on threads, each thread takes the next unstarted index
+template<class Work> void BatchPool(int threads, int count, Work work)
+{
+	std::atomic<int> next(0);
+	int num_threads = threads<count ? threads : count;
+	std::thread *workers = new std::thread[num_threads>0 ? num_threads : 1];
+	for (int t=0; t<num_threads; t++) {
+		workers[t] = std::thread([&]() {
+			for (int i = next++; i<count; i = next++)
+				work(i);
+		});
+	}
+	for (int t=0; t<num_threads; t++)
+		workers[t].join();
+	delete[] workers;
+}
+
+// Encode the target in blocks on threads with the settings of an encoder, the
+// source index is built once if the engine can share it. Returns the container.
+char *EncodeBlocks(const Encoder &options, bool optimal, const char *source, size_t source_size,
+				   const char *target, size_t target_size, size_t block_size, int threads,
+				   size_t &result_size)
+{
+	size_t count = target_size ? (target_size-1)/block_size+1 : 0;
+	MatchFinder *source_index = options.source_index;
+	if (!source_index && count>1) {
+		source_index = CreateMatchFinder(options.engine, options.level, source, source_size, false);
+		if (!source_index->Shared()) {
+			delete source_index;
+			source_index = nullptr;
+		}
+	}
+	char **patches = (char**)calloc(count ? count : 1, sizeof(char*));
+	size_t *sizes = (size_t*)calloc(count ? count : 1, sizeof(size_t));
+	BatchPool(threads, (int)count, [&](int b) {
+		size_t start = b * block_size;
+		size_t size = (target_size-start)<block_size ? target_size-start : block_size;
+		Encoder encode;
+		encode.engine = options.engine;
+		encode.level = options.level;
+		encode.large = options.large;
+		encode.cycle_model = options.cycle_model;
+		encode.cycle_weight = options.cycle_weight;
+		encode.limits = options.limits;
+		encode.source_index = source_index;
+		if (optimal)
+			encode.BuildOptimal(source, source_size, target+start, size);
+		else
+			encode.Build(source, source_size, target+start, size);
+		encode.Optimize();
+		encode.Generate();
+		patches[b] = encode.result;
+		sizes[b] = encode.result_size;
+		encode.result = nullptr;
+	});
+	if (source_index!=options.source_index)
+		delete source_index;
+
+	result_size = E8_BLOCK_HEADER + 8*count;
+	for (size_t b=0; b<count; b++)
+		result_size += sizes[b];
+	char *container = (char*)malloc(result_size);
+	unsigned char *out = (unsigned char*)container;
+	unsigned long long header[2] = { target_size, block_size };
+	*out++ = E8_LARGE_MARKER;
+	*out++ = E8_BLOCK_VERSION;
+	for (int h=0; h<2; h++) {
+		for (int s=56; s>=0; s-=8)
+			*out++ = (unsigned char)(header[h]>>s);
+	}
+	unsigned long long end = E8_BLOCK_HEADER + 8*count;
+	char *next = container + end;
+	for (size_t b=0; b<count; b++) {
+		end += sizes[b];
+		for (int s=56; s>=0; s-=8)
+			*out++ = (unsigned char)(end>>s);
+		memcpy(next, patches[b], sizes[b]);
+		next += sizes[b];
+		free(patches[b]);
+	}
+	free(patches);
+	free(sizes);
+	return container;
+}
+
+// Decode a block container into a sink, as many blocks as threads are decoded
+// at a time and written in order. Returns the number of bytes decoded or -1.
+long long DecodeBlocks(DecodeSink &sink, const char *source, const char *diff, size_t diff_size, int threads)
+{
+	BlockIndex blocks;
+	if (!blocks.Read(diff, diff_size))
+		return -1;
+	if (threads<1)
+		threads = 1;
+	size_t block_size = (size_t)blocks.block_size;
+	char *out = (char*)malloc(block_size ? block_size*threads : 1);
+	bool *ok = (bool*)malloc(threads*sizeof(bool));
+	long long total = 0;
+	for (size_t first=0; first<blocks.count; first+=threads) {
+		int group = (blocks.count-first)<(size_t)threads ? int(blocks.count-first) : threads;
+		BatchPool(group, group, [&](int i) {
+			size_t size;
+			const char *patch = blocks.Block(first+i, size);
+			size_t target_size = blocks.BlockTarget(first+i);
+			ok[i] = GetLength(patch, size)==target_size &&
+				DecodeFast(out + i*block_size, source, patch, size)==target_size;
+		});
+		for (int i=0; i<group && total>=0; i++) {
+			size_t target_size = blocks.BlockTarget(first+i);
+			if (!ok[i] || !sink.Write(out + i*block_size, target_size))
+				total = -1;
+			else
+				total += target_size;
+		}
+		if (total<0)
+			break;
+	}
+	free(out);
+	free(ok);
+	return total;
+}
+
+// Decode a patch or a block container into a sink
+long long DecodePatch(DecodeSink &sink, const char *source, size_t source_size,
+					  const char *diff, size_t diff_size, size_t window, int threads)
+{
+	BlockIndex blocks;
+	if (blocks.Read(diff, diff_size))
+		return DecodeBlocks(sink, source, diff, diff_size, threads);
+	return DecodeStream(sink, source, source_size, diff, diff_size, window);
+}
+
+// Checksum trailer
+// ----------------
+
+// CRC-32 (the polynomial of zip and png), 8 bytes at a time
+struct Crc32Table {
+	unsigned int t[8][256];
+	Crc32Table() {
+		for (unsigned int i=0; i<256; i++) {
+			unsigned int c = i;
+			for (int k=0; k<8; k++)
+				c = (c & 1) ? (0xedb88320 ^ (c>>1)) : (c>>1);
+			t[0][i] = c;
+		}
+		for (int s=1; s<8; s++) {
+			for (int i=0; i<256; i++)
+				t[s][i] = (t[s-1][i]>>8) ^ t[0][t[s-1][i] & 0xff];
+		}
+	}
+};
+
+// continue a checksum with more data, start with 0
+unsigned int Crc32(unsigned int crc, const char *data, size_t size)
+{
+	static const Crc32Table table;
+	const unsigned int (*t)[256] = table.t;
+	const unsigned char *p = (const unsigned char*)data;
+	crc = ~crc;
+	for (; size>=8; size-=8, p+=8) {
+		unsigned int a = crc ^ (p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24));
+		unsigned int b = p[4] | (p[5]<<8) | (p[6]<<16) | ((unsigned int)p[7]<<24);
+		crc = t[7][a & 0xff] ^ t[6][(a>>8) & 0xff] ^ t[5][(a>>16) & 0xff] ^ t[4][a>>24] ^
+			  t[3][b & 0xff] ^ t[2][(b>>8) & 0xff] ^ t[1][(b>>16) & 0xff] ^ t[0][b>>24];
+	}
+	while (size--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc>>8);
+	return ~crc;
+}
+
+// Sizes and checksums of the source and target after the instructions
+struct PatchTrailer {
+	unsigned long long source_size;
+	unsigned long long target_size;
+	unsigned int source_crc;
+	unsigned int target_crc;
+
+	PatchTrailer() : source_size(0), target_size(0), source_crc(0), target_crc(0) {}
+
+	void Set(const char *source, size_t ssize, const char *target, size_t tsize) {
+		source_size = ssize;
+		target_size = tsize;
+		source_crc = Crc32(0, source, ssize);
+		target_crc = Crc32(0, target, tsize);
+	}
+	static void Put(char *out, unsigned long long value, int bytes) {
+		for (int b=0; b<bytes; b++)
+			out[b] = (char)(value>>(b*8));
+	}
+	static unsigned long long Get(const char *in, int bytes) {
+		unsigned long long value = 0;
+		for (int b=0; b<bytes; b++)
+			value |= (unsigned long long)(unsigned char)in[b]<<(b*8);
+		return value;
+	}
+	void Write(char *out) const {
+		Put(out, source_size, 8);
+		Put(out+8, source_crc, 4);
+		Put(out+12, target_size, 8);
+		Put(out+20, target_crc, 4);
+		memcpy(out+24, E8_TRAILER_MAGIC, 4);
+	}
+	// false if the patch has no trailer, the instructions before
+	// the trailer must decode to the target size
+	bool Read(const char *diff, size_t diff_size) {
+		if (diff_size<=E8_TRAILER_SIZE || memcmp(diff+diff_size-4, E8_TRAILER_MAGIC, 4))
+			return false;
+		const char *in = diff+diff_size-E8_TRAILER_SIZE;
+		source_size = Get(in, 8);
+		source_crc = (unsigned int)Get(in+8, 4);
+		target_size = Get(in+12, 8);
+		target_crc = (unsigned int)Get(in+20, 4);
+		return GetLength(diff, diff_size-E8_TRAILER_SIZE)==target_size;
+	}
+};
+
+// append a checksum trailer of the source and target to the patch
+void Encoder::AddTrailer(const char *source, size_t source_size, const char *target, size_t target_size)
+{
+	PatchTrailer trailer;
+	trailer.Set(source, source_size, target, target_size);
+	result = (char*)realloc(result, result_size+E8_TRAILER_SIZE);
+	trailer.Write(result+result_size);
+	result_size += E8_TRAILER_SIZE;
+}
+
+// Checksum of decoded output on its way to another sink
+struct ChecksumSink : public DecodeSink {
+	DecodeSink &next;
+	unsigned int crc;
+	ChecksumSink(DecodeSink &n) : next(n), crc(0) {}
+	bool Write(const char *data, size_t size) {
+		crc = Crc32(crc, data, size);
+		return next.Write(data, size);
+	}
+	bool ReadBack(size_t offset, char *data, size_t size) { return next.ReadBack(offset, data, size); }
+};
+
+// Compare decoded output with the target as it is decoded,
+// earlier output is read back from the target
+struct CompareSink : public DecodeSink {
+	const char *target;
+	size_t target_size;
+	size_t pos;			// bytes compared
+	bool differs;
+
+	CompareSink(const char *t, size_t s) : target(t), target_size(s), pos(0), differs(false) {}
+	bool Write(const char *data, size_t size) {
+		if (size<=(target_size-pos) && !memcmp(data, target+pos, size)) {
+			pos += size;
+			return true;
+		}
+		for (size_t o=0; o<size; o++) {
+			if (pos>=target_size || data[o]!=target[pos]) {
+				differs = true;
+				return false;
+			}
+			pos++;
+		}
+		return true;
+	}
+	bool ReadBack(size_t offset, char *data, size_t size) {
+		if ((offset+size)>pos)
+			return false;
+		memcpy(data, target+offset, size);
+		return true;
+	}
+};
+
+// Decode a patch a window at a time (a block container a group of blocks
+// at a time) and compare with the target without another copy of the
+// target in memory. Returns false and
+// the offset of the first byte that is wrong or missing if the
+// patch does not decode to the target.
+bool VerifyPatch(const char *source, size_t source_size, const char *target, size_t target_size,
+				 const char *diff, size_t diff_size, size_t &first_diff, int threads = 1)
+{
+	CompareSink sink(target, target_size);
+	long long decoded = DecodePatch(sink, source, source_size, diff, diff_size, E8_VERIFY_WINDOW, threads);
+	first_diff = sink.pos;
+	return !sink.differs && decoded==(long long)target_size;
+}
+
+struct InputFile;
+
+// Reference files concatenated into one source buffer. Copies can read from
+// any of them and across the ends, the decoder is given the same files next
+// to each other in memory in the same order.
+struct SourceSet {
+	int count;
+	const char **names;
+	size_t *starts;				// offset of each file in the source (count+1)
+	InputFile *files;
+	char *joined;				// the files copied together if there is more than one
+	const char *data;
+	size_t size;
+
+	SourceSet() : count(0), names(nullptr), starts(nullptr), files(nullptr),
+		joined(nullptr), data(nullptr), size(0) {}
+	~SourceSet();
+
+	// index of the file holding a source offset
+	int Find(size_t offset) const {
+		int lo = 0, hi = count-1;
+		while (lo<hi) {
+			int mid = (lo+hi+1)>>1;
+			if (starts[mid]<=offset)
+				lo = mid;
+			else
+				hi = mid-1;
+		}
+		return lo;
+	}
+};
+
+// Print the copies and bytes each reference file contributed to a patch
+void PrintSourceUse(const SourceSet &sources, const char *diff, size_t diff_size)
+{
+	DiffHeader hdr;
+	if (!sources.count || !hdr.Read(diff, diff_size) || hdr.instructions>=hdr.diff_end)
+		return;
+	long long *copies = (long long*)calloc(2*sources.count, sizeof(long long));
+	long long *bytes = copies + sources.count;
+	const char *inject = hdr.inject;
+	const unsigned char *du = hdr.instructions;
+	unsigned char mask = 0x80;
+	long long src = hdr.backward ? (long long)hdr.source_size : 0, total = 0;
+	for (;;) {
+		int buffer = DecodeBit(&du, mask);
+		if (!buffer && inject>=hdr.inject_end)
+			break;
+		long long len = DecodeBits(&du, mask, hdr.lenBits[DecodeBits(&du, mask, hdr.lenIdxBits)]);
+		if (!buffer) {
+			total += len;
+			inject += len;
+			continue;
+		}
+		long long offs = DecodeBits(&du, mask, hdr.offBits[DecodeBits(&du, mask, hdr.offIdxBits)]);
+		if (DecodeBit(&du, mask))
+			offs = ~offs;
+		if (DecodeBit(&du, mask)) {
+			total += len;
+			continue;
+		}
+		if (hdr.delta && DecodeBit(&du, mask)) {
+			int bucket, index;
+			long long words = len;
+			for (len = 2*words; words; --words)
+				len += hdr.DeltaWord(&du, mask, bucket, index);
+		}
+		total += len;
+		src += offs;
+		if (hdr.backward)
+			src -= len;		// read down from the pointer
+		if (src<0 || size_t(src+len)>sources.size)
+			break;
+		// a copy counts for the file it starts in, the bytes for each file it reads
+		int f = sources.Find(size_t(src));
+		copies[f]++;
+		for (long long pos = src, end = src+len; pos<end; f++) {
+			long long stop = (long long)sources.starts[f+1]<end ? (long long)sources.starts[f+1] : end;
+			bytes[f] += stop-pos;
+			pos = stop;
+		}
+		if (!hdr.backward)
+			src += len;
+	}
+	for (int f=0; f<sources.count; f++) {
+		printf("Reference %s: %lld copies, %lld bytes (%.1f%% of target)\n", sources.names[f],
+			   copies[f], bytes[f], total ? 100.0 * bytes[f] / total : 0.0);
+	}
+	free(copies);
+}
+
+// Names of buffers for creating a csv report
+const char *aBufferNames[] = {
+	"Inject",
+	"Source",
+	"Target",
+	"Delta"
+};
+
+// Create a spreadsheet of instructions from a bit stream, source copies
+// are named by the reference file and offset in it if there are several
+bool GetStats(const char *filename, const SourceSet &sources, const char *diff, size_t diff_size)
+{
+	const char *source = sources.data;
+	size_t source_size = sources.size;
+	size_t out_size = GetLength(diff, diff_size);
+	DiffHeader hdr;
+	if (!out_size || !hdr.Read(diff, diff_size))
+		return false;
+
+	if (FILE *f = fopen(filename, "w")) {
+		int bitSizeCnt[2] = { hdr.lenIdxBits, hdr.offIdxBits };
+		char *start = (char*)malloc(out_size);
+		char *out = start;
+		const unsigned char *bitSize[2] = { hdr.lenBits, hdr.offBits };
+		const char *buf[3], *orig[3];
+		const char *end = hdr.inject_end;
+		const unsigned char *du = hdr.instructions;
+
+		int gaps[E8_DELTA_WORDS], indices[E8_DELTA_WORDS];	// words of a delta copy
+		long long words = 0, w;
+
+		fprintf(f, "name,target,offset,length,data\n");
+		orig[0] = buf[0] = hdr.inject;
+		orig[1] = buf[1] = source;
+		orig[2] = buf[2] = out;
+		bool back = hdr.backward;
+		if (back) {
+			// decoded first, the instructions move the pointers down from the ends
+			if (source && DecodeBackward(start, source, source_size, hdr)!=(long long)out_size) {
+				printf("Source file is not valid (not large enough)\n");
+				source = nullptr;
+			}
+			buf[0] = end;
+			buf[1] = orig[1] + hdr.source_size;
+			buf[2] = out = start + out_size;
+		}
+		unsigned char mask = 0x80;
+		for (;;) {
+			int buffer = DecodeBit(&du, mask);
+			if (!buffer && (back ? buf[0]<=orig[0] : buf[0]>=end))
+				break;
+			int lbits = (int)DecodeBits(&du, mask, bitSizeCnt[0]);
+			long long length = DecodeBits(&du, mask, bitSize[0][lbits]);
+			long long offs = -1;
+			bool delta = false;
+			if (buffer) {
+				int obits = (int)DecodeBits(&du, mask, bitSizeCnt[1]);
+				offs = DecodeBits(&du, mask, bitSize[1][obits]);
+				if (DecodeBit(&du, mask))
+					offs = ~offs;
+				if (DecodeBit(&du, mask))
+					buffer = 2;
+				else if (hdr.delta)
+					delta = DecodeBit(&du, mask)!=0;
+				buf[buffer] += offs;
+			}
+			if (delta && length>E8_DELTA_WORDS)
+				break;
+			if (delta) {
+				// length is the bytes written, the words are read first
+				int bucket;
+				for (words = length, length = 2*words, w = 0; w<words; w++) {
+					gaps[w] = (int)hdr.DeltaWord(&du, mask, bucket, indices[w]);
+					length += gaps[w];
+				}
+			}
+			if (back) {
+				buf[buffer] -= length;
+				out -= length;
+			}
+			const char *data = out, *bufptr = buf[buffer];
+			if (source && !back) {
+				if (buffer==1 && size_t(buf[1]+length-source)>source_size) {
+					printf("Source file is not valid (not large enough)\n");
+					source = nullptr;
+				} else if ((out+length)>(start+out_size)) {
+				} else if (delta) {
+					for (long long w=0; w<words; w++) {
+						for (int g=0; g<gaps[w]; g++)
+							*out++ = *buf[1]++;
+						hdr.deltas.Word(out, buf[1], indices[w]);
+						out += 2;
+						buf[1] += 2;
+					}
+				} else {
+					const char *read = buf[buffer];
+					for (long long move=length; move; --move)
+						*out++ = *read++;
+					buf[buffer] = read;
+				}
+			} else if (!back) {
+				out += length;
+				buf[buffer] += length;
+			}
+			char info[33], *pi=info, bufOffs[21];
+			const char *name = aBufferNames[delta ? 3 : buffer];
+			if (source) {
+				int il = length<16 ? (int)length : 16;
+				for (int i=0; i<il; i++) {
+					*pi++ = data[i]<=' ' ? '.' : data[i];
+					if (data[i]=='"')
+						*pi++ = '"';
+				}
+				*pi = 0;
+			} else
+				info[0] = 0;
+			if (buffer==1 && sources.count>1 && bufptr>=orig[1] && size_t(bufptr-orig[1])<source_size) {
+				int file = sources.Find(size_t(bufptr-orig[1]));
+				name = sources.names[file];
+				snprintf(bufOffs, sizeof(bufOffs), "0x%llx", (long long)(bufptr-orig[1]-sources.starts[file]));
+			} else if (buffer)
+				snprintf(bufOffs, sizeof(bufOffs), "0x%llx", (long long)(bufptr-orig[buffer]));
+			else
+				bufOffs[0] = 0;
+			fprintf(f, "%s,0x%llx,%s,0x%llx,\"%s\"\n", name,
+					(long long)(data-start), bufOffs, length, info);
+		}
+		// clean up
+		free(start);
+		fclose(f);
+		return true;
+	}
+	return false;
+}
+
+const char *aStatFieldNames[PatchStats::FIELDS] = {
+	"instruction",
+	"length_bucket",
+	"length_value",
+	"offset_bucket",
+	"offset_value",
+	"sign",
+	"buffer"
+};
+
+// Fill in stats from the instructions of a patch
+bool ReadStats(PatchStats &stats, const char *diff, size_t diff_size)
+{
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size) || hdr.instructions>=hdr.diff_end)
+		return false;
+	stats.Begin((long long)GetLength(diff, diff_size));
+	stats.Tables((long long)(hdr.inject - diff)*8, hdr.lenIdxBits, (const char*)hdr.lenBits,
+				 hdr.offIdxBits, (const char*)hdr.offBits);
+	stats.delta_format = hdr.delta;
+	const char *inject = hdr.inject;
+	const unsigned char *du = hdr.instructions;
+	unsigned char mask = 0x80;
+	for (;;) {
+		int buffer = DecodeBit(&du, mask);
+		if (!buffer && inject>=hdr.inject_end)
+			break;
+		int len_bucket = (int)DecodeBits(&du, mask, hdr.lenIdxBits);
+		long long len = DecodeBits(&du, mask, hdr.lenBits[len_bucket]);
+		int off_bucket = 0;
+		if (buffer) {
+			off_bucket = (int)DecodeBits(&du, mask, hdr.offIdxBits);
+			DecodeBits(&du, mask, hdr.offBits[off_bucket]);
+			DecodeBit(&du, mask);
+			buffer += DecodeBit(&du, mask);
+			if (buffer==1 && hdr.delta && DecodeBit(&du, mask))
+				buffer = 3;
+		} else
+			inject += len;
+		if (buffer==3) {
+			// the words are read first for the bytes the delta copy writes
+			int buckets[E8_DELTA_WORDS], index;
+			long long words = len;
+			if (words>E8_DELTA_WORDS)
+				return false;
+			for (long long w=len=0; w<words; w++)
+				len += hdr.DeltaWord(&du, mask, buckets[w], index) + 2;
+			stats.Instr(buffer, len, len_bucket, off_bucket);
+			for (long long w=0; w<words; w++)
+				stats.Word(buckets[w], hdr.deltas.IndexBits());
+		} else
+			stats.Instr(buffer, len, len_bucket, off_bucket);
+	}
+	stats.End();
+	return true;
+}
+
+// Save the stats as json
+bool PatchStats::Write(const char *filename) const
+{
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\n\t\"target_size\": %lld,\n\t\"patch_size\": %lld,\n\t\"header_bits\": %lld,\n",
+			target_size, PatchSize(), header_bits);
+	const char *aTypeNames[3] = { "inject", "source", "target" };
+	fprintf(f, "\t\"instructions\": {");
+	for (int t=0; t<3; t++) {
+		fprintf(f, "%s\n\t\t\"%s\": { \"count\": %lld, \"bytes\": %lld }", t ? "," : "",
+				aTypeNames[t], count[t], bytes[t]);
+	}
+	fprintf(f, "\n\t},\n\t\"field_bits\": {\n\t\t\"inject_bytes\": %lld", bytes[0]*8);
+	for (int b=0; b<FIELDS; b++)
+		fprintf(f, ",\n\t\t\"%s\": %lld", aStatFieldNames[b], field_bits[b]);
+	fprintf(f, "\n\t},\n");
+	const char *aHistNames[2] = { "length_buckets", "offset_buckets" };
+	for (int h=0; h<2; h++) {
+		fprintf(f, "\t\"%s\": [", aHistNames[h]);
+		for (int b=0; b<(1<<index_bits[h]); b++) {
+			fprintf(f, "%s\n\t\t{ \"bits\": %d, \"count\": %lld }", b ? "," : "",
+					bucket_bits[h][b], histogram[h][b]);
+		}
+		fprintf(f, "\n\t],\n");
+	}
+	fprintf(f, "\t\"region_size\": %lld,\n\t\"regions\": [", region_size);
+	int regions = target_size ? int((target_size+region_size-1)/region_size) : 0;
+	for (int r=0; r<regions; r++) {
+		long long size = r<regions-1 ? region_size : target_size - r*region_size;
+		fprintf(f, "%s\n\t\t{ \"start\": %lld, \"inject\": %lld, \"source\": %lld, \"target\": %lld, "
+				"\"bits\": %lld, \"bits_per_byte\": %.3f }", r ? "," : "", r*region_size,
+				region_bytes[r][0], region_bytes[r][1], region_bytes[r][2], region_bits[r],
+				double(region_bits[r]) / size);
+	}
+	fprintf(f, "\n\t]\n}\n");
+	return fclose(f)==0;
+}
+
+
+// How an input file will be read, a hint for mapped files
+enum FileAccess {
+	ACCESS_ALL,			// the whole file is read (indexed by the encoder)
+	ACCESS_SEQUENTIAL,	// read once from start to end
+	ACCESS_RANDOM		// only parts are read in any order
+};
+
+// A read only input file, mapped into memory if possible, otherwise
+// (pipes and other files that can't be mapped) read into a buffer
+struct InputFile {
+	const char *data;
+	size_t size;
+	bool mapped;
+#ifdef WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+	InputFile() : data(nullptr), size(0), mapped(false)
+#ifdef WIN32
+		, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#endif
+	{}
+	~InputFile() { Close(); }
+
+	bool Load(const char *name, FileAccess access, bool map);
+	bool Map(const char *name, FileAccess access);
+	bool Read(const char *name);
+	void Close();
+};
+
+// load a file, mapped if map is set and the file can be mapped
+bool InputFile::Load(const char *name, FileAccess access, bool map)
+{
+	Close();
+	if (map && Map(name, access))
+		return true;
+	return Read(name);
+}
+
+#ifdef WIN32
+bool InputFile::Map(const char *name, FileAccess access)
+{
+	DWORD flags = access==ACCESS_RANDOM ? FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN;
+	file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+	if (file==INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (GetFileType(file)==FILE_TYPE_DISK && GetFileSizeEx(file, &file_size) && file_size.QuadPart>0) {
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			if (void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) {
+				data = (const char*)view;
+				size = (size_t)file_size.QuadPart;
+				mapped = true;
+				return true;
+			}
+			CloseHandle(mapping);
+			mapping = nullptr;
+		}
+	}
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	return false;
+}
+#else
+bool InputFile::Map(const char *name, FileAccess access)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd<0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+		void *view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view!=MAP_FAILED) {
+			madvise(view, (size_t)st.st_size, access==ACCESS_ALL ? MADV_WILLNEED :
+					(access==ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM));
+			close(fd);
+			data = (const char*)view;
+			size = (size_t)st.st_size;
+			mapped = true;
+			return true;
+		}
+	}
+	close(fd);
+	return false;
+}
+#endif
+
+// read a file into a buffer until the end (works for pipes)
+bool InputFile::Read(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return false;
+	size_t capacity = 1<<16;
+	char *buffer = (char*)malloc(capacity);
+	size_t total = 0;
+	for (;;) {
+		if (total==capacity) {
+			capacity *= 2;
+			buffer = (char*)realloc(buffer, capacity);
+		}
+		size_t read = fread(buffer+total, 1, capacity-total, f);
+		if (!read)
+			break;
+		total += read;
+	}
+	fclose(f);
+	data = buffer;
+	size = total;
+	return true;
+}
+
+void InputFile::Close()
+{
+	if (data) {
+		if (!mapped)
+			free((void*)data);
+#ifdef WIN32
+		else {
+			UnmapViewOfFile(data);
+			CloseHandle(mapping);
+			CloseHandle(file);
+			mapping = nullptr;
+			file = INVALID_HANDLE_VALUE;
+		}
+#else
+		else
+			munmap((void*)data, size);
+#endif
+	}
+	data = nullptr;
+	size = 0;
+	mapped = false;
+}
+
+SourceSet::~SourceSet()
+{
+	delete[] files;
+	free(starts);
+	free(joined);
+}
+
+// Load the reference files of a source, returns the number of files loaded
+// which is less than num if one could not be opened
+int LoadSources(SourceSet &sources, const char **names, int num, FileAccess access, bool map)
+{
+	sources.names = names;
+	sources.files = new InputFile[num];
+	sources.starts = (size_t*)calloc(num+1, sizeof(size_t));
+	for (int f=0; f<num; f++) {
+		if (!sources.files[f].Load(names[f], access, map))
+			return f;
+		sources.starts[f+1] = sources.starts[f] + sources.files[f].size;
+	}
+	sources.count = num;
+	sources.size = sources.starts[num];
+	if (num==1)
+		sources.data = sources.files[0].data;
+	else {
+		// one buffer so copies can cross from one file to the next
+		sources.joined = (char*)malloc(sources.size ? sources.size : 1);
+		for (int f=0; f<num; f++) {
+			if (sources.files[f].size)
+				memcpy(sources.joined + sources.starts[f], sources.files[f].data, sources.files[f].size);
+			sources.files[f].Close();
+		}
+		sources.data = sources.joined;
+	}
+	return num;
+}
+
+// Source index cache
+// ------------------
+// The source index of the pairs and suffix engines can be saved to a cache
+// directory and mapped back in when the same source is encoded again, so
+// only the target is indexed. Cache files are named by a hash of the source
+// and the engine and hold the index arrays in the byte order of the machine
+// that wrote them, anything that doesn't match the header or the hash of the
+// arrays is rebuilt.
+
+#define E8_CACHE_VERSION 2
+
+struct CacheHeader {
+	char magic[8];					// "8BDINDEX"
+	unsigned int version;
+	unsigned int engine;
+	unsigned int index_bytes;		// size of the Index type (4 or 8)
+	unsigned int reserved;
+	unsigned long long source_size;
+	unsigned long long hash;
+	unsigned long long arrays_hash;	// hash of the index arrays that follow
+};
+
+static const char aCacheMagic[8] = { '8', 'B', 'D', 'I', 'N', 'D', 'E', 'X' };
+
+// 64 bit hash of a buffer, 8 bytes per step so it is cheap next to building an index
+unsigned long long HashBuffer(const char *b, size_t s)
+{
+	const unsigned long long prime = 0x9e3779b97f4a7c15ULL;
+	unsigned long long h = 0xcbf29ce484222325ULL ^ (unsigned long long)s;
+	size_t words = s>>3;
+	for (size_t w=0; w<words; w++) {
+		unsigned long long v;
+		memcpy(&v, b + (w<<3), sizeof(v));
+		h = (h ^ v) * prime;
+		h ^= h>>29;
+	}
+	for (size_t o=words<<3; o<s; o++)
+		h = (h ^ (unsigned char)b[o]) * 0x100000001b3ULL;
+	h ^= h>>32;
+	return h * prime;
+}
+
+// Index arrays of a cache file, nullptr if they don't fit the source
+template<typename Index> MatchFinder* MapMatchFinder(MatchEngine engine, const char *buffer, size_t size,
+													 const char *index, size_t index_size)
+{
+	if (engine==ENGINE_PAIRS && PairLookupTable<Index>::Valid(size, index, index_size))
+		return new PairLookupTable<Index>(buffer, size, index);
+	if (engine==ENGINE_SUFFIX && SuffixArrayLookup<Index>::Valid(size, index, index_size))
+		return new SuffixArrayLookup<Index>(buffer, size, index);
+	return nullptr;
+}
+
+// Source index from the cache directory dir, the index is built and saved
+// if the cache doesn't have it. cache holds the mapped file and must be kept
+// open as long as the index is used. Returns nullptr if the engine index
+// can't be cached.
+MatchFinder* CachedMatchFinder(const char *dir, InputFile &cache, MatchEngine engine, int level,
+							   const char *source, size_t size, bool map, bool &hit)
+{
+	hit = false;
+	if (engine!=ENGINE_PAIRS && engine!=ENGINE_SUFFIX)
+		return nullptr;
+	unsigned int index_bytes = (unsigned long long)size>0xffffffffULL ? 8 : 4;
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, aCacheMagic, sizeof(header.magic));
+	header.version = E8_CACHE_VERSION;
+	header.engine = engine;
+	header.index_bytes = index_bytes;
+	header.source_size = size;
+	header.hash = HashBuffer(source, size);
+
+	size_t dir_len = strlen(dir);
+	bool sep = dir_len && dir[dir_len-1]!='/' && dir[dir_len-1]!='\\';
+	char name[1024];
+	snprintf(name, sizeof(name), "%s%s%016llx.%s.8bi", dir, sep ? "/" : "", header.hash, aEngineNames[engine]);
+
+	if (cache.Load(name, ACCESS_RANDOM, map)) {
+		MatchFinder *index = nullptr;
+		const char *arrays = cache.data + sizeof(CacheHeader);
+		size_t arrays_size = cache.size>=sizeof(CacheHeader) ? cache.size - sizeof(CacheHeader) : 0;
+		if (cache.size>=sizeof(CacheHeader))
+			memcpy(&header.arrays_hash, cache.data + offsetof(CacheHeader, arrays_hash), sizeof(header.arrays_hash));
+		// the arrays index into the source so a damaged file must not be used
+		if (cache.size>=sizeof(CacheHeader) && memcmp(cache.data, &header, sizeof(CacheHeader))==0 &&
+			HashBuffer(arrays, arrays_size)==header.arrays_hash) {
+			index = index_bytes==8 ? MapMatchFinder<unsigned long long>(engine, source, size, arrays, arrays_size) :
+				MapMatchFinder<unsigned int>(engine, source, size, arrays, arrays_size);
+		}
+		if (index) {
+			hit = true;
+			return index;
+		}
+		cache.Close();
+	}
+
+	// write to a temporary file so other runs never map a partial index
+	MatchFinder *index = CreateMatchFinder(engine, level, source, size, false);
+	char temp[1040];
+	snprintf(temp, sizeof(temp), "%s.tmp", name);
+	bool saved = false;
+	if (FILE *f = fopen(temp, "wb")) {
+		header.arrays_hash = 0;
+		saved = fwrite(&header, sizeof(header), 1, f)==1 && index->Save(f);
+		saved = fclose(f)==0 && saved;
+		// hash the arrays as written and fill in the header
+		InputFile written;
+		saved = saved && written.Load(temp, ACCESS_SEQUENTIAL, map) && written.size>=sizeof(CacheHeader);
+		if (saved) {
+			header.arrays_hash = HashBuffer(written.data + sizeof(CacheHeader), written.size - sizeof(CacheHeader));
+			written.Close();
+			f = fopen(temp, "r+b");
+			saved = f && fwrite(&header, sizeof(header), 1, f)==1;
+			saved = (!f || fclose(f)==0) && saved;
+		}
+		if (saved) {
+			remove(name);
+			saved = rename(temp, name)==0;
+		}
+		if (!saved)
+			remove(temp);
+	}
+	if (!saved)
+		printf("Could not write source index \"%s\"\n", name);
+	return index;
+}
+
+// Time the compare functions on long matches (a mismatch every 4 kb on average)
+void BenchCompare()
+{
+	enum { DATA_SIZE = 1<<20, MISMATCHES = DATA_SIZE>>12, REPEAT = 256 };
+	char *a = (char*)malloc(DATA_SIZE);
+	char *b = (char*)malloc(DATA_SIZE);
+	unsigned int seed = 0x8bd1ff;
+	for (int i=0; i<DATA_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		a[i] = b[i] = (char)(seed>>16);
+	}
+	for (int i=0; i<MISMATCHES; i++) {
+		seed = seed * 1103515245 + 12345;
+		b[(seed>>8) % DATA_SIZE] ^= 0x55;
+	}
+
+	printf("Compare function benchmark, %d MB with %d mismatches x %d\n",
+		   DATA_SIZE>>20, MISMATCHES, REPEAT);
+	MatchLengthKernel best = BestKernel();
+	double bytes_ms = 0.0;
+	for (int k=0; k<=best; k++) {
+		MatchLengthFunc func = aKernels[k];
+		size_t total = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int r=0; r<REPEAT; r++) {
+			for (size_t pos=0; pos<DATA_SIZE; pos++) {
+				size_t len = func(a+pos, b+pos, DATA_SIZE-pos);
+				total += len;
+				pos += len;
+			}
+		}
+		double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now()-start).count() / 1000.0;
+		if (k==KERNEL_BYTES)
+			bytes_ms = ms;
+		printf("%-6s %8.1f ms %8.1f MB/s %6.2fx%s\n", aKernelNames[k], ms,
+			   ms>0.0 ? total / (ms * 1000.0) : 0.0, ms>0.0 ? bytes_ms / ms : 0.0,
+			   k==best ? " (selected)" : "");
+	}
+	free(a);
+	free(b);
+}
+
+// Time Decode and DecodeFast on a patch and check that the results match
+void BenchDecode(const char *source, const char *diff, size_t diff_size)
+{
+	size_t target_size = GetLength(diff, diff_size);
+	if (!target_size) {
+		printf("Could not decode diff file\n");
+		return;
+	}
+	char *ref = (char*)malloc(target_size);
+	char *fast = (char*)malloc(target_size);
+	// repeat to decode at least 64 MB
+	int repeat = int((64<<20) / target_size) + 1;
+	printf("Decode benchmark, %d bytes x %d\n", (int)target_size, repeat);
+	double ms[2];
+	for (int d=0; d<2; d++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int r=0; r<repeat; r++) {
+			if (d)
+				DecodeFast(fast, source, diff, diff_size);
+			else
+				Decode(ref, source, diff, diff_size);
+		}
+		ms[d] = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now()-start).count() / 1000.0;
+		printf("%-10s %8.1f ms %8.1f MB/s\n", d ? "DecodeFast" : "Decode", ms[d],
+			   ms[d]>0.0 ? double(target_size) * repeat / (ms[d] * 1000.0) : 0.0);
+	}
+	if (ms[1]>0.0)
+		printf("DecodeFast is %.2fx faster\n", ms[0] / ms[1]);
+	if (memcmp(ref, fast, target_size))
+		printf("DecodeFast result differs from Decode!\n");
+	free(ref);
+	free(fast);
+}
+
+// Peak resident memory of this process in kb (0 if not known)
+size_t PeakMemoryKB()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize>>10;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss>>10;	// bytes on macOS
+#else
+	return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Resident memory of this process in kb (0 if not known)
+size_t MemoryKB()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.WorkingSetSize>>10;
+	return 0;
+#else
+	size_t resident = 0;
+	if (FILE *f = fopen("/proc/self/statm", "r")) {
+		unsigned long long total, pages;
+		if (fscanf(f, "%llu %llu", &total, &pages)==2)
+			resident = size_t(pages * (unsigned long long)sysconf(_SC_PAGESIZE) >> 10);
+		fclose(f);
+	}
+	return resident;
+#endif
+}
+
+// Cpu time of all threads of this process in ms
+double ProcessCpuMs()
+{
+#ifdef WIN32
+	FILETIME create, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user))
+		return 0.0;
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) / 10000.0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0.0;
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+#endif
+}
+
+void EncodeProfile::Start()
+{
+	wall_start = std::chrono::steady_clock::now();
+	cpu_start = ProcessCpuMs();
+	memory_start = MemoryKB();
+}
+
+void EncodeProfile::Stop(ProfilePhase phase)
+{
+	Phase &p = phases[phase];
+	p.wall_ms += std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now()-wall_start).count() / 1000.0;
+	p.cpu_ms += ProcessCpuMs() - cpu_start;
+	p.memory_kb += (long long)MemoryKB() - (long long)memory_start;
+	p.peak_kb = PeakMemoryKB();
+	p.runs++;
+}
+
+// Print the phases of an encode and the matches found
+void PrintProfile(const EncodeProfile &profile, const Encoder &encode)
+{
+	printf("%-10s %10s %10s %12s %10s %5s\n", "phase", "wall_ms", "cpu_ms", "memory_kb", "peak_kb", "runs");
+	double wall = 0.0, cpu = 0.0;
+	for (int p=0; p<PROFILE_COUNT; p++) {
+		const EncodeProfile::Phase &phase = profile.phases[p];
+		if (!phase.runs)
+			continue;
+		printf("%-10s %10.1f %10.1f %+12lld %10d %5d\n", aProfilePhaseNames[p], phase.wall_ms, phase.cpu_ms,
+			   phase.memory_kb, (int)phase.peak_kb, phase.runs);
+		wall += phase.wall_ms;
+		cpu += phase.cpu_ms;
+	}
+	printf("%-10s %10.1f %10.1f %12s %10d\n", "total", wall, cpu, "", (int)PeakMemoryKB());
+
+	long long lookups = profile.counter.lookups, candidates = profile.counter.candidates;
+	printf("Match lookups: %lld, candidates visited: %lld (%.1f per lookup)\n",
+		   lookups, candidates, lookups ? double(candidates) / lookups : 0.0);
+	long long num[Encoder::E8I_END] = { 0 }, bytes[Encoder::E8I_END] = { 0 };
+	size_t val = 0;
+	for (const char *instr = encode.instructions; instr<encode.next_instr; instr++) {
+		long long len = encode.Value(val++);
+		if (*instr!=Encoder::E8I_INJ)
+			val++;
+		num[(int)*instr]++;
+		if (*instr==Encoder::E8I_DLT) {
+			bytes[(int)*instr] += encode.DeltaBytes(val, len);
+			val += size_t(2*len);
+		} else
+			bytes[(int)*instr] += len;
+	}
+	// delta copies count as source copies
+	num[Encoder::E8I_SRC] += num[Encoder::E8I_DLT];
+	bytes[Encoder::E8I_SRC] += bytes[Encoder::E8I_DLT];
+	long long copies = num[Encoder::E8I_SRC] + num[Encoder::E8I_TRG];
+	long long copied = bytes[Encoder::E8I_SRC] + bytes[Encoder::E8I_TRG];
+	printf("Copies: %lld source + %lld target, average match length %.1f bytes, "
+		   "%lld inject runs of %.1f bytes on average\n",
+		   num[Encoder::E8I_SRC], num[Encoder::E8I_TRG], copies ? double(copied) / copies : 0.0,
+		   num[Encoder::E8I_INJ], num[Encoder::E8I_INJ] ? double(bytes[Encoder::E8I_INJ]) / num[Encoder::E8I_INJ] : 0.0);
+}
+
+// Random numbers for the benchmark corpus, the same on every platform
+// (xorshift, seed must not be 0)
+struct BenchRandom {
+	unsigned int seed;
+	BenchRandom(unsigned int s) : seed(s) {}
+	unsigned int Next() {
+		seed ^= seed<<13;
+		seed ^= seed>>17;
+		seed ^= seed<<5;
+		return seed;
+	}
+	unsigned int Below(unsigned int n) { return Next() % n; }
+};
+
+// A generated source and target pair
+struct BenchInput {
+	char *source;
+	size_t source_size;
+	char *target;
+	size_t target_size;
+
+	BenchInput() : source(nullptr), source_size(0), target(nullptr), target_size(0) {}
+	~BenchInput() {
+		free(source);
+		free(target);
+	}
+	void Alloc(size_t s, size_t t) {
+		source = (char*)calloc(s ? s : 1, 1);
+		source_size = s;
+		target = (char*)calloc(t ? t : 1, 1);
+		target_size = t;
+	}
+};
+
+// Instruction set sample for generating machine code
+struct BenchCpu {
+	const unsigned char *ops[3];	// opcodes with 0, 1 and 2 bytes of operand
+	int num_ops[3];
+	int base;						// load address
+	int moved;						// load address of the relocated target
+};
+
+const unsigned char a6502Ops0[] = { 0xea, 0x18, 0x38, 0xe8, 0xc8, 0xca, 0x88, 0xaa, 0xa8, 0x8a, 0x98, 0x60, 0x48, 0x68 };
+const unsigned char a6502Ops1[] = { 0xa9, 0xa2, 0xa0, 0x85, 0xa5, 0x86, 0xc9, 0x29, 0x09, 0x69, 0xd0, 0xf0, 0x90, 0xb0, 0xb1, 0x91 };
+const unsigned char a6502Ops2[] = { 0xad, 0x8d, 0xbd, 0x9d, 0xb9, 0x99, 0x20, 0x4c, 0xee, 0xce, 0xae, 0x8e };
+const unsigned char aZ80Ops0[] = { 0x00, 0x3c, 0x3d, 0x04, 0x05, 0x78, 0x47, 0x7e, 0x77, 0x23, 0x2b, 0xaf, 0xc9, 0xc5, 0xc1, 0xe5, 0xe1 };
+const unsigned char aZ80Ops1[] = { 0x3e, 0x06, 0x0e, 0x16, 0x1e, 0x18, 0x20, 0x28, 0x30, 0x38, 0xfe, 0xe6, 0xf6, 0x10 };
+const unsigned char aZ80Ops2[] = { 0xc3, 0xcd, 0xc2, 0xca, 0x21, 0x11, 0x01, 0x3a, 0x32, 0x2a, 0x22 };
+
+const BenchCpu aBenchCpus[] = {
+	{ { a6502Ops0, a6502Ops1, a6502Ops2 }, { sizeof(a6502Ops0), sizeof(a6502Ops1), sizeof(a6502Ops2) }, 0x0801, 0x0c01 },
+	{ { aZ80Ops0, aZ80Ops1, aZ80Ops2 }, { sizeof(aZ80Ops0), sizeof(aZ80Ops1), sizeof(aZ80Ops2) }, 0x8000, 0x9000 },
+};
+
+// Machine code assembled at one address, and again at another address with
+// a few instructions inserted. Absolute operands inside the program move
+// with the code, the rest point at i/o or tables outside of it.
+void BenchCode(BenchInput &in, const BenchCpu &cpu, size_t size)
+{
+	struct Op {
+		unsigned char opcode;
+		unsigned char bytes;	// operand bytes
+		bool label;				// operand is the index of an op
+		int operand;
+	};
+	size_t max_ops = size;
+	Op *ops = (Op*)malloc(sizeof(Op) * (max_ops+16));
+	int *addr = (int*)malloc(sizeof(int) * (max_ops+16));
+	BenchRandom rnd(0x6502);
+	size_t num_ops = 0, bytes = 0;
+	while (bytes<size) {
+		if (num_ops>32 && rnd.Below(4)==0) {
+			// repeat an earlier sequence (common idioms)
+			size_t from = rnd.Below((unsigned int)num_ops-16);
+			size_t len = 2 + rnd.Below(12);
+			for (size_t i=0; i<len && bytes<size; i++) {
+				ops[num_ops] = ops[from+i];
+				bytes += 1 + ops[num_ops++].bytes;
+			}
+			continue;
+		}
+		Op &op = ops[num_ops++];
+		unsigned int kind = rnd.Below(10);
+		op.bytes = kind<3 ? 0 : (kind<6 ? 1 : 2);
+		op.opcode = cpu.ops[op.bytes][rnd.Below(cpu.num_ops[op.bytes])];
+		op.label = op.bytes==2 && rnd.Below(4)!=0;
+		op.operand = op.label ? (int)rnd.Below((unsigned int)(size/3)) : (int)rnd.Below(0x10000);
+		bytes += 1 + op.bytes;
+	}
+	// the target has a few instructions inserted in the middle
+	size_t insert_at = num_ops/2, inserted = 4;
+	for (int pass=0; pass<2; pass++) {
+		size_t total = num_ops + (pass ? inserted : 0);
+		int pc = pass ? cpu.moved : cpu.base;
+		for (size_t i=0, o=0; i<total; i++) {
+			bool extra = pass && i>=insert_at && i<insert_at+inserted;
+			addr[i] = pc;
+			pc += extra ? 3 : 1 + ops[o].bytes;
+			if (!extra)
+				o++;
+		}
+		char *out = pass ? in.target : in.source;
+		size_t limit = pass ? in.target_size : in.source_size;
+		size_t n = 0;
+		for (size_t i=0, o=0; i<total && n<limit; i++) {
+			// inserted instructions are calls to a routine outside the program
+			bool extra = pass && i>=insert_at && i<insert_at+inserted;
+			Op call = { cpu.ops[2][0], 2, false, 0xc000 + 3*int(i-insert_at) };
+			const Op &op = extra ? call : ops[o++];
+			out[n++] = (char)op.opcode;
+			int value = op.operand;
+			if (op.label) {
+				size_t index = (size_t)op.operand % num_ops;	// op index in the source
+				if (pass && index>=insert_at)
+					index += inserted;
+				value = addr[index];
+			}
+			for (int b=0; b<op.bytes && n<limit; b++)
+				out[n++] = (char)(value>>(8*b));
+		}
+		if (pass)
+			in.target_size = n;
+		else
+			in.source_size = n;
+	}
+	free(addr);
+	free(ops);
+}
+
+void BenchCode6502(BenchInput &in)
+{
+	in.Alloc(16384, 16384+12);
+	BenchCode(in, aBenchCpus[0], 16384);
+}
+
+void BenchCodeZ80(BenchInput &in)
+{
+	in.Alloc(16384, 16384+12);
+	BenchCode(in, aBenchCpus[1], 16384);
+}
+
+// Tile map with platforms, the target has a number of small areas changed
+void BenchLevel(BenchInput &in)
+{
+	enum { WIDTH = 256, HEIGHT = 128, EDITS = 48 };
+	in.Alloc(WIDTH*HEIGHT, WIDTH*HEIGHT);
+	BenchRandom rnd(0x1e7e1);
+	for (int y=0; y<HEIGHT; y++) {
+		for (int x=0; x<WIDTH; x++)
+			in.source[y*WIDTH+x] = (char)((y%32)>28 ? 1 : 0);	// ground every 32 rows
+	}
+	for (int p=0; p<600; p++) {
+		int x = rnd.Below(WIDTH-16), y = rnd.Below(HEIGHT), len = 2 + rnd.Below(14);
+		char tile = (char)(2 + rnd.Below(6));
+		for (int i=0; i<len; i++)
+			in.source[y*WIDTH+x+i] = tile;
+	}
+	memcpy(in.target, in.source, in.target_size);
+	for (int e=0; e<EDITS; e++) {
+		int x = rnd.Below(WIDTH-4), y = rnd.Below(HEIGHT-3);
+		int w = 1 + rnd.Below(4), h = 1 + rnd.Below(3);
+		char tile = (char)rnd.Below(12);
+		for (int j=0; j<h; j++) {
+			for (int i=0; i<w; i++)
+				in.target[(y+j)*WIDTH+x+i] = tile;
+		}
+	}
+}
+
+const char *aBenchWords[] = {
+	"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with",
+	"be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+	"but", "have", "an", "had", "they", "you", "were", "their", "one", "all", "we", "can",
+	"memory", "screen", "sprite", "character", "border", "raster", "interrupt", "vector",
+	"routine", "pointer", "address", "register", "accumulator", "carry", "overflow", "zero",
+	"page", "stack", "bank", "cartridge", "loader", "patch", "level", "player", "score", "sound"
+};
+
+// Words with punctuation and line breaks, the target has words replaced,
+// sentences inserted and sentences removed
+size_t BenchWriteText(char *out, size_t size, BenchRandom &words, BenchRandom *edits)
+{
+	const int num_words = sizeof(aBenchWords) / sizeof(aBenchWords[0]);
+	size_t n = 0, line = 0;
+	bool capital = true;
+	while (n<size) {
+		int w = words.Below(num_words);
+		int end = words.Below(12);
+		if (edits) {
+			int e = edits->Below(200);
+			if (e==0)
+				w = edits->Below(num_words);	// replaced word
+			else if (e==1)
+				continue;						// removed word
+			else if (e==2) {
+				// inserted sentence
+				for (int i = 3 + edits->Below(8); i && n<size; i--) {
+					const char *ins = aBenchWords[edits->Below(num_words)];
+					while (*ins && n<size)
+						out[n++] = *ins++;
+					if (n<size)
+						out[n++] = ' ';
+				}
+			}
+		}
+		const char *word = aBenchWords[w];
+		size_t start = n;
+		while (*word && n<size)
+			out[n++] = *word++;
+		if (capital && n>start && out[start]>='a' && out[start]<='z')
+			out[start] -= 'a'-'A';
+		capital = end==0;
+		if (end==0 && n<size)
+			out[n++] = '.';
+		else if (end==1 && n<size)
+			out[n++] = ',';
+		if (n<size) {
+			bool wrap = (n-line)>64;
+			out[n++] = wrap ? '\n' : ' ';
+			if (wrap)
+				line = n;
+		}
+	}
+	return n;
+}
+
+void BenchText(BenchInput &in)
+{
+	in.Alloc(65536, 65536);
+	BenchRandom src(0x7e47), trg(0x7e47), edits(0xed17);
+	in.source_size = BenchWriteText(in.source, in.source_size, src, nullptr);
+	in.target_size = BenchWriteText(in.target, in.target_size, trg, &edits);
+}
+
+// Text with an empty source
+void BenchEmpty(BenchInput &in)
+{
+	in.Alloc(0, 32768);
+	BenchRandom words(0xe497);
+	in.target_size = BenchWriteText(in.target, in.target_size, words, nullptr);
+}
+
+// Mostly empty rom, the target has code added in a few places
+void BenchZeroRom(BenchInput &in)
+{
+	enum { SIZE = 32768, PATCHES = 16 };
+	in.Alloc(SIZE, SIZE);
+	BenchRandom rnd(0x20b);
+	for (int p=0; p<PATCHES; p++) {
+		int at = rnd.Below(SIZE-64), len = 16 + rnd.Below(48);
+		for (int i=0; i<len; i++)
+			in.target[at+i] = (char)rnd.Next();
+	}
+}
+
+// Random data, the target is made of moved blocks of the source and new blocks
+void BenchRandomData(BenchInput &in)
+{
+	enum { SIZE = 65536, BLOCK = 4096 };
+	in.Alloc(SIZE, SIZE);
+	BenchRandom rnd(0x5eed);
+	for (int i=0; i<SIZE; i++)
+		in.source[i] = (char)rnd.Next();
+	for (int b=0; b<SIZE; b+=BLOCK) {
+		if (rnd.Below(4)==0) {
+			for (int i=0; i<BLOCK; i++)
+				in.target[b+i] = (char)rnd.Next();
+		} else
+			memcpy(in.target+b, in.source + rnd.Below(SIZE/BLOCK)*BLOCK, BLOCK);
+	}
+}
+
+// Generated inputs for the benchmark suite
+struct BenchCorpus {
+	const char *name;
+	void (*generate)(BenchInput &in);
+};
+
+const BenchCorpus aBenchCorpus[] = {
+	{ "6502-reloc", BenchCode6502 },
+	{ "z80-reloc", BenchCodeZ80 },
+	{ "level-edit", BenchLevel },
+	{ "text-edit", BenchText },
+	{ "zero-rom", BenchZeroRom },
+	{ "random", BenchRandomData },
+	{ "empty-source", BenchEmpty },
+};
+
+const char *aBenchColumns = "corpus,engine,source_size,target_size,patch_size,ratio,encode_mbs,decode_mbs,peak_rss_kb,verified";
+
+// Encode and decode one corpus input with an engine, repeated for at least
+// BENCH_MS, and print a line of results
+#define BENCH_MS 200
+
+bool BenchCase(const char *name, MatchEngine engine, int level, bool optimal, bool delta, int threads)
+{
+	const BenchCorpus *corpus = nullptr;
+	for (size_t c=0; c<sizeof(aBenchCorpus)/sizeof(aBenchCorpus[0]); c++) {
+		if (strcasecmp(aBenchCorpus[c].name, name)==0)
+			corpus = aBenchCorpus + c;
+	}
+	if (!corpus) {
+		printf("Unknown benchmark input \"%s\"\n", name);
+		return false;
+	}
+	BenchInput in;
+	corpus->generate(in);
+
+	Encoder encode;
+	encode.engine = engine;
+	encode.level = level;
+	encode.threads = threads;
+	int encodes = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double encode_ms;
+	do {
+		encode.Reset();
+		if (optimal)
+			encode.BuildOptimal(in.source, in.source_size, in.target, in.target_size);
+		else
+			encode.Build(in.source, in.source_size, in.target, in.target_size);
+		encode.Optimize();
+		if (delta) {
+			size_t copies, bytes;
+			encode.Delta(in.source, in.source_size, in.target, in.target_size, false, copies, bytes);
+			encode.Optimize();
+		}
+		encode.Generate();
+		encodes++;
+		encode_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now()-start).count() / 1000.0;
+	} while (encode_ms<BENCH_MS);
+
+	char *out = (char*)malloc(in.target_size ? in.target_size : 1);
+	int decodes = 0;
+	size_t decoded;
+	start = std::chrono::steady_clock::now();
+	double decode_ms;
+	do {
+		decoded = DecodeFast(out, in.source, encode.result, encode.result_size);
+		decodes++;
+		decode_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now()-start).count() / 1000.0;
+	} while (decode_ms<BENCH_MS);
+	bool verified = decoded==in.target_size && !memcmp(out, in.target, in.target_size);
+	free(out);
+
+	double mb = in.target_size / (1024.0 * 1024.0);
+	printf("%s,%s%s%s,%d,%d,%d,%.4f,%.2f,%.2f,%d,%d\n", corpus->name, aEngineNames[engine],
+		   optimal ? "+optimal" : "", delta ? "+delta" : "", (int)in.source_size, (int)in.target_size, (int)encode.result_size,
+		   in.target_size ? double(encode.result_size) / in.target_size : 0.0,
+		   mb * encodes * 1000.0 / encode_ms, mb * decodes * 1000.0 / decode_ms,
+		   (int)PeakMemoryKB(), verified ? 1 : 0);
+	fflush(stdout);
+	return verified;
+}
+
+// Run each corpus input with each engine in its own process (so the peak
+// memory is for that case) and print csv results, also written to csv_file
+void BenchSuite(const char *exe, const char *csv_file, int level, bool optimal, bool delta, int threads)
+{
+	FILE *csv = csv_file ? fopen(csv_file, "w") : nullptr;
+	if (csv_file && !csv)
+		printf("Could not open \"%s\"\n", csv_file);
+	printf("%s\n", aBenchColumns);
+	if (csv)
+		fprintf(csv, "%s\n", aBenchColumns);
+	for (size_t c=0; c<sizeof(aBenchCorpus)/sizeof(aBenchCorpus[0]); c++) {
+		for (int e=0; e<ENGINE_COUNT; e++) {
+			char command[1024];
+			snprintf(command, sizeof(command), "\"%s\" -bench -case %s -engine %s -%d -threads %d%s%s",
+					 exe, aBenchCorpus[c].name, aEngineNames[e], level, threads, optimal ? " -optimal" : "",
+					 delta ? " -delta" : "");
+			char line[512];
+			line[0] = 0;
+			if (FILE *run = popen(command, "r")) {
+				while (fgets(line, sizeof(line), run)) {
+					if (!strncmp(line, aBenchCorpus[c].name, strlen(aBenchCorpus[c].name)))
+						break;	// skip encoder messages
+					line[0] = 0;
+				}
+				pclose(run);
+			}
+			if (!line[0])
+				snprintf(line, sizeof(line), "%s,%s,,,,,,,,0\n", aBenchCorpus[c].name, aEngineNames[e]);
+			printf("%s", line);
+			fflush(stdout);
+			if (csv)
+				fprintf(csv, "%s", line);
+		}
+	}
+	if (csv)
+		fclose(csv);
+}
+
+// Emulated decoders
+// -----------------
+// The bundled 6502, Z80 and 68000 decoders are assembled from their source
+// and run on small cpu cores that count cycles, the output is compared with
+// Decode. The 6502 decoder modifies its own code so it is assembled into
+// memory and run as machine code, the Z80 and 68000 decoders are run one
+// parsed source line at a time.
+
+// Cpu a decoder is written for
+enum EmuCpu {
+	CPU_6502,
+	CPU_Z80,
+	CPU_68K,
+
+	CPU_COUNT
+};
+
+const char *aCpuNames[] = {
+	"6502",
+	"z80",
+	"68k",
+	nullptr
+};
+
+// Where the cycles of a decode are spent
+enum EmuPhase {
+	PHASE_SETUP,		// reading the header
+	PHASE_BITS,			// reading lengths and offsets from the bit stream
+	PHASE_COPY,			// copying bytes
+	PHASE_OTHER,		// instruction type, sign and buffer bits, end test
+
+	PHASE_COUNT
+};
+
+const char *aPhaseNames[] = {
+	"setup",
+	"bit_read",
+	"copy",
+	"other"
+};
+
+// Routines of the bundled decoders, each label starts a
+// phase that lasts until the next label in the list
+struct EmuRegion {
+	const char *label;
+	EmuPhase phase;
+};
+
+const EmuRegion a6502Regions[] = {
+	{ "Patch_8BDiff_InPlace", PHASE_SETUP },
+	{ "Patch_8BDiff", PHASE_SETUP },
+	{ "NextInstruction", PHASE_OTHER },
+	{ "MoveToDest", PHASE_COPY },
+	{ "NoLowLength", PHASE_OTHER },
+	{ "DeltaCopy", PHASE_COPY },
+	{ "BufferCopy", PHASE_COPY },
+	{ "GetLenOffBits", PHASE_BITS },
+	{ "BitX", PHASE_SETUP },
+	{ "ApplyOffsetY", PHASE_COPY },
+	{ nullptr, PHASE_OTHER }
+};
+
+const EmuRegion aZ80Regions[] = {
+	{ "Patch_8BDiff", PHASE_SETUP },
+	{ "P8BP_PatchLoop", PHASE_OTHER },
+	{ "P8BD_ReadBits", PHASE_BITS },
+	{ "P8BD_Shift", PHASE_SETUP },
+	{ nullptr, PHASE_OTHER }
+};
+
+const EmuRegion a68kRegions[] = {
+	{ "Patch_8BDiff", PHASE_SETUP },
+	{ ".PatchLoop", PHASE_OTHER },
+	{ ".CopyInject", PHASE_COPY },
+	{ ".SrcOrTrg", PHASE_OTHER },
+	{ ".CopySource", PHASE_COPY },
+	{ ".Trg", PHASE_COPY },
+	{ ".ReadBit", PHASE_BITS },
+	{ nullptr, PHASE_OTHER }
+};
+
+// phase that starts at a label, or -1 if the label isn't in the list
+int EmuRegionPhase(const EmuRegion *regions, const char *label)
+{
+	for (; regions->label; regions++) {
+		if (strcmp(regions->label, label)==0)
+			return regions->phase;
+	}
+	return -1;
+}
+
+// Labels and their values while assembling
+struct EmuSymbols {
+	enum { MAX_SYMBOLS = 1024, MAX_NAME = 64 };
+	char names[MAX_SYMBOLS][MAX_NAME];
+	long long values[MAX_SYMBOLS];
+	int count;
+
+	EmuSymbols() : count(0) {}
+	int Find(const char *name, size_t len) const {
+		for (int s=0; s<count; s++) {
+			if (strlen(names[s])==len && !strncmp(names[s], name, len))
+				return s;
+		}
+		return -1;
+	}
+	void Set(const char *name, size_t len, long long value) {
+		int s = Find(name, len);
+		if (s<0 && count<MAX_SYMBOLS && len<MAX_NAME) {
+			s = count++;
+			memcpy(names[s], name, len);
+			names[s][len] = 0;
+		}
+		if (s>=0)
+			values[s] = value;
+	}
+};
+
+bool EmuLabelChar(char c)
+{
+	return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c=='_' || c=='.' || c=='!';
+}
+
+const char* EmuSkipSpace(const char *p)
+{
+	while (*p==' ' || *p=='\t')
+		p++;
+	return p;
+}
+
+// Evaluate numbers ($hex, %binary, decimal) and labels added and subtracted,
+// < and > select the low and high byte. known is cleared if a label is not
+// defined yet. A label ending in + or - (a 6502 multi label) is looked up
+// with the resolve function.
+typedef bool (*EmuResolve)(void *user, const char *name, size_t len, char dir, long long &value);
+
+const char* EmuEval(const char *p, const EmuSymbols &syms, long long &value, bool &known,
+					EmuResolve resolve = nullptr, void *user = nullptr)
+{
+	value = 0;
+	known = true;
+	int byte = 0;
+	p = EmuSkipSpace(p);
+	if (*p=='<' || *p=='>')
+		byte = *p++;
+	char op = '+';
+	for (;;) {
+		p = EmuSkipSpace(p);
+		long long term = 0;
+		bool negate = false;
+		if (*p=='-') {
+			negate = true;
+			p = EmuSkipSpace(p+1);
+		}
+		if (*p=='$' || (*p=='0' && (p[1]=='x' || p[1]=='X'))) {
+			p += *p=='$' ? 1 : 2;
+			term = strtoll(p, (char**)&p, 16);
+		} else if (*p=='%') {
+			term = strtoll(p+1, (char**)&p, 2);
+		} else if (*p>='0' && *p<='9') {
+			term = strtoll(p, (char**)&p, 10);
+		} else if (EmuLabelChar(*p)) {
+			const char *name = p;
+			while (EmuLabelChar(*p))
+				p++;
+			size_t len = p-name;
+			if (*name=='!' && (*p=='+' || *p=='-') && resolve) {
+				if (!resolve(user, name, len, *p, term))
+					known = false;
+				p++;
+			} else {
+				int s = syms.Find(name, len);
+				if (s<0)
+					known = false;
+				else
+					term = syms.values[s];
+			}
+		} else
+			break;
+		if (negate)
+			term = -term;
+		value = op=='+' ? value+term : value-term;
+		p = EmuSkipSpace(p);
+		if (*p!='+' && *p!='-')
+			break;
+		op = *p++;
+	}
+	if (byte=='<')
+		value &= 0xff;
+	else if (byte=='>')
+		value = (value>>8) & 0xff;
+	return p;
+}
+
+// Source split into lines with comments removed
+struct EmuLines {
+	char *text;
+	char **lines;
+	int count;
+
+	EmuLines() : text(nullptr), lines(nullptr), count(0) {}
+	~EmuLines() {
+		free(text);
+		free(lines);
+	}
+	// comment starts a comment that runs to the end of the line
+	void Split(const char *source, size_t size, const char *comment) {
+		text = (char*)malloc(size+1);
+		memcpy(text, source, size);
+		text[size] = 0;
+		int max_lines = 1;
+		for (size_t i=0; i<size; i++)
+			max_lines += text[i]=='\n';
+		lines = (char**)malloc(sizeof(char*) * max_lines);
+		char *p = text;
+		if ((unsigned char)p[0]==0xef && (unsigned char)p[1]==0xbb && (unsigned char)p[2]==0xbf)
+			p += 3;	// utf-8 byte order mark
+		while (*p) {
+			char *line = p;
+			while (*p && *p!='\n')
+				p++;
+			if (*p)
+				*p++ = 0;
+			if (char *c = strstr(line, comment))
+				*c = 0;
+			size_t len = strlen(line);
+			while (len && (line[len-1]==' ' || line[len-1]=='\t' || line[len-1]=='\r'))
+				line[--len] = 0;
+			lines[count++] = line;
+		}
+	}
+};
+
+// Cpu core running a decoder, memory holds the diff, source and output
+struct EmuDecoder {
+	long long cycles[PHASE_COUNT];
+
+	virtual ~EmuDecoder() {}
+	// assemble the decoder, prints errors
+	virtual bool Assemble(const char *source, size_t size) = 0;
+	virtual size_t MemorySize() const = 0;
+	// first address free for data
+	virtual size_t DataStart() const = 0;
+	virtual unsigned char* Memory() = 0;
+	// call the decoder, returns an error message or nullptr when it returned
+	virtual const char* Run(size_t diff, size_t source, size_t dest, long long limit) = 0;
+
+	long long Total() const {
+		long long total = 0;
+		for (int p=0; p<PHASE_COUNT; p++)
+			total += cycles[p];
+		return total;
+	}
+};
+
+// 6502 addressing modes
+enum Mode6502 {
+	M_IMP, M_ACC, M_IMM, M_ZP, M_ZPX, M_ZPY, M_ABS, M_ABSX, M_ABSY, M_IND, M_INDX, M_INDY, M_REL,
+
+	M_COUNT
+};
+
+const int aModeBytes6502[M_COUNT] = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2, 2 };
+
+enum Mnem6502 {
+	ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+	CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP,
+	JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI,
+	RTS, SBC, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+
+	MNEM_COUNT
+};
+
+const char *aMnem6502[MNEM_COUNT] = {
+	"adc", "and", "asl", "bcc", "bcs", "beq", "bit", "bmi", "bne", "bpl", "brk", "bvc", "bvs", "clc",
+	"cld", "cli", "clv", "cmp", "cpx", "cpy", "dec", "dex", "dey", "eor", "inc", "inx", "iny", "jmp",
+	"jsr", "lda", "ldx", "ldy", "lsr", "nop", "ora", "pha", "php", "pla", "plp", "rol", "ror", "rti",
+	"rts", "sbc", "sec", "sed", "sei", "sta", "stx", "sty", "tax", "tay", "tsx", "txa", "txs", "tya"
+};
+
+// documented opcodes with base cycle counts
+struct Op6502 {
+	unsigned char opcode;
+	unsigned char mnem;
+	unsigned char mode;
+	unsigned char cycles;
+};
+
+const Op6502 aOps6502[] = {
+	{ 0x69, ADC, M_IMM, 2 }, { 0x65, ADC, M_ZP, 3 }, { 0x75, ADC, M_ZPX, 4 }, { 0x6d, ADC, M_ABS, 4 },
+	{ 0x7d, ADC, M_ABSX, 4 }, { 0x79, ADC, M_ABSY, 4 }, { 0x61, ADC, M_INDX, 6 }, { 0x71, ADC, M_INDY, 5 },
+	{ 0x29, AND, M_IMM, 2 }, { 0x25, AND, M_ZP, 3 }, { 0x35, AND, M_ZPX, 4 }, { 0x2d, AND, M_ABS, 4 },
+	{ 0x3d, AND, M_ABSX, 4 }, { 0x39, AND, M_ABSY, 4 }, { 0x21, AND, M_INDX, 6 }, { 0x31, AND, M_INDY, 5 },
+	{ 0x0a, ASL, M_ACC, 2 }, { 0x06, ASL, M_ZP, 5 }, { 0x16, ASL, M_ZPX, 6 }, { 0x0e, ASL, M_ABS, 6 },
+	{ 0x1e, ASL, M_ABSX, 7 },
+	{ 0x90, BCC, M_REL, 2 }, { 0xb0, BCS, M_REL, 2 }, { 0xf0, BEQ, M_REL, 2 }, { 0x30, BMI, M_REL, 2 },
+	{ 0xd0, BNE, M_REL, 2 }, { 0x10, BPL, M_REL, 2 }, { 0x50, BVC, M_REL, 2 }, { 0x70, BVS, M_REL, 2 },
+	{ 0x24, BIT, M_ZP, 3 }, { 0x2c, BIT, M_ABS, 4 },
+	{ 0x00, BRK, M_IMP, 7 },
+	{ 0x18, CLC, M_IMP, 2 }, { 0xd8, CLD, M_IMP, 2 }, { 0x58, CLI, M_IMP, 2 }, { 0xb8, CLV, M_IMP, 2 },
+	{ 0xc9, CMP, M_IMM, 2 }, { 0xc5, CMP, M_ZP, 3 }, { 0xd5, CMP, M_ZPX, 4 }, { 0xcd, CMP, M_ABS, 4 },
+	{ 0xdd, CMP, M_ABSX, 4 }, { 0xd9, CMP, M_ABSY, 4 }, { 0xc1, CMP, M_INDX, 6 }, { 0xd1, CMP, M_INDY, 5 },
+	{ 0xe0, CPX, M_IMM, 2 }, { 0xe4, CPX, M_ZP, 3 }, { 0xec, CPX, M_ABS, 4 },
+	{ 0xc0, CPY, M_IMM, 2 }, { 0xc4, CPY, M_ZP, 3 }, { 0xcc, CPY, M_ABS, 4 },
+	{ 0xc6, DEC, M_ZP, 5 }, { 0xd6, DEC, M_ZPX, 6 }, { 0xce, DEC, M_ABS, 6 }, { 0xde, DEC, M_ABSX, 7 },
+	{ 0xca, DEX, M_IMP, 2 }, { 0x88, DEY, M_IMP, 2 },
+	{ 0x49, EOR, M_IMM, 2 }, { 0x45, EOR, M_ZP, 3 }, { 0x55, EOR, M_ZPX, 4 }, { 0x4d, EOR, M_ABS, 4 },
+	{ 0x5d, EOR, M_ABSX, 4 }, { 0x59, EOR, M_ABSY, 4 }, { 0x41, EOR, M_INDX, 6 }, { 0x51, EOR, M_INDY, 5 },
+	{ 0xe6, INC, M_ZP, 5 }, { 0xf6, INC, M_ZPX, 6 }, { 0xee, INC, M_ABS, 6 }, { 0xfe, INC, M_ABSX, 7 },
+	{ 0xe8, INX, M_IMP, 2 }, { 0xc8, INY, M_IMP, 2 },
+	{ 0x4c, JMP, M_ABS, 3 }, { 0x6c, JMP, M_IND, 5 }, { 0x20, JSR, M_ABS, 6 },
+	{ 0xa9, LDA, M_IMM, 2 }, { 0xa5, LDA, M_ZP, 3 }, { 0xb5, LDA, M_ZPX, 4 }, { 0xad, LDA, M_ABS, 4 },
+	{ 0xbd, LDA, M_ABSX, 4 }, { 0xb9, LDA, M_ABSY, 4 }, { 0xa1, LDA, M_INDX, 6 }, { 0xb1, LDA, M_INDY, 5 },
+	{ 0xa2, LDX, M_IMM, 2 }, { 0xa6, LDX, M_ZP, 3 }, { 0xb6, LDX, M_ZPY, 4 }, { 0xae, LDX, M_ABS, 4 },
+	{ 0xbe, LDX, M_ABSY, 4 },
+	{ 0xa0, LDY, M_IMM, 2 }, { 0xa4, LDY, M_ZP, 3 }, { 0xb4, LDY, M_ZPX, 4 }, { 0xac, LDY, M_ABS, 4 },
+	{ 0xbc, LDY, M_ABSX, 4 },
+	{ 0x4a, LSR, M_ACC, 2 }, { 0x46, LSR, M_ZP, 5 }, { 0x56, LSR, M_ZPX, 6 }, { 0x4e, LSR, M_ABS, 6 },
+	{ 0x5e, LSR, M_ABSX, 7 },
+	{ 0xea, NOP, M_IMP, 2 },
+	{ 0x09, ORA, M_IMM, 2 }, { 0x05, ORA, M_ZP, 3 }, { 0x15, ORA, M_ZPX, 4 }, { 0x0d, ORA, M_ABS, 4 },
+	{ 0x1d, ORA, M_ABSX, 4 }, { 0x19, ORA, M_ABSY, 4 }, { 0x01, ORA, M_INDX, 6 }, { 0x11, ORA, M_INDY, 5 },
+	{ 0x48, PHA, M_IMP, 3 }, { 0x08, PHP, M_IMP, 3 }, { 0x68, PLA, M_IMP, 4 }, { 0x28, PLP, M_IMP, 4 },
+	{ 0x2a, ROL, M_ACC, 2 }, { 0x26, ROL, M_ZP, 5 }, { 0x36, ROL, M_ZPX, 6 }, { 0x2e, ROL, M_ABS, 6 },
+	{ 0x3e, ROL, M_ABSX, 7 },
+	{ 0x6a, ROR, M_ACC, 2 }, { 0x66, ROR, M_ZP, 5 }, { 0x76, ROR, M_ZPX, 6 }, { 0x6e, ROR, M_ABS, 6 },
+	{ 0x7e, ROR, M_ABSX, 7 },
+	{ 0x40, RTI, M_IMP, 6 }, { 0x60, RTS, M_IMP, 6 },
+	{ 0xe9, SBC, M_IMM, 2 }, { 0xe5, SBC, M_ZP, 3 }, { 0xf5, SBC, M_ZPX, 4 }, { 0xed, SBC, M_ABS, 4 },
+	{ 0xfd, SBC, M_ABSX, 4 }, { 0xf9, SBC, M_ABSY, 4 }, { 0xe1, SBC, M_INDX, 6 }, { 0xf1, SBC, M_INDY, 5 },
+	{ 0x38, SEC, M_IMP, 2 }, { 0xf8, SED, M_IMP, 2 }, { 0x78, SEI, M_IMP, 2 },
+	{ 0x85, STA, M_ZP, 3 }, { 0x95, STA, M_ZPX, 4 }, { 0x8d, STA, M_ABS, 4 }, { 0x9d, STA, M_ABSX, 5 },
+	{ 0x99, STA, M_ABSY, 5 }, { 0x81, STA, M_INDX, 6 }, { 0x91, STA, M_INDY, 6 },
+	{ 0x86, STX, M_ZP, 3 }, { 0x96, STX, M_ZPY, 4 }, { 0x8e, STX, M_ABS, 4 },
+	{ 0x84, STY, M_ZP, 3 }, { 0x94, STY, M_ZPX, 4 }, { 0x8c, STY, M_ABS, 4 },
+	{ 0xaa, TAX, M_IMP, 2 }, { 0xa8, TAY, M_IMP, 2 }, { 0xba, TSX, M_IMP, 2 }, { 0x8a, TXA, M_IMP, 2 },
+	{ 0x9a, TXS, M_IMP, 2 }, { 0x98, TYA, M_IMP, 2 }
+};
+
+// 6502 running the KickAssembler source of 8BitDiff_6502.s
+struct Decoder6502 : public EmuDecoder {
+	enum {
+		CODE = 0x0200,	// decoder is assembled here
+		DATA = 0x0800,
+		STOP = 0x0100,	// return address of the call, bottom of the stack page
+		MAX_LINES = 4096,
+		MAX_MULTI = 256,
+	};
+	enum { FC = 0x01, FZ = 0x02, FI = 0x04, FD = 0x08, FB = 0x10, FV = 0x40, FN = 0x80 };
+
+	unsigned char mem[0x10000];
+	unsigned char image[DATA];		// assembled code, restored for each run
+	unsigned char phase[0x10000];	// phase of the instruction at each address
+	short ops[256];					// index in aOps6502 by opcode, or -1
+	size_t entry;
+	size_t entry_in_place;			// Patch_8BDiff_InPlace, called when the source is the output
+
+	// source after macro expansion
+	const char *lines[MAX_LINES];
+	int num_lines;
+	unsigned char modes[MAX_LINES];	// addressing mode picked in the first pass
+
+	// multi labels (!name) by line, looked up with !name+ and !name-
+	struct Multi { char name[32]; int line; int addr; } multi[MAX_MULTI];
+	int num_multi;
+	int curr_line;
+
+	unsigned char a, x, y, sp, p;
+	unsigned short pc;
+
+	Decoder6502() : entry(0), entry_in_place(0), num_lines(0), num_multi(0), curr_line(0) {
+		for (int o=0; o<256; o++)
+			ops[o] = -1;
+		for (int i=0; i<(int)(sizeof(aOps6502)/sizeof(aOps6502[0])); i++)
+			ops[aOps6502[i].opcode] = (short)i;
+	}
+	size_t MemorySize() const { return sizeof(mem); }
+	size_t DataStart() const { return DATA; }
+	unsigned char* Memory() { return mem; }
+
+	static bool ResolveMulti(void *user, const char *name, size_t len, char dir, long long &value) {
+		Decoder6502 *cpu = (Decoder6502*)user;
+		int found = -1;
+		for (int m=0; m<cpu->num_multi; m++) {
+			Multi &l = cpu->multi[m];
+			if (strlen(l.name)!=len || strncmp(l.name, name, len))
+				continue;
+			if (dir=='+' && l.line>cpu->curr_line && (found<0 || l.line<cpu->multi[found].line))
+				found = m;
+			else if (dir=='-' && l.line<cpu->curr_line && (found<0 || l.line>cpu->multi[found].line))
+				found = m;
+		}
+		if (found<0 || cpu->multi[found].addr<0)
+			return false;
+		value = cpu->multi[found].addr;
+		return true;
+	}
+
+	int FindOp(int mnem, int mode) const {
+		for (int i=0; i<(int)(sizeof(aOps6502)/sizeof(aOps6502[0])); i++) {
+			if (aOps6502[i].mnem==mnem && aOps6502[i].mode==mode)
+				return i;
+		}
+		return -1;
+	}
+
+	// expand .macro calls into lines, keeps pointers into the source lines
+	bool Expand(EmuLines &src) {
+		struct Macro { const char *name; size_t len; int first, count; } macros[32];
+		int num_macros = 0;
+		for (int l=0; l<src.count; l++) {
+			const char *s = EmuSkipSpace(src.lines[l]);
+			if (!strncmp(s, ".macro", 6)) {
+				s = EmuSkipSpace(s+6);
+				const char *name = s;
+				while (EmuLabelChar(*s))
+					s++;
+				if (num_macros==32)
+					return false;
+				Macro &m = macros[num_macros++];
+				m.name = name;
+				m.len = s-name;
+				m.first = l+1;
+				while (l<src.count && strcmp(EmuSkipSpace(src.lines[l]), "}"))
+					l++;
+				m.count = l-m.first;
+			} else if (*s==':') {
+				const char *name = s+1;
+				size_t len = 0;
+				while (EmuLabelChar(name[len]))
+					len++;
+				int m = 0;
+				while (m<num_macros && (macros[m].len!=len || strncmp(macros[m].name, name, len)))
+					m++;
+				if (m==num_macros) {
+					printf("line %d: unknown macro \"%s\"\n", l+1, s);
+					return false;
+				}
+				for (int i=0; i<macros[m].count && num_lines<MAX_LINES; i++)
+					lines[num_lines++] = src.lines[macros[m].first+i];
+			} else if (num_lines<MAX_LINES)
+				lines[num_lines++] = src.lines[l];
+		}
+		return num_lines<MAX_LINES;
+	}
+
+	// one pass over the expanded source, the first pass picks zero page or absolute
+	// modes and the second pass writes the code
+	bool Pass(EmuSymbols &syms, const EmuRegion *regions, bool write) {
+		int addr = CODE;
+		int curr_phase = PHASE_OTHER;
+		int multi_index = 0;
+		for (curr_line=0; curr_line<num_lines; curr_line++) {
+			const char *s = EmuSkipSpace(lines[curr_line]);
+			if (!*s)
+				continue;
+			if (!strncmp(s, ".label", 6)) {
+				s = EmuSkipSpace(s+6);
+				const char *name = s;
+				while (EmuLabelChar(*s))
+					s++;
+				size_t len = s-name;
+				s = EmuSkipSpace(s);
+				if (*s++!='=')
+					return false;
+				long long value;
+				bool known;
+				EmuEval(s, syms, value, known, ResolveMulti, this);
+				if (!known) {
+					printf("line %d: undefined value in \"%s\"\n", curr_line+1, lines[curr_line]);
+					return false;
+				}
+				syms.Set(name, len, value);
+				continue;
+			}
+			// labels
+			const char *e = s;
+			while (EmuLabelChar(*e))
+				e++;
+			if (*e==':' && e>s) {
+				if (*s=='!') {
+					if (!write && num_multi<MAX_MULTI && (size_t)(e-s)<sizeof(multi[0].name)) {
+						Multi &m = multi[num_multi++];
+						memcpy(m.name, s, e-s);
+						m.name[e-s] = 0;
+						m.line = curr_line;
+						m.addr = addr;
+					} else if (write)
+						multi[multi_index++].addr = addr;
+				} else {
+					syms.Set(s, e-s, addr);
+					char label[64];
+					size_t len = (size_t)(e-s)<sizeof(label) ? e-s : sizeof(label)-1;
+					memcpy(label, s, len);
+					label[len] = 0;
+					int region = EmuRegionPhase(regions, label);
+					if (region>=0)
+						curr_phase = region;
+				}
+				s = EmuSkipSpace(e+1);
+				if (!*s)
+					continue;
+			}
+			// instruction
+			int mnem = 0;
+			while (mnem<MNEM_COUNT && (strncasecmp(s, aMnem6502[mnem], 3) || EmuLabelChar(s[3])))
+				mnem++;
+			if (mnem==MNEM_COUNT) {
+				printf("line %d: unknown instruction \"%s\"\n", curr_line+1, s);
+				return false;
+			}
+			s = EmuSkipSpace(s+3);
+			int mode = M_IMP;
+			long long value = 0;
+			bool known = true;
+			if (*s=='#') {
+				mode = M_IMM;
+				EmuEval(s+1, syms, value, known, ResolveMulti, this);
+			} else if (*s=='(') {
+				const char *t = EmuEval(s+1, syms, value, known, ResolveMulti, this);
+				if (*t==',')
+					mode = M_INDX;
+				else if (*t==')' && EmuSkipSpace(t+1)[0]==',')
+					mode = M_INDY;
+				else
+					mode = M_IND;
+			} else if (*s) {
+				const char *t = EmuEval(s, syms, value, known, ResolveMulti, this);
+				bool zp = write ? (modes[curr_line]==M_ZP || modes[curr_line]==M_ZPX || modes[curr_line]==M_ZPY) :
+					(known && value>=0 && value<0x100);
+				if (*t==',') {
+					t = EmuSkipSpace(t+1);
+					bool is_x = *t=='x' || *t=='X';
+					mode = is_x ? (zp ? M_ZPX : M_ABSX) : (zp ? M_ZPY : M_ABSY);
+					if (FindOp(mnem, mode)<0)	// no zero page version
+						mode = is_x ? M_ABSX : M_ABSY;
+				} else if (FindOp(mnem, M_REL)>=0)
+					mode = M_REL;
+				else {
+					mode = zp ? M_ZP : M_ABS;
+					if (FindOp(mnem, mode)<0)
+						mode = M_ABS;
+				}
+			} else if (FindOp(mnem, M_ACC)>=0)
+				mode = M_ACC;
+			int op = FindOp(mnem, mode);
+			if (op<0) {
+				printf("line %d: addressing mode not supported \"%s\"\n", curr_line+1, lines[curr_line]);
+				return false;
+			}
+			if (!write)
+				modes[curr_line] = (unsigned char)mode;
+			else {
+				if (!known) {
+					printf("line %d: undefined value in \"%s\"\n", curr_line+1, lines[curr_line]);
+					return false;
+				}
+				if (mode==M_REL) {
+					value -= addr+2;
+					if (value<-128 || value>127) {
+						printf("line %d: branch out of range\n", curr_line+1);
+						return false;
+					}
+				}
+				mem[addr] = aOps6502[op].opcode;
+				if (aModeBytes6502[mode]>1)
+					mem[addr+1] = (unsigned char)value;
+				if (aModeBytes6502[mode]>2)
+					mem[addr+2] = (unsigned char)(value>>8);
+				for (int b=0; b<aModeBytes6502[mode]; b++)
+					phase[addr+b] = (unsigned char)curr_phase;
+			}
+			addr += aModeBytes6502[mode];
+			if (addr>=DATA) {
+				printf("6502 decoder is too large\n");
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool Assemble(const char *source, size_t size) {
+		EmuLines src;
+		src.Split(source, size, "//");
+		if (!Expand(src))
+			return false;
+		memset(mem, 0, sizeof(mem));
+		memset(phase, PHASE_OTHER, sizeof(phase));
+		EmuSymbols syms;
+		if (!Pass(syms, a6502Regions, false) || !Pass(syms, a6502Regions, true))
+			return false;
+		int s = syms.Find("Patch_8BDiff", 12);
+		if (s<0) {
+			printf("6502 decoder has no Patch_8BDiff label\n");
+			return false;
+		}
+		entry = (size_t)syms.values[s];
+		s = syms.Find("Patch_8BDiff_InPlace", 20);
+		entry_in_place = s<0 ? entry : (size_t)syms.values[s];
+		memcpy(image, mem, sizeof(image));
+		return true;
+	}
+
+	unsigned char Pull() { return mem[0x100 + ++sp]; }
+	void Push(unsigned char v) { mem[0x100 + sp--] = v; }
+	void SetNZ(unsigned char v) { p = (p & ~(FN|FZ)) | (v & FN) | (v ? 0 : FZ); }
+
+	const char* Run(size_t diff, size_t source, size_t dest, long long limit) {
+		memset(cycles, 0, sizeof(cycles));
+		memcpy(mem, image, sizeof(image));	// a failed run may have written over the code
+		// parameters in zero page
+		mem[0xf0] = (unsigned char)diff; mem[0xf1] = (unsigned char)(diff>>8);
+		mem[0xf2] = (unsigned char)source; mem[0xf3] = (unsigned char)(source>>8);
+		mem[0xf4] = (unsigned char)dest; mem[0xf5] = (unsigned char)(dest>>8);
+		a = x = y = 0;
+		p = 0x24;
+		sp = 0xff;
+		Push((unsigned char)((STOP-1)>>8));	// jsr Patch_8BDiff
+		Push((unsigned char)(STOP-1));
+		pc = (unsigned short)(source==dest ? entry_in_place : entry);
+		cycles[PHASE_SETUP] += 6;
+		long long total = 6;
+		while (pc!=STOP) {
+			if (total>limit)
+				return "cycle limit reached";
+			int o = ops[mem[pc]];
+			if (o<0 || aOps6502[o].mnem==BRK)
+				return "illegal instruction or brk";
+			const Op6502 &op = aOps6502[o];
+			unsigned short at = pc;
+			unsigned short addr = 0;
+			bool cross = false;
+			unsigned short arg = mem[(pc+1)&0xffff] | (mem[(pc+2)&0xffff]<<8);
+			switch (op.mode) {
+				case M_IMM: addr = pc+1; break;
+				case M_ZP: addr = arg & 0xff; break;
+				case M_ZPX: addr = (arg+x) & 0xff; break;
+				case M_ZPY: addr = (arg+y) & 0xff; break;
+				case M_ABS: addr = arg; break;
+				case M_ABSX: addr = arg+x; cross = (addr^arg)>0xff; break;
+				case M_ABSY: addr = arg+y; cross = (addr^arg)>0xff; break;
+				case M_IND: addr = mem[arg] | (mem[(arg&0xff00) | ((arg+1)&0xff)]<<8); break;
+				case M_INDX: addr = mem[(arg+x)&0xff] | (mem[(arg+x+1)&0xff]<<8); break;
+				case M_INDY: {
+					unsigned short base = mem[arg&0xff] | (mem[(arg+1)&0xff]<<8);
+					addr = base+y;
+					cross = (addr^base)>0xff;
+					break;
+				}
+				case M_REL: addr = pc+2+(signed char)arg; break;
+			}
+			pc += aModeBytes6502[op.mode];
+			int c = op.cycles;
+			unsigned char m = op.mode==M_ACC ? a : mem[addr];
+			unsigned int t;
+			bool branch = false;
+			switch (op.mnem) {
+				case ADC: case SBC:	// binary mode only, the decoder doesn't use decimal mode
+					if (op.mnem==SBC)
+						m ^= 0xff;
+					t = a + m + (p & FC);
+					p = (p & ~(FC|FV)) | (t>0xff ? FC : 0) | ((~(a^m) & (a^t) & 0x80) ? FV : 0);
+					SetNZ(a = (unsigned char)t);
+					c += cross;
+					break;
+				case AND: SetNZ(a &= m); c += cross; break;
+				case ORA: SetNZ(a |= m); c += cross; break;
+				case EOR: SetNZ(a ^= m); c += cross; break;
+				case ASL: case LSR: case ROL: case ROR: {
+					unsigned char cin = p & FC;
+					bool left = op.mnem==ASL || op.mnem==ROL;
+					p = (p & ~FC) | (left ? m>>7 : m&1);
+					m = left ? (unsigned char)(m<<1) : m>>1;
+					if (op.mnem==ROL)
+						m |= cin;
+					else if (op.mnem==ROR)
+						m |= cin<<7;
+					SetNZ(m);
+					if (op.mode==M_ACC)
+						a = m;
+					else
+						mem[addr] = m;
+					break;
+				}
+				case BCC: branch = !(p & FC); break;
+				case BCS: branch = !!(p & FC); break;
+				case BNE: branch = !(p & FZ); break;
+				case BEQ: branch = !!(p & FZ); break;
+				case BPL: branch = !(p & FN); break;
+				case BMI: branch = !!(p & FN); break;
+				case BVC: branch = !(p & FV); break;
+				case BVS: branch = !!(p & FV); break;
+				case BIT: p = (p & ~(FN|FV|FZ)) | (m & (FN|FV)) | ((a & m) ? 0 : FZ); break;
+				case CLC: p &= ~FC; break;
+				case CLD: p &= ~FD; break;
+				case CLI: p &= ~FI; break;
+				case CLV: p &= ~FV; break;
+				case SEC: p |= FC; break;
+				case SED: p |= FD; break;
+				case SEI: p |= FI; break;
+				case CMP: case CPX: case CPY: {
+					unsigned char r = op.mnem==CMP ? a : (op.mnem==CPX ? x : y);
+					p = (p & ~FC) | (r>=m ? FC : 0);
+					SetNZ((unsigned char)(r-m));
+					c += cross;
+					break;
+				}
+				case DEC: SetNZ(--mem[addr]); break;
+				case INC: SetNZ(++mem[addr]); break;
+				case DEX: SetNZ(--x); break;
+				case DEY: SetNZ(--y); break;
+				case INX: SetNZ(++x); break;
+				case INY: SetNZ(++y); break;
+				case JMP: pc = addr; break;
+				case JSR:
+					Push((unsigned char)((pc-1)>>8));
+					Push((unsigned char)(pc-1));
+					pc = addr;
+					break;
+				case RTS: pc = Pull(); pc = (pc | (Pull()<<8)) + 1; break;
+				case RTI: p = (Pull() & ~FB) | 0x20; pc = Pull(); pc |= Pull()<<8; break;
+				case LDA: SetNZ(a = m); c += cross; break;
+				case LDX: SetNZ(x = m); c += cross; break;
+				case LDY: SetNZ(y = m); c += cross; break;
+				case STA: mem[addr] = a; break;
+				case STX: mem[addr] = x; break;
+				case STY: mem[addr] = y; break;
+				case PHA: Push(a); break;
+				case PHP: Push(p | FB | 0x20); break;
+				case PLA: SetNZ(a = Pull()); break;
+				case PLP: p = (Pull() & ~FB) | 0x20; break;
+				case TAX: SetNZ(x = a); break;
+				case TAY: SetNZ(y = a); break;
+				case TSX: SetNZ(x = sp); break;
+				case TXA: SetNZ(a = x); break;
+				case TXS: sp = x; break;
+				case TYA: SetNZ(a = y); break;
+				default: break;
+			}
+			if (branch) {
+				c += ((pc^addr) & 0xff00) ? 2 : 1;
+				pc = addr;
+			}
+			cycles[phase[at]] += c;
+			total += c;
+		}
+		return nullptr;
+	}
+};
+
+// Operand of a parsed Z80 or 68000 source line
+enum EmuOperandType {
+	OPD_NONE,
+	OPD_REG8,		// z80 a..l
+	OPD_REG16,		// z80 bc..iy
+	OPD_IND,		// z80 (bc), (de), (hl), (ix+d), (iy+d)
+	OPD_MEM,		// z80 (nn)
+	OPD_COND,		// z80 nz, z, nc, c, po, pe, p, m
+	OPD_DREG,		// 68000 d0..d7
+	OPD_AREG,		// 68000 a0..a7
+	OPD_AIND,		// 68000 (an), d(an)
+	OPD_POSTINC,	// 68000 (an)+
+	OPD_PREDEC,		// 68000 -(an)
+	OPD_INDEX,		// 68000 d(an,xn)
+	OPD_IMM,		// #n on the 68000
+	OPD_ADDR,		// number or label
+};
+
+struct EmuOperand {
+	EmuOperandType type;
+	int reg;			// register, pointer register or condition
+	int index;			// index register for OPD_INDEX, 8-15 for address registers
+	bool index_long;
+	long long value;	// value, displacement or instruction index of a label
+	const char *expr;	// expression resolved after all labels are known
+};
+
+// Instruction of a parsed Z80 or 68000 source line
+struct EmuInstr {
+	char mnem[8];
+	int size;			// 68000 operation size in bytes
+	int num_operands;
+	EmuOperand opd[2];
+	int line;
+	unsigned char phase;
+};
+
+// Z80 and 68000 source split into instructions, labels are instruction indices
+struct EmuProgram {
+	EmuInstr *instr;
+	int count;
+	EmuSymbols labels;
+
+	EmuProgram() : instr(nullptr), count(0) {}
+	~EmuProgram() { free(instr); }
+
+	// resolve the label and number operands
+	bool Resolve() {
+		for (int i=0; i<count; i++) {
+			for (int o=0; o<instr[i].num_operands; o++) {
+				EmuOperand &opd = instr[i].opd[o];
+				if (!opd.expr)
+					continue;
+				bool known;
+				EmuEval(opd.expr, labels, opd.value, known);
+				if (!known) {
+					printf("line %d: undefined value \"%s\"\n", instr[i].line, opd.expr);
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+// split operands at commas outside parentheses, returns number of operands
+int EmuSplitOperands(char *s, char **opds, int max)
+{
+	int count = 0, depth = 0;
+	s = (char*)EmuSkipSpace(s);
+	if (!*s)
+		return 0;
+	opds[count++] = s;
+	for (; *s; s++) {
+		if (*s=='(')
+			depth++;
+		else if (*s==')')
+			depth--;
+		else if (*s==',' && !depth) {
+			*s = 0;
+			if (count==max)
+				return -1;
+			opds[count++] = (char*)EmuSkipSpace(s+1);
+		}
+	}
+	for (int o=0; o<count; o++) {
+		size_t len = strlen(opds[o]);
+		while (len && (opds[o][len-1]==' ' || opds[o][len-1]=='\t'))
+			opds[o][--len] = 0;
+	}
+	return count;
+}
+
+// Z80 running 8BitDiff_z80.s one source line at a time
+struct DecoderZ80 : public EmuDecoder {
+	enum {
+		WORK = 0x0010,		// 14 bytes of work memory in IX
+		STACK = 0x0800,
+		DATA = 0x0800,
+		STOP = 0xffff,		// return address of the call
+	};
+	// 8 bit registers in instruction encoding order, 6 is F
+	enum { RB, RC, RD, RE, RH, RL, RF, RA };
+	// register pairs
+	enum { BC, DE, HL, SP, AF, IX, IY };
+	enum { FC = 0x01, FN = 0x02, FP = 0x04, FH = 0x10, FZ = 0x40, FS = 0x80 };
+
+	unsigned char mem[0x10000];
+	EmuProgram prog;
+	int entry;
+
+	unsigned char r[8];
+	unsigned short ix, iy, sp;
+
+	DecoderZ80() : entry(0) {}
+	size_t MemorySize() const { return sizeof(mem); }
+	size_t DataStart() const { return DATA; }
+	unsigned char* Memory() { return mem; }
+
+	static int Reg8(const char *s) {
+		static const char *names = "bcdehl-a";
+		if (!s[0] || s[1])
+			return -1;
+		const char *c = strchr(names, s[0]|0x20);
+		return c && *c!='-' ? (int)(c-names) : -1;
+	}
+	static int Reg16(const char *s) {
+		static const char *names[] = { "bc", "de", "hl", "sp", "af", "ix", "iy" };
+		for (int i=0; i<7; i++) {
+			if (!strcasecmp(s, names[i]))
+				return i;
 		}
-		total[i] = totes;
-		top[i] = tops;
+		return -1;
+	}
+	static int Cond(const char *s) {
+		static const char *names[] = { "nz", "z", "nc", "c", "po", "pe", "p", "m" };
+		for (int i=0; i<8; i++) {
+			if (!strcasecmp(s, names[i]))
+				return i;
+		}
+		return -1;
 	}
 
-	// find an optimal distribution of bit buckets to represent the sizes
-	// 1) bounded by 0 and top
-	for (int i=0; i<TYPES; i++) {
-		int minCost = 1<<30;
-		bitSizesCount[i] = 0;
-		// number of bits to represent the size (0 = constant)
-		for (int b=0; b<=EB_SIZE_BITS_MAX; b++) {
-			char i2b[1<<EB_SIZE_BITS_MAX];
-			int last = (1<<b)-1;
-			for (int j=0; j<last; j++)
-				i2b[j] = j+1; // min valid amount of bits = 1
-			i2b[last] = top[i];
+	bool ParseOperand(char *s, EmuOperand &opd, bool cond) {
+		memset(&opd, 0, sizeof(opd));
+		if (cond && (opd.reg = Cond(s))>=0)
+			opd.type = OPD_COND;
+		else if ((opd.reg = Reg8(s))>=0)
+			opd.type = OPD_REG8;
+		else if ((opd.reg = Reg16(s))>=0)
+			opd.type = OPD_REG16;
+		else if (*s=='(') {
+			char *e = s+strlen(s)-1;
+			if (*e!=')')
+				return false;
+			*e = 0;
+			char *in = (char*)EmuSkipSpace(s+1);
+			char *p = in;
+			while (EmuLabelChar(*p))
+				p++;
+			char c = *p;
+			*p = 0;
+			opd.reg = Reg16(in);
+			*p = c;
+			if (opd.reg>=0 && opd.reg!=SP && opd.reg!=AF) {
+				opd.type = OPD_IND;
+				p = (char*)EmuSkipSpace(p);
+				if (*p=='+' || *p=='-') {
+					if (opd.reg!=IX && opd.reg!=IY)
+						return false;
+					opd.expr = *p=='+' ? p+1 : p;
+				}
+			} else {
+				opd.type = OPD_MEM;
+				opd.expr = in;
+			}
+		} else {
+			opd.type = OPD_ADDR;
+			opd.expr = s;
+		}
+		return true;
+	}
 
-			bool shuffled = false;
-			do {
-				// calculate size at current setup
-				int s = 0;
-				int bits = 0;
-				for (int n=0; n<=top[i]; n++) {
-					if (n>i2b[s])
-						s++;
-					bits += bitCounts[i][n] * (i2b[s] + b);
+	bool Assemble(const char *source, size_t size) {
+		EmuLines src;
+		src.Split(source, size, ";");
+		prog.instr = (EmuInstr*)calloc(src.count, sizeof(EmuInstr));
+		int curr_phase = PHASE_OTHER;
+		for (int l=0; l<src.count; l++) {
+			char *s = (char*)EmuSkipSpace(src.lines[l]);
+			char *e = s;
+			while (EmuLabelChar(*e))
+				e++;
+			if (*e==':' && e>s) {
+				prog.labels.Set(s, e-s, prog.count);
+				*e = 0;
+				int region = EmuRegionPhase(aZ80Regions, s);
+				if (region>=0)
+					curr_phase = region;
+				s = (char*)EmuSkipSpace(e+1);
+			}
+			if (!*s)
+				continue;
+			EmuInstr &in = prog.instr[prog.count];
+			e = s;
+			while (EmuLabelChar(*e))
+				e++;
+			if (e-s>=(int)sizeof(in.mnem)) {
+				printf("line %d: unknown instruction \"%s\"\n", l+1, s);
+				return false;
+			}
+			for (int c=0; c<e-s; c++)
+				in.mnem[c] = s[c]|0x20;
+			in.line = l+1;
+			in.phase = (unsigned char)(strcmp(in.mnem, "ldir") ? curr_phase : PHASE_COPY);
+			char *opds[2];
+			in.num_operands = EmuSplitOperands(e, opds, 2);
+			bool cond = !strcmp(in.mnem, "jr") || !strcmp(in.mnem, "jp") || !strcmp(in.mnem, "call") || !strcmp(in.mnem, "ret");
+			for (int o=0; o<in.num_operands; o++) {
+				if (!ParseOperand(opds[o], in.opd[o], cond && o==0 && (in.num_operands==2 || in.mnem[0]=='r'))) {
+					printf("line %d: can't parse operand \"%s\"\n", l+1, opds[o]);
+					return false;
 				}
-				if (bits < minCost) {
-					minCost = bits;
-					bitSizesCount[i] = b;
-					for (int c=0; c<(1<<3); c++)
-						besti2b[i][c] = i2b[c];
+			}
+			if (in.num_operands<0) {
+				printf("line %d: too many operands\n", l+1);
+				return false;
+			}
+			prog.count++;
+		}
+		int s = prog.labels.Find("Patch_8BDiff", 12);
+		if (s<0) {
+			printf("z80 decoder has no Patch_8BDiff label\n");
+			return false;
+		}
+		entry = (int)prog.labels.values[s];
+		return prog.Resolve();
+	}
+
+	unsigned short Pair(int p) const {
+		switch (p) {
+			case BC: return (r[RB]<<8) | r[RC];
+			case DE: return (r[RD]<<8) | r[RE];
+			case HL: return (r[RH]<<8) | r[RL];
+			case SP: return sp;
+			case AF: return (r[RA]<<8) | r[RF];
+			case IX: return ix;
+			default: return iy;
+		}
+	}
+	void SetPair(int p, unsigned short v) {
+		switch (p) {
+			case BC: r[RB] = v>>8; r[RC] = (unsigned char)v; break;
+			case DE: r[RD] = v>>8; r[RE] = (unsigned char)v; break;
+			case HL: r[RH] = v>>8; r[RL] = (unsigned char)v; break;
+			case SP: sp = v; break;
+			case AF: r[RA] = v>>8; r[RF] = (unsigned char)v; break;
+			case IX: ix = v; break;
+			default: iy = v; break;
+		}
+	}
+	unsigned short Addr(const EmuOperand &o) const {
+		return o.type==OPD_MEM ? (unsigned short)o.value : (unsigned short)(Pair(o.reg) + o.value);
+	}
+	unsigned char Get8(const EmuOperand &o) const {
+		switch (o.type) {
+			case OPD_REG8: return r[o.reg];
+			case OPD_IND: case OPD_MEM: return mem[Addr(o)];
+			default: return (unsigned char)o.value;
+		}
+	}
+	void Set8(const EmuOperand &o, unsigned char v) {
+		if (o.type==OPD_REG8)
+			r[o.reg] = v;
+		else
+			mem[Addr(o)] = v;
+	}
+	void Push(unsigned short v) {
+		mem[--sp] = v>>8;
+		mem[--sp] = (unsigned char)v;
+	}
+	unsigned short Pop() {
+		unsigned short v = mem[sp++];
+		return v | (mem[sp++]<<8);
+	}
+	static unsigned char Parity(unsigned char v) {
+		v ^= v>>4; v ^= v>>2; v ^= v>>1;
+		return (v & 1) ? 0 : FP;
+	}
+	unsigned char SZP(unsigned char v) const {
+		return (v & FS) | (v ? 0 : FZ) | Parity(v);
+	}
+	bool Condition(int c) const {
+		static const unsigned char flag[4] = { FZ, FC, FP, FS };
+		return !(r[RF] & flag[c>>1]) == !(c & 1);
+	}
+	// cycles of 8 bit operands: register, (hl) or immediate, (ix+d)
+	static int Cost8(const EmuOperand &o, int reg, int hl, int ix) {
+		if (o.type==OPD_REG8)
+			return reg;
+		if (o.type==OPD_IND && o.reg>=IX)
+			return ix;
+		return hl;
+	}
+
+	// run one instruction, returns the number of cycles or 0 if not supported
+	int Step(const EmuInstr &in, int &pc) {
+		const EmuOperand &a = in.opd[0], &b = in.opd[1];
+		const char *m = in.mnem;
+		unsigned char &f = r[RF];
+		int n = in.num_operands;
+		if (!strcmp(m, "ld")) {
+			if (a.type==OPD_REG16 || (a.type==OPD_MEM && b.type==OPD_REG16)) {
+				if (a.type==OPD_MEM) {
+					unsigned short v = Pair(b.reg);
+					mem[Addr(a)] = (unsigned char)v;
+					mem[(Addr(a)+1)&0xffff] = v>>8;
+					return b.reg==HL ? 16 : 20;
 				}
-				shuffled = false;
-				// now attempt to shuffle..
-				for (int bi=last-1; bi>=0; --bi) {
-					int v = i2b[bi];
-					if ((i2b[bi+1]-v)>1) {
-						v++;
-						i2b[bi] = v;
-						shuffled = true;
-						for (int b2=bi+1; b2<last; b2++) {
-							++v;
-							i2b[b2] = v;
-						}
-						break;
-					}
+				bool index = a.reg>=IX;
+				if (b.type==OPD_MEM) {
+					SetPair(a.reg, mem[Addr(b)] | (mem[(Addr(b)+1)&0xffff]<<8));
+					return a.reg==HL ? 16 : 20;
 				}
-			} while (shuffled);
+				if (b.type==OPD_REG16) {	// ld sp, hl
+					SetPair(a.reg, Pair(b.reg));
+					return b.reg>=IX ? 10 : 6;
+				}
+				SetPair(a.reg, (unsigned short)b.value);
+				return index ? 14 : 10;
+			}
+			Set8(a, Get8(b));
+			if (a.type==OPD_MEM || b.type==OPD_MEM)
+				return 13;
+			if (a.type==OPD_REG8 && b.type==OPD_REG8)
+				return 4;
+			if ((a.type==OPD_IND && a.reg>=IX) || (b.type==OPD_IND && b.reg>=IX))
+				return 19;
+			return a.type==OPD_IND && b.type!=OPD_REG8 ? 10 : 7;
+		}
+		if (!strcmp(m, "push")) {
+			Push(Pair(a.reg));
+			return a.reg>=IX ? 15 : 11;
+		}
+		if (!strcmp(m, "pop")) {
+			SetPair(a.reg, Pop());
+			return a.reg>=IX ? 14 : 10;
+		}
+		if ((!strcmp(m, "add") || !strcmp(m, "adc") || !strcmp(m, "sbc")) && a.type==OPD_REG16) {
+			unsigned int x = Pair(a.reg), y = Pair(b.reg);
+			if (!strcmp(m, "add")) {
+				unsigned int t = x + y;
+				f = (f & (FS|FZ|FP)) | (((x&0xfff)+(y&0xfff))>0xfff ? FH : 0) | (t>0xffff ? FC : 0);
+				SetPair(a.reg, (unsigned short)t);
+				return a.reg>=IX ? 15 : 11;
+			}
+			int cin = f & FC;
+			bool sub = m[0]=='s';
+			unsigned int t = sub ? x - y - cin : x + y + cin;
+			bool h = sub ? (int)(x&0xfff)-(int)(y&0xfff)-cin<0 : ((x&0xfff)+(y&0xfff)+cin)>0xfff;
+			bool v = sub ? ((x^y) & (x^t) & 0x8000)!=0 : (~(x^y) & (x^t) & 0x8000)!=0;
+			f = ((t>>8) & FS) | ((t&0xffff) ? 0 : FZ) | (h ? FH : 0) | (v ? FP : 0) | (sub ? FN : 0) | (t>0xffff ? FC : 0);
+			SetPair(a.reg, (unsigned short)t);
+			return 15;
+		}
+		static const char *alu[] = { "add", "adc", "sub", "sbc", "and", "xor", "or", "cp" };
+		for (int op=0; op<8; op++) {
+			if (strcmp(m, alu[op]))
+				continue;
+			const EmuOperand &s = n==2 ? b : a;
+			unsigned int x = r[RA], y = Get8(s);
+			int cin = (op==1 || op==3) ? (f & FC) : 0;
+			if (op>=4 && op<=6) {
+				unsigned char t = op==4 ? x & y : (op==5 ? x ^ y : x | y);
+				r[RA] = t;
+				f = SZP(t) | (op==4 ? FH : 0);
+			} else {
+				bool sub = op>=2;
+				unsigned int t = sub ? x - y - cin : x + y + cin;
+				bool h = sub ? (int)(x&0xf)-(int)(y&0xf)-cin<0 : ((x&0xf)+(y&0xf)+cin)>0xf;
+				bool v = sub ? ((x^y) & (x^t) & 0x80)!=0 : (~(x^y) & (x^t) & 0x80)!=0;
+				f = (t & FS) | ((t&0xff) ? 0 : FZ) | (h ? FH : 0) | (v ? FP : 0) | (sub ? FN : 0) | (t>0xff ? FC : 0);
+				if (op!=7)
+					r[RA] = (unsigned char)t;
+			}
+			return Cost8(s, 4, 7, 19);
+		}
+		if (!strcmp(m, "inc") || !strcmp(m, "dec")) {
+			bool dec = m[0]=='d';
+			if (a.type==OPD_REG16) {
+				SetPair(a.reg, Pair(a.reg) + (dec ? -1 : 1));
+				return a.reg>=IX ? 10 : 6;
+			}
+			unsigned char v = Get8(a), t = v + (dec ? -1 : 1);
+			Set8(a, t);
+			f = (f & FC) | (t & FS) | (t ? 0 : FZ) | (dec ? FN : 0) |
+				(((dec ? v : t) & 0xf)==0 ? FH : 0) | ((dec ? v==0x80 : v==0x7f) ? FP : 0);
+			return Cost8(a, 4, 11, 23);
+		}
+		static const char *shift[] = { "rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl" };
+		for (int op=0; op<8; op++) {
+			if (strcmp(m, shift[op]))
+				continue;
+			unsigned char v = Get8(a), t;
+			int cin = f & FC, cout;
+			if (!(op & 1)) {	// left
+				cout = v>>7;
+				t = (unsigned char)(v<<1) | (op==0 ? cout : (op==2 ? cin : (op==6 ? 1 : 0)));
+			} else {
+				cout = v & 1;
+				t = (v>>1) | (op==1 ? cout<<7 : (op==3 ? cin<<7 : (op==5 ? v & 0x80 : 0)));
+			}
+			Set8(a, t);
+			f = SZP(t) | cout;
+			return Cost8(a, 8, 15, 23);
+		}
+		if (!strcmp(m, "rla") || !strcmp(m, "rra") || !strcmp(m, "rlca") || !strcmp(m, "rrca")) {
+			unsigned char v = r[RA];
+			bool left = m[1]=='l';
+			int cin = m[2]=='c' ? (left ? v>>7 : v & 1) : (f & FC);
+			r[RA] = left ? (unsigned char)(v<<1) | cin : (v>>1) | (cin<<7);
+			f = (f & (FS|FZ|FP)) | (left ? v>>7 : v & 1);
+			return 4;
+		}
+		if (!strcmp(m, "scf")) { f = (f & (FS|FZ|FP)) | FC; return 4; }
+		if (!strcmp(m, "ccf")) { f = (f & (FS|FZ|FP)) | ((f & FC) ? FH : FC); return 4; }
+		if (!strcmp(m, "cpl")) { r[RA] = ~r[RA]; f |= FH|FN; return 4; }
+		if (!strcmp(m, "nop")) return 4;
+		if (!strcmp(m, "ex") && a.type==OPD_REG16 && a.reg==DE) {
+			unsigned short t = Pair(DE);
+			SetPair(DE, Pair(HL));
+			SetPair(HL, t);
+			return 4;
+		}
+		if (!strcmp(m, "jr") || !strcmp(m, "jp")) {
+			bool jump = n==1 || Condition(a.reg);
+			if (jump)
+				pc = (int)(n==1 ? a : b).value;
+			return m[1]=='p' ? 10 : (jump ? 12 : 7);
+		}
+		if (!strcmp(m, "djnz")) {
+			if (--r[RB]) {
+				pc = (int)a.value;
+				return 13;
+			}
+			return 8;
+		}
+		if (!strcmp(m, "call")) {
+			if (n==2 && !Condition(a.reg))
+				return 10;
+			Push((unsigned short)pc);
+			pc = (int)(n==1 ? a : b).value;
+			return 17;
+		}
+		if (!strcmp(m, "ret")) {
+			if (n==1 && !Condition(a.reg))
+				return 5;
+			pc = Pop();
+			return n==1 ? 11 : 10;
+		}
+		if (!strcmp(m, "ldir")) {
+			int c = 0;
+			do {
+				mem[Pair(DE)] = mem[Pair(HL)];
+				SetPair(DE, Pair(DE)+1);
+				SetPair(HL, Pair(HL)+1);
+				SetPair(BC, Pair(BC)-1);
+				c += Pair(BC) ? 21 : 16;
+			} while (Pair(BC));
+			f &= FS|FZ|FC;
+			return c;
+		}
+		return 0;
+	}
+
+	const char* Run(size_t diff, size_t source, size_t dest, long long limit) {
+		memset(cycles, 0, sizeof(cycles));
+		memset(r, 0, sizeof(r));
+		SetPair(HL, (unsigned short)diff);
+		SetPair(BC, (unsigned short)source);
+		SetPair(DE, (unsigned short)dest);
+		ix = WORK;
+		iy = 0;
+		sp = STACK;
+		Push(STOP);	// call Patch_8BDiff
+		cycles[PHASE_SETUP] += 17;
+		long long total = 17;
+		int pc = entry;
+		while (pc!=STOP) {
+			if (total>limit)
+				return "cycle limit reached";
+			if (pc<0 || pc>=prog.count)
+				return "jumped outside the decoder";
+			const EmuInstr &in = prog.instr[pc++];
+			int c = Step(in, pc);
+			if (!c) {
+				static char error[64];
+				snprintf(error, sizeof(error), "unsupported instruction on line %d", in.line);
+				return error;
+			}
+			cycles[in.phase] += c;
+			total += c;
+		}
+		return nullptr;
+	}
+};
+
+// 68000 running 8BitDiff_68k.s one source line at a time
+struct Decoder68k : public EmuDecoder {
+	enum {
+		MEMORY = 1<<20,
+		DATA = 0x1000,
+		STOP = 0x7fffffff,	// return address of the call
+	};
+	enum { CC_T, CC_F, CC_HI, CC_LS, CC_CC, CC_CS, CC_NE, CC_EQ, CC_VC, CC_VS, CC_PL, CC_MI, CC_GE, CC_LT, CC_GT, CC_LE };
+
+	// resolved operand, register or memory address
+	struct Loc {
+		EmuOperandType type;
+		int reg;
+		unsigned int addr;
+	};
+
+	unsigned char *mem;
+	EmuProgram prog;
+	int entry;
+	const char *fault;
+
+	unsigned int d[8], a[8];
+	bool fx, fn, fz, fv, fc;
+
+	Decoder68k() : entry(0), fault(nullptr) { mem = (unsigned char*)calloc(MEMORY, 1); }
+	~Decoder68k() { free(mem); }
+	size_t MemorySize() const { return MEMORY; }
+	size_t DataStart() const { return DATA; }
+	unsigned char* Memory() { return mem; }
+
+	static int Reg(const char *s, size_t len, bool &addr) {
+		if (len==2 && (s[0]|0x20)=='s' && (s[1]|0x20)=='p') {
+			addr = true;
+			return 7;
+		}
+		if (len!=2 || s[1]<'0' || s[1]>'7' || ((s[0]|0x20)!='d' && (s[0]|0x20)!='a'))
+			return -1;
+		addr = (s[0]|0x20)=='a';
+		return s[1]-'0';
+	}
+	static int Cond(const char *s) {
+		static const char *names[] = { "t", "f", "hi", "ls", "cc", "cs", "ne", "eq", "vc", "vs", "pl", "mi", "ge", "lt", "gt", "le", "hs", "lo", "ra" };
+		for (int i=0; i<19; i++) {
+			if (!strcmp(s, names[i]))
+				return i<16 ? i : (i==16 ? CC_CC : (i==17 ? CC_CS : CC_F));	// dbra is dbf
+		}
+		return -1;
+	}
+
+	bool ParseOperand(char *s, EmuOperand &opd) {
+		memset(&opd, 0, sizeof(opd));
+		size_t len = strlen(s);
+		bool addr;
+		if ((opd.reg = Reg(s, len, addr))>=0) {
+			opd.type = addr ? OPD_AREG : OPD_DREG;
+			return true;
+		}
+		if (*s=='#') {
+			opd.type = OPD_IMM;
+			opd.expr = s+1;
+			return true;
 		}
+		if (*s=='-' && s[1]=='(') {
+			opd.type = OPD_PREDEC;
+			opd.reg = Reg(EmuSkipSpace(s+2), 2, addr);
+			return opd.reg>=0 && addr;
+		}
+		char *open = strchr(s, '(');
+		if (!open) {
+			opd.type = OPD_ADDR;
+			opd.expr = s;
+			return true;
+		}
+		char *close = strchr(open, ')');
+		if (!close)
+			return false;
+		// displacement before or as the first item inside the parentheses
+		if (open>s) {
+			*open = 0;
+			opd.expr = s;
+		}
+		char *items[3];
+		*close = 0;
+		int num = EmuSplitOperands(open+1, items, 3);
+		if (num<1)
+			return false;
+		int first = 0;
+		if (Reg(items[0], strlen(items[0]), addr)<0) {
+			opd.expr = items[0];
+			first = 1;
+		}
+		if (first>=num || (opd.reg = Reg(items[first], strlen(items[first]), addr))<0 || !addr)
+			return false;
+		if (first+1<num) {
+			bool index_addr;
+			char *ix = items[first+1];
+			char *size = strchr(ix, '.');
+			opd.index_long = size && (size[1]|0x20)=='l';
+			if ((opd.index = Reg(ix, size ? size-ix : strlen(ix), index_addr))<0)
+				return false;
+			opd.index += index_addr ? 8 : 0;
+			opd.type = OPD_INDEX;
+		} else if (EmuSkipSpace(close+1)[0]=='+')
+			opd.type = OPD_POSTINC;
+		else
+			opd.type = OPD_AIND;
+		return true;
+	}
+
+	bool Assemble(const char *source, size_t size) {
+		EmuLines src;
+		src.Split(source, size, ";");
+		prog.instr = (EmuInstr*)calloc(src.count, sizeof(EmuInstr));
+		int curr_phase = PHASE_OTHER;
+		for (int l=0; l<src.count; l++) {
+			char *s = src.lines[l];
+			if (*s && *s!=' ' && *s!='\t') {	// labels start in the first column
+				char *e = s;
+				while (EmuLabelChar(*e))
+					e++;
+				prog.labels.Set(s, e-s, prog.count);
+				char c = *e;
+				*e = 0;
+				int region = EmuRegionPhase(a68kRegions, s);
+				if (region>=0)
+					curr_phase = region;
+				*e = c;
+				s = e + (*e==':');
+			}
+			s = (char*)EmuSkipSpace(s);
+			if (!*s)
+				continue;
+			EmuInstr &in = prog.instr[prog.count];
+			char *e = s;
+			while (*e && *e!='.' && *e!=' ' && *e!='\t')
+				e++;
+			if (e-s>=(int)sizeof(in.mnem)) {
+				printf("line %d: unknown instruction \"%s\"\n", l+1, s);
+				return false;
+			}
+			for (int c=0; c<e-s; c++)
+				in.mnem[c] = s[c]|0x20;
+			in.size = !strcmp(in.mnem, "moveq") ? 4 : 2;
+			if (*e=='.') {
+				switch (e[1]|0x20) {
+					case 'b': in.size = 1; break;
+					case 'l': in.size = 4; break;
+				}
+				e += 2;
+			}
+			in.line = l+1;
+			in.phase = (unsigned char)curr_phase;
+			char *opds[2];
+			in.num_operands = EmuSplitOperands(e, opds, 2);
+			if (in.num_operands<0) {
+				printf("line %d: too many operands\n", l+1);
+				return false;
+			}
+			for (int o=0; o<in.num_operands; o++) {
+				if (!ParseOperand(opds[o], in.opd[o])) {
+					printf("line %d: can't parse operand \"%s\"\n", l+1, opds[o]);
+					return false;
+				}
+			}
+			prog.count++;
+		}
+		int s = prog.labels.Find("Patch_8BDiff", 12);
+		if (s<0) {
+			printf("68k decoder has no Patch_8BDiff label\n");
+			return false;
+		}
+		entry = (int)prog.labels.values[s];
+		return prog.Resolve();
+	}
+
+	static unsigned int Mask(int size) { return size==4 ? 0xffffffff : (1u<<(size*8))-1; }
+	static unsigned int Sign(int size) { return 1u<<(size*8-1); }
+	static unsigned int Extend(unsigned int v, int size) {
+		return size==1 ? (unsigned int)(int)(signed char)v : (size==2 ? (unsigned int)(int)(short)v : v);
+	}
+
+	unsigned int Read(unsigned int addr, int size) {
+		if (addr+size>MEMORY) {
+			fault = "memory read out of range";
+			return 0;
+		}
+		unsigned int v = 0;
+		for (int b=0; b<size; b++)
+			v = (v<<8) | mem[addr+b];
+		return v;
+	}
+	void Write(unsigned int addr, int size, unsigned int v) {
+		if (addr+size>MEMORY) {
+			fault = "memory write out of range";
+			return;
+		}
+		for (int b=size-1; b>=0; b--, v>>=8)
+			mem[addr+b] = (unsigned char)v;
+	}
+
+	// address an operand, applies (an)+ and -(an)
+	Loc Locate(const EmuOperand &o, int size) {
+		Loc l = { o.type, o.reg, 0 };
+		int step = (size==1 && o.reg==7) ? 2 : size;
+		switch (o.type) {
+			case OPD_AIND: l.addr = a[o.reg] + (unsigned int)o.value; break;
+			case OPD_POSTINC: l.addr = a[o.reg]; a[o.reg] += step; break;
+			case OPD_PREDEC: a[o.reg] -= step; l.addr = a[o.reg]; break;
+			case OPD_INDEX: {
+				unsigned int x = o.index>=8 ? a[o.index-8] : d[o.index];
+				l.addr = a[o.reg] + (unsigned int)o.value + (o.index_long ? x : Extend(x, 2));
+				break;
+			}
+			case OPD_ADDR: l.addr = (unsigned int)o.value; break;
+			default: break;
+		}
+		l.addr &= 0xffffff;
+		return l;
+	}
+	unsigned int Get(const Loc &l, const EmuOperand &o, int size) {
+		switch (l.type) {
+			case OPD_DREG: return d[l.reg] & Mask(size);
+			case OPD_AREG: return a[l.reg] & Mask(size);
+			case OPD_IMM: return (unsigned int)o.value & Mask(size);
+			default: return Read(l.addr, size);
+		}
+	}
+	void Put(const Loc &l, int size, unsigned int v) {
+		v &= Mask(size);
+		if (l.type==OPD_DREG)
+			d[l.reg] = (d[l.reg] & ~Mask(size)) | v;
+		else if (l.type==OPD_AREG)
+			a[l.reg] = Extend(v, size);
+		else
+			Write(l.addr, size, v);
+	}
+	void SetNZ(unsigned int v, int size) {
+		fn = (v & Sign(size))!=0;
+		fz = (v & Mask(size))==0;
+		fv = fc = false;
+	}
+	bool Condition(int cc) const {
+		switch (cc) {
+			case CC_T: return true;
+			case CC_F: return false;
+			case CC_HI: return !fc && !fz;
+			case CC_LS: return fc || fz;
+			case CC_CC: return !fc;
+			case CC_CS: return fc;
+			case CC_NE: return !fz;
+			case CC_EQ: return fz;
+			case CC_VC: return !fv;
+			case CC_VS: return fv;
+			case CC_PL: return !fn;
+			case CC_MI: return fn;
+			case CC_GE: return fn==fv;
+			case CC_LT: return fn!=fv;
+			case CC_GT: return !fz && fn==fv;
+			default: return fz || fn!=fv;
+		}
+	}
+	// effective address calculation time
+	static int EACost(const EmuOperand &o, int size) {
+		int l = size==4 ? 4 : 0;
+		switch (o.type) {
+			case OPD_AIND: return (o.value ? 8 : 4) + l;
+			case OPD_POSTINC: return 4 + l;
+			case OPD_PREDEC: return 6 + l;
+			case OPD_INDEX: return 10 + l;
+			case OPD_ADDR: return (o.value<0x8000 ? 8 : 12) + l;
+			case OPD_IMM: return 4 + l;
+			default: return 0;
+		}
+	}
+	static bool IsReg(const EmuOperand &o) { return o.type==OPD_DREG || o.type==OPD_AREG; }
+
+	// add or subtract with flags, returns the result
+	unsigned int AddSub(unsigned int dst, unsigned int src, int size, bool sub, bool set_x) {
+		unsigned int m = Mask(size), s = Sign(size);
+		unsigned int r = (sub ? dst - src : dst + src) & m;
+		fc = sub ? src>dst : r<dst;
+		fv = sub ? ((dst^src) & (dst^r) & s)!=0 : (~(dst^src) & (dst^r) & s)!=0;
+		fn = (r & s)!=0;
+		fz = !r;
+		if (set_x)
+			fx = fc;
+		return r;
+	}
+
+	// run one instruction, returns the number of cycles or 0 if not supported
+	int Step(const EmuInstr &in, int &pc) {
+		const char *m = in.mnem;
+		int size = in.size, n = in.num_operands;
+		const EmuOperand &s = in.opd[0], &t = in.opd[n>1];
+		size_t len = strlen(m);
+		int cc;
+		if (!strcmp(m, "move") || !strcmp(m, "movea")) {
+			Loc ls = Locate(s, size);
+			unsigned int v = Get(ls, s, size);
+			Loc lt = Locate(t, size);
+			Put(lt, size, v);
+			if (t.type!=OPD_AREG)
+				SetNZ(v, size);
+			int dst = t.type==OPD_PREDEC ? 4 + (size==4 ? 4 : 0) : EACost(t, size);
+			return 4 + EACost(s, size) + dst;
+		}
+		if (!strcmp(m, "moveq")) {
+			d[t.reg] = Extend((unsigned int)s.value, 1);
+			SetNZ(d[t.reg], 4);
+			return 4;
+		}
+		if (!strcmp(m, "lea")) {
+			a[t.reg] = Locate(s, 4).addr;
+			return s.type==OPD_INDEX ? 12 : (s.type==OPD_AIND && !s.value ? 4 : 8);
+		}
+		if (!strcmp(m, "and") || !strcmp(m, "andi") || !strcmp(m, "or") || !strcmp(m, "ori") ||
+			!strcmp(m, "eor") || !strcmp(m, "eori")) {
+			Loc ls = Locate(s, size);
+			unsigned int v = Get(ls, s, size);
+			Loc lt = Locate(t, size);
+			unsigned int r = Get(lt, t, size);
+			r = m[0]=='a' ? r & v : (m[0]=='o' ? r | v : r ^ v);
+			Put(lt, size, r);
+			SetNZ(r, size);
+			if (s.type==OPD_IMM)
+				return t.type==OPD_DREG ? (size==4 ? (m[0]=='a' ? 14 : 16) : 8) : (size==4 ? 20 : 12) + EACost(t, size);
+			if (t.type==OPD_DREG)
+				return size==4 ? (IsReg(s) ? 8 : 6 + EACost(s, size)) : 4 + EACost(s, size);
+			return (size==4 ? 12 : 8) + EACost(t, size);
+		}
+		if (!strncmp(m, "add", 3) || !strncmp(m, "sub", 3)) {
+			bool sub = m[0]=='s';
+			bool quick = m[3]=='q';
+			Loc ls = Locate(s, size);
+			unsigned int v = Get(ls, s, size);
+			if (t.type==OPD_AREG) {	// adda and suba use the whole register
+				v = Extend(v, size);
+				a[t.reg] = sub ? a[t.reg] - v : a[t.reg] + v;
+				if (quick)
+					return 8;
+				return size==4 ? (IsReg(s) || s.type==OPD_IMM ? 8 : 6 + EACost(s, size)) : 8 + EACost(s, size);
+			}
+			Loc lt = Locate(t, size);
+			Put(lt, size, AddSub(Get(lt, t, size), v, size, sub, true));
+			if (quick)
+				return t.type==OPD_DREG ? (size==4 ? 8 : 4) : (size==4 ? 12 : 8) + EACost(t, size);
+			if (s.type==OPD_IMM)
+				return t.type==OPD_DREG ? (size==4 ? 16 : 8) : (size==4 ? 20 : 12) + EACost(t, size);
+			if (t.type==OPD_DREG)
+				return size==4 ? (IsReg(s) ? 8 : 6 + EACost(s, size)) : 4 + EACost(s, size);
+			return (size==4 ? 12 : 8) + EACost(t, size);
+		}
+		if (!strncmp(m, "cmp", 3)) {
+			Loc ls = Locate(s, size);
+			unsigned int v = Get(ls, s, size);
+			Loc lt = Locate(t, size);
+			if (t.type==OPD_AREG) {	// cmpa compares the whole register
+				AddSub(a[t.reg], Extend(v, size), 4, true, false);
+				return 6 + EACost(s, size);
+			}
+			AddSub(Get(lt, t, size), v, size, true, false);
+			if (s.type==OPD_IMM && t.type==OPD_DREG)
+				return size==4 ? 14 : 8;
+			return (size==4 ? 6 : 4) + EACost(s, size);
+		}
+		if (!strcmp(m, "tst")) {
+			Loc ls = Locate(s, size);
+			SetNZ(Get(ls, s, size), size);
+			return 4 + EACost(s, size);
+		}
+		if (!strcmp(m, "clr") || !strcmp(m, "not") || !strcmp(m, "neg")) {
+			Loc ls = Locate(s, size);
+			unsigned int v = Get(ls, s, size);
+			if (m[0]=='n' && m[1]=='e')
+				v = AddSub(0, v, size, true, true);
+			else {
+				v = m[0]=='c' ? 0 : ~v;
+				SetNZ(v, size);
+			}
+			Put(ls, size, v);
+			return s.type==OPD_DREG ? (size==4 ? 6 : 4) : (size==4 ? 12 : 8) + EACost(s, size);
+		}
+		if (!strcmp(m, "swap")) {
+			d[s.reg] = (d[s.reg]>>16) | (d[s.reg]<<16);
+			SetNZ(d[s.reg], 4);
+			return 4;
+		}
+		if (!strcmp(m, "ext")) {
+			unsigned int v = Extend(d[s.reg], size==4 ? 2 : 1);
+			Put(Locate(s, size), size, v);
+			SetNZ(v, size);
+			return 4;
+		}
+		if (len==3 && (m[0]=='l' || m[0]=='a' || m[0]=='r') && (m[2]=='l' || m[2]=='r') &&
+			(!strncmp(m, "ls", 2) || !strncmp(m, "as", 2) || !strncmp(m, "ro", 2))) {
+			// shift count from #n or a data register, a single register operand shifts once
+			int count = n==1 ? 1 : (s.type==OPD_IMM ? (int)s.value : (int)(d[s.reg] & 63));
+			Loc lt = Locate(t, size);
+			unsigned int v = Get(lt, t, size), msk = Mask(size), sign = Sign(size);
+			bool left = m[2]=='l';
+			bool overflow = false;
+			fc = false;
+			for (int i=0; i<count; i++) {
+				unsigned int out = left ? (v & sign)!=0 : v & 1;
+				if (left)
+					v = ((v<<1) | (m[0]=='r' ? out : 0)) & msk;
+				else
+					v = (v>>1) | (m[0]=='r' ? out*sign : (m[0]=='a' ? v & sign : 0));
+				if (left && m[0]=='a' && ((v & sign)!=0)!=(out!=0))
+					overflow = true;
+				fc = out!=0;
+				if (m[0]!='r')
+					fx = fc;
+			}
+			Put(lt, size, v);
+			fn = (v & sign)!=0;
+			fz = !v;
+			fv = overflow;
+			if (t.type!=OPD_DREG)
+				return 8 + EACost(t, size);
+			return (size==4 ? 8 : 6) + 2*count;
+		}
+		if (!strcmp(m, "bra") || !strcmp(m, "bsr")) {
+			if (m[1]=='s') {
+				a[7] -= 4;
+				Write(a[7], 4, (unsigned int)pc);
+			}
+			pc = (int)s.value;
+			return m[1]=='s' ? 18 : 10;
+		}
+		if (m[0]=='b' && (cc = Cond(m+1))>=0) {
+			if (!Condition(cc))
+				return 8;
+			pc = (int)s.value;
+			return 10;
+		}
+		if (m[0]=='d' && m[1]=='b' && (cc = Cond(m+2))>=0) {
+			if (Condition(cc))
+				return 12;
+			unsigned short count = (unsigned short)(d[s.reg]-1);
+			d[s.reg] = (d[s.reg] & 0xffff0000) | count;
+			if (count==0xffff)
+				return 14;
+			pc = (int)t.value;
+			return 10;
+		}
+		if (!strcmp(m, "rts")) {
+			pc = (int)Read(a[7], 4);
+			a[7] += 4;
+			return 16;
+		}
+		if (!strcmp(m, "jmp") || !strcmp(m, "jsr")) {
+			if (m[1]=='s') {
+				a[7] -= 4;
+				Write(a[7], 4, (unsigned int)pc);
+			}
+			pc = (int)s.value;
+			return m[1]=='s' ? 20 : 12;
+		}
+		if (!strcmp(m, "nop"))
+			return 4;
+		return 0;
+	}
+
+	const char* Run(size_t diff, size_t source, size_t dest, long long limit) {
+		memset(cycles, 0, sizeof(cycles));
+		memset(d, 0, sizeof(d));
+		memset(a, 0, sizeof(a));
+		fx = fn = fz = fv = fc = false;
+		fault = nullptr;
+		a[0] = (unsigned int)diff;
+		a[1] = (unsigned int)source;
+		a[2] = (unsigned int)dest;
+		a[7] = MEMORY;
+		a[7] -= 4;
+		Write(a[7], 4, STOP);	// jsr Patch_8BDiff
+		cycles[PHASE_SETUP] += 20;
+		long long total = 20;
+		int pc = entry;
+		while (pc!=STOP) {
+			if (total>limit)
+				return "cycle limit reached";
+			if (pc<0 || pc>=prog.count)
+				return "jumped outside the decoder";
+			const EmuInstr &in = prog.instr[pc++];
+			int c = Step(in, pc);
+			if (fault)
+				return fault;
+			if (!c) {
+				static char error[64];
+				snprintf(error, sizeof(error), "unsupported instruction on line %d", in.line);
+				return error;
+			}
+			cycles[in.phase] += c;
+			total += c;
+		}
+		return nullptr;
+	}
+};
+
+EmuDecoder* CreateEmuDecoder(EmuCpu cpu)
+{
+	switch (cpu) {
+		case CPU_6502: return new Decoder6502;
+		case CPU_Z80: return new DecoderZ80;
+		default: return new Decoder68k;
 	}
 }
 
-// Build a binary diff buffer
-void Encoder::Generate()
+// Cpu from the decoder file name, 8BitDiff_6502.s etc.
+EmuCpu EmuCpuFromName(const char *file)
 {
-	int num_instr = instr[E8I_INJ] + instr[E8I_SRC] + instr[E8I_TRG];
-	// figure out size of diff
-	size_t diff_size = 1;	// 1 byte for bit counts of offs/len tables
-	diff_size += (1<<bitSizesCount[LENGTH]) + (1<<bitSizesCount[OFFSET]);
-	diff_size += inject_size<(1<<15) ? 2 : 4;
-	diff_size += inject_size;
-	size_t instruction_bits = 0;
-	// go through the instructions and add up the bits
+	char name[256];
+	size_t len = strlen(file);
+	if (len>=sizeof(name))
+		len = sizeof(name)-1;
+	for (size_t c=0; c<len; c++)
+		name[c] = file[c]|0x20;
+	name[len] = 0;
+	for (int c=0; c<CPU_COUNT; c++) {
+		if (strstr(name, aCpuNames[c]))
+			return (EmuCpu)c;
+	}
+	return CPU_COUNT;
+}
 
-	int *val = values;
-	for (int i=0; i<num_instr; i++) {
-		instruction_bits += 1; // instructions use at least 1 bit
-		char instr = instructions[i];
-		// add offset, injection buffer doesn't use offset
-		// add length
-		int lenIndex = GetBitCountIndex(*val++, besti2b[LENGTH], 1<<bitSizesCount[LENGTH]);
-		instruction_bits += bitSizesCount[LENGTH]; // offset bit length
-		instruction_bits += besti2b[LENGTH][lenIndex];
-		if (instr!=E8I_INJ) { // inject instruction doesn't have an offset
-			instruction_bits += bitSizesCount[OFFSET]; // offset bit length
-			instruction_bits += besti2b[OFFSET][GetBitCountIndex(*val++,
-								besti2b[OFFSET], 1<<bitSizesCount[OFFSET])];
-			instruction_bits += 1; // offset buffer requires 1 sign bit
-			instruction_bits += 1; // source and target buffers use 1 extra instruction bit
+// 8 bit decoders share 64 kb with the diff, source and output
+#define EMU_SIZE_8BIT (8<<10)
+#define EMU_CYCLES_PER_BYTE 1000	// a decoder running longer is stuck
+
+const char *aEmuColumns = "patch,cpu,target_size,patch_size,cycles,cycles_per_byte,setup,bit_read,copy,other,verified,note";
+
+// Run a diff on an emulated decoder, compare the output with Decode and
+// print a line of results. In place the output is written over the source.
+bool EmulateCase(FILE *csv, EmuDecoder *emu, EmuCpu cpu, const char *name,
+				 const char *source, size_t source_size, const char *diff, size_t diff_size,
+				 bool in_place = false)
+{
+	char line[512];
+	char note[128];
+	note[0] = 0;
+	bool verified = false;
+	size_t target_size = GetLength(diff, diff_size);
+	char *target = (char*)malloc(target_size ? target_size : 1);
+	DiffHeader hdr;
+	size_t diff_at = emu->DataStart();
+	size_t source_at = diff_at + diff_size;
+	size_t dest_at = in_place ? source_at : source_at + source_size;
+	size_t end_at = dest_at + target_size;
+	if (in_place && source_size>target_size)
+		end_at = source_at + source_size;
+	memset(emu->cycles, 0, sizeof(emu->cycles));
+	if (!hdr.Read(diff, diff_size) || Decode(target, source, diff, diff_size)!=target_size)
+		snprintf(note, sizeof(note), "not a valid diff");
+	else if (hdr.large)
+		snprintf(note, sizeof(note), "large file format is not supported");
+	else if (hdr.delta && cpu!=CPU_6502)
+		snprintf(note, sizeof(note), "delta copies are not supported");
+	else if (hdr.backward && cpu!=CPU_6502)
+		snprintf(note, sizeof(note), "backward patches are not supported");
+	else if (end_at > emu->MemorySize())
+		snprintf(note, sizeof(note), "does not fit in %d kb", (int)(emu->MemorySize()>>10));
+	else {
+		unsigned char *mem = emu->Memory();
+		memset(mem + diff_at, 0, emu->MemorySize() - diff_at);
+		memcpy(mem + diff_at, diff, diff_size);
+		memcpy(mem + source_at, source, source_size);
+		long long limit = (long long)(target_size + diff_size) * EMU_CYCLES_PER_BYTE + 1000000;
+		if (const char *error = emu->Run(diff_at, source_at, dest_at, limit))
+			snprintf(note, sizeof(note), "%s", error);
+		for (size_t o=0; o<target_size; o++) {
+			if (mem[dest_at+o]!=(unsigned char)target[o]) {
+				if (!note[0])
+					snprintf(note, sizeof(note), "output differs at 0x%x", (int)o);
+				break;
+			}
 		}
+		verified = !note[0];
 	}
-	instruction_bits += 1; // the diff is terminated by an injection that goes beyond the end
+	free(target);
 
-	diff_size += (instruction_bits+7)/8;
-	result_size = diff_size;
-	result = (char*)malloc(diff_size);
+	long long total = emu->Total();
+	int len = snprintf(line, sizeof(line), "%s,%s,%d,%d,%lld,%.2f", name, aCpuNames[cpu], (int)target_size,
+					   (int)diff_size, total, target_size ? double(total) / target_size : 0.0);
+	for (int p=0; p<PHASE_COUNT; p++)
+		len += snprintf(line+len, sizeof(line)-len, ",%lld", emu->cycles[p]);
+	snprintf(line+len, sizeof(line)-len, ",%d,%s\n", verified ? 1 : 0, note);
+	printf("%s", line);
+	if (csv)
+		fprintf(csv, "%s", line);
+	return verified;
+}
+
+// Encode each benchmark corpus input and run the diff on an emulated
+// decoder, inputs are cut down to fit in 64 kb for 8 bit cpus. In place
+// the diffs are encoded with InPlace and decoded over the source.
+bool EmulateCorpus(FILE *csv, EmuDecoder *emu, EmuCpu cpu, MatchEngine engine, int level, bool optimal,
+				   const CycleModel *cycle_model, double cycle_weight, bool delta, bool in_place,
+				   const AddressWindow *limits)
+{
+	bool verified = true;
+	for (size_t c=0; c<sizeof(aBenchCorpus)/sizeof(aBenchCorpus[0]); c++) {
+		BenchInput in;
+		aBenchCorpus[c].generate(in);
+		size_t source_size = in.source_size, target_size = in.target_size;
+		if (cpu!=CPU_68K) {
+			source_size = source_size<EMU_SIZE_8BIT ? source_size : EMU_SIZE_8BIT;
+			target_size = target_size<EMU_SIZE_8BIT ? target_size : EMU_SIZE_8BIT;
+		}
+		Encoder encode;
+		if (engine!=ENGINE_COUNT)
+			encode.engine = engine;
+		if (level)
+			encode.level = level;
+		encode.cycle_model = cycle_model;
+		encode.cycle_weight = cycle_weight;
+		encode.limits = limits;
+		if (optimal)
+			encode.BuildOptimal(in.source, source_size, in.target, target_size);
+		else
+			encode.Build(in.source, source_size, in.target, target_size);
+		encode.Optimize();
+		if (in_place) {
+			size_t copies, bytes;
+			encode.InPlace(in.source, source_size, in.target, target_size, optimal, copies, bytes);
+			encode.Optimize();
+		}
+		if (delta) {
+			size_t copies, bytes;
+			encode.Delta(in.source, source_size, in.target, target_size, in_place, copies, bytes);
+			encode.Optimize();
+		}
+		encode.Generate();
+		if (!EmulateCase(csv, emu, cpu, aBenchCorpus[c].name, in.source, source_size,
+						 encode.result, encode.result_size, in_place))
+			verified = false;
+	}
+	return verified;
+}
+
+// Batch encoding
+// --------------
+// A manifest lists a source, target and result file on each line (paths
+// relative to the manifest, quoted if they contain spaces, # starts a comment).
+// Sources are loaded and indexed once and shared by the targets using them,
+// the targets are encoded on a pool of threads that each take the next
+// unstarted pair, largest targets first.
+
+// A source shared by the pairs in a manifest
+struct BatchSource {
+	char *name;
+	InputFile file;
+	InputFile cache;		// index mapped from the cache directory
+	MatchFinder *index;		// nullptr if the engine index can't be shared
+	bool loaded;
+	double ms;				// load and index time
+
+	BatchSource() : name(nullptr), index(nullptr), loaded(false), ms(0.0) {}
+	~BatchSource() {
+		delete index;
+		free(name);
+	}
+};
+
+// One line of a manifest
+struct BatchJob {
+	char *target;
+	char *result;
+	int source;				// index in the source list
+	size_t target_size;
+	size_t result_size;
+	double ms;				// encode, verify and write time
+	const char *error;
+
+	BatchJob() : target(nullptr), result(nullptr), source(0), target_size(0), result_size(0), ms(0.0), error(nullptr) {}
+	~BatchJob() {
+		free(target);
+		free(result);
+	}
+};
+
+// Next path on a manifest line relative to dir, nullptr at the end of the line
+char* BatchPath(const char *&p, const char *dir, size_t dir_len)
+{
+	p = EmuSkipSpace(p);
+	if (!*p || *p=='#')
+		return nullptr;
+	const char *start = p;
+	if (*p=='"') {
+		start = ++p;
+		while (*p && *p!='"')
+			p++;
+	} else {
+		while (*p && *p!=' ' && *p!='\t')
+			p++;
+	}
+	size_t len = p-start;
+	if (*p=='"')
+		p++;
+	bool absolute = *start=='/' || *start=='\\' || (len>1 && start[1]==':');
+	if (absolute)
+		dir_len = 0;
+	char *path = (char*)malloc(dir_len + len + 1);
+	memcpy(path, dir, dir_len);
+	memcpy(path + dir_len, start, len);
+	path[dir_len + len] = 0;
+	return path;
+}
+
+// Size of a file without loading it, 0 if it can't be opened
+size_t BatchFileSize(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return 0;
+	fseeko(f, 0, SEEK_END);
+	size_t size = (size_t)ftello(f);
+	fclose(f);
+	return size;
+}
 
-	unsigned char *o = (unsigned char*)result;
-	// write # bits per category
-	*o++ = (bitSizesCount[OFFSET]<<4) | bitSizesCount[LENGTH];
+const char *aBatchColumns = "source,target,result,source_size,target_size,patch_size,ratio,ms,verified";
 
-	// write # bits per bucket
-	for (int siz=0; siz<TYPES; siz++) {
-		for (int b=0; b<(1<<bitSizesCount[siz]); b++)
-			*o++ = besti2b[siz][b];
+// Encode every pair in a manifest on threads, prints a csv summary that
+// is also written to summary_file
+bool BatchEncode(const char *manifest, const char *summary_file, MatchEngine engine, int level, bool optimal,
+				 const CycleModel *cycle_model, double cycle_weight, int threads, bool map, const char *cache_dir,
+				 bool checksum)
+{
+	if (engine==ENGINE_COUNT)
+		engine = Encoder().engine;
+	if (!level)
+		level = E8_DEFAULT_LEVEL;
+	InputFile list;
+	if (!list.Load(manifest, ACCESS_SEQUENTIAL, map)) {
+		printf("Could not open \"%s\"\n", manifest);
+		return false;
 	}
+	char *text = (char*)malloc(list.size+1);
+	memcpy(text, list.data, list.size);
+	text[list.size] = 0;
+	size_t max_lines = 1;
+	for (size_t i=0; i<list.size; i++)
+		max_lines += text[i]=='\n';
+	list.Close();
 
-	// write inject buffer size
-	if (inject_size>=0x8000) {
-		*o++ = 0x80 | (unsigned char)(inject_size>>24);
-		*o++ = (unsigned char)(inject_size>>16);
+	size_t dir_len = strlen(manifest);
+	while (dir_len && manifest[dir_len-1]!='/' && manifest[dir_len-1]!='\\')
+		dir_len--;
+
+	BatchSource *sources = new BatchSource[max_lines];
+	BatchJob *jobs = new BatchJob[max_lines];
+	int num_sources = 0, num_jobs = 0;
+	bool ok = true;
+	int line_num = 0;
+	for (char *line = text; line && *line; ) {
+		char *end = strchr(line, '\n');
+		if (end)
+			*end++ = 0;
+		line_num++;
+		size_t line_len = strlen(line);
+		if (line_len && line[line_len-1]=='\r')
+			line[line_len-1] = 0;
+		const char *p = line;
+		char *source = BatchPath(p, manifest, dir_len);
+		if (source) {
+			BatchJob &job = jobs[num_jobs];
+			job.target = BatchPath(p, manifest, dir_len);
+			job.result = job.target ? BatchPath(p, manifest, dir_len) : nullptr;
+			if (!job.result) {
+				printf("%s(%d): expected <source> <target> <result.8bd>\n", manifest, line_num);
+				free(source);
+				ok = false;
+			} else {
+				int s = 0;
+				while (s<num_sources && strcmp(sources[s].name, source))
+					s++;
+				if (s==num_sources)
+					sources[num_sources++].name = source;
+				else
+					free(source);
+				job.source = s;
+				num_jobs++;
+			}
+		}
+		line = end;
 	}
-	*o++ = (unsigned char)(inject_size>>8);
-	*o++ = (unsigned char)(inject_size);
+	free(text);
 
-	// write inject buffer
-	for (int i=0; i<inject_size; i++)
-		*o++ = inject[i];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-	// write instructions
-	val = values;
-	unsigned char mask = 0x80;
-	for (int i=0; i<num_instr; i++) {
-		char instr = instructions[i];
-		// insert first bit of instruction (0=inject, 1=source or target copy)
-		o = PushBits(o, mask, instr!=E8I_INJ, 1);
-		// add length
-		int length = *val++;
-		int lenIndex = GetBitCountIndex(length, besti2b[LENGTH], 1<<bitSizesCount[LENGTH]);
-		o = PushBits(o, mask, lenIndex, bitSizesCount[LENGTH]);
-		o = PushBits(o, mask, length, besti2b[LENGTH][lenIndex]);
-		// add offset, injection buffer doesn't use offset
-		if (instr!=E8I_INJ) {
-			int offset = *val++;
-			int offIndex = GetBitCountIndex(offset, besti2b[OFFSET], 1<<bitSizesCount[OFFSET]);
-			o = PushBits(o, mask, offIndex, bitSizesCount[OFFSET]);
-			o = PushBits(o, mask, offset, besti2b[OFFSET][offIndex]);
-			o = PushBits(o, mask, offset<0, 1);
-			o = PushBits(o, mask, instr==E8I_TRG, 1);
+	// load and index the sources
+	BatchPool(threads, num_sources, [&](int s) {
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		BatchSource &src = sources[s];
+		src.loaded = src.file.Load(src.name, ACCESS_ALL, map);
+		if (src.loaded) {
+			bool hit;
+			if (cache_dir)
+				src.index = CachedMatchFinder(cache_dir, src.cache, engine, level, src.file.data, src.file.size, map, hit);
+			if (!src.index)
+				src.index = CreateMatchFinder(engine, level, src.file.data, src.file.size, false);
+			if (!src.index->Shared()) {
+				delete src.index;
+				src.index = nullptr;
+			}
 		}
+		src.ms = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now()-begin).count() / 1000.0;
+	});
+
+	// largest targets first so the pool isn't left waiting for one large pair
+	int *order = (int*)malloc(sizeof(int) * (num_jobs ? num_jobs : 1));
+	for (int j=0; j<num_jobs; j++) {
+		jobs[j].target_size = BatchFileSize(jobs[j].target);
+		order[j] = j;
 	}
-	o = PushBits(o, mask, 0, 1); // terminate the file!
-	if (mask!=0x80)
-		o++;
-}
+	std::sort(order, order+num_jobs, [&](int a, int b) { return jobs[a].target_size>jobs[b].target_size; });
 
-// Read a number of bits from the bit stream into a value
-int DecodeBits(const unsigned char **read, unsigned char &mask, int bits)
-{
-	const unsigned char *r = *read;
-	char c = *r;
-	unsigned char m = mask;
-	int value = 0;
-	for (int b=0; b<bits; b++) {
-		value <<= 1;
-		if (c&m)
-			value |= 1;
-		m >>= 1;
-		if (!m) {
-			m = 0x80;
-			c = *++r;
+	BatchPool(threads, num_jobs, [&](int o) {
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		BatchJob &job = jobs[order[o]];
+		BatchSource &src = sources[job.source];
+		InputFile target;
+		if (!src.loaded)
+			job.error = "could not open source";
+		else if (!target.Load(job.target, ACCESS_ALL, map))
+			job.error = "could not open target";
+		else {
+			job.target_size = target.size;
+			Encoder encode;
+			if (engine!=ENGINE_COUNT)
+				encode.engine = engine;
+			if (level)
+				encode.level = level;
+			encode.cycle_model = cycle_model;
+			encode.cycle_weight = cycle_weight;
+			encode.source_index = src.index;
+			if (optimal)
+				encode.BuildOptimal(src.file.data, src.file.size, target.data, target.size);
+			else
+				encode.Build(src.file.data, src.file.size, target.data, target.size);
+			encode.Optimize();
+			encode.Generate();
+			if (checksum)
+				encode.AddTrailer(src.file.data, src.file.size, target.data, target.size);
+			job.result_size = encode.result_size;
+			size_t first_diff;
+			if (!VerifyPatch(src.file.data, src.file.size, target.data, target.size, encode.result, encode.result_size, first_diff))
+				job.error = "patch did not decode to the target";
+			if (!job.error) {
+				FILE *f = fopen(job.result, "wb");
+				if (!f || fwrite(encode.result, encode.result_size, 1, f)!=1)
+					job.error = "could not write result";
+				if (f)
+					fclose(f);
+			}
 		}
+		job.ms = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now()-begin).count() / 1000.0;
+	});
+	free(order);
+	double total_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now()-start).count() / 1000.0;
+
+	FILE *csv = summary_file ? fopen(summary_file, "w") : nullptr;
+	if (summary_file && !csv)
+		printf("Could not open \"%s\"\n", summary_file);
+	printf("%s\n", aBatchColumns);
+	if (csv)
+		fprintf(csv, "%s\n", aBatchColumns);
+	double source_ms = 0.0, job_ms = 0.0;
+	size_t target_bytes = 0, patch_bytes = 0;
+	int failed = 0;
+	for (int s=0; s<num_sources; s++)
+		source_ms += sources[s].ms;
+	for (int j=0; j<num_jobs; j++) {
+		const BatchJob &job = jobs[j];
+		const BatchSource &src = sources[job.source];
+		char line[2048];
+		snprintf(line, sizeof(line), "%s,%s,%s,%d,%d,%d,%.4f,%.1f,%d\n", src.name, job.target, job.result,
+				 (int)src.file.size, (int)job.target_size, (int)job.result_size,
+				 job.target_size ? double(job.result_size) / job.target_size : 0.0, job.ms, job.error ? 0 : 1);
+		printf("%s", line);
+		if (csv)
+			fprintf(csv, "%s", line);
+		if (job.error) {
+			printf("%s: %s\n", job.target, job.error);
+			failed++;
+		}
+		job_ms += job.ms;
+		target_bytes += job.target_size;
+		patch_bytes += job.result_size;
 	}
-	mask = m;
-	*read = r;
-	return value;
+	if (csv)
+		fclose(csv);
+	printf("%d patches (%d failed) from %d sources on %d threads in %.1f ms, %.1f ms indexing sources "
+		   "and %.1f ms encoding on all threads, %d bytes of targets in %d bytes of patches\n",
+		   num_jobs, failed, num_sources, threads, total_ms, source_ms, job_ms, (int)target_bytes, (int)patch_bytes);
+	delete[] jobs;
+	delete[] sources;
+	return ok && !failed;
 }
 
-// Read a single bit from a bit stream and return it
-int DecodeBit(const unsigned char **read, unsigned char &mask)
-{
-	const unsigned char *r = *read;
-	char c = *r;
-	unsigned char m = mask;
+// Patch composition
+// -----------------
+// A patch from a source to a middle file and a patch from the middle file to
+// a target are combined into one patch from the source by following each
+// copy from the middle file back to the source bytes and injected bytes it
+// was made from, so the work depends on the number of instructions and not
+// on the file sizes. Copies that can't be followed in a few steps or that
+// break up into small pieces are encoded again from the decoded middle file.
 
-	int ret = (c&m) ? 1 : 0;
-	m>>=1;
-	if (!m) {
-		mask = 0x80;
-		*read = r+1;
-		return ret;
+#define E8_COMPOSE_DEPTH 64		// target copies in the middle file followed in a row
+#define E8_COMPOSE_PIECE 8		// fewest bytes per instruction a copy may break up into
+
+// One instruction of a patch with the absolute position it reads from
+struct PatchOp {
+	int type;				// Encoder::E8I_INJ, E8I_SRC or E8I_TRG
+	long long pos;			// target position written
+	long long len;
+	long long from;			// source or target position of a copy
+	const char *bytes;		// injected bytes
+};
+
+// The instructions of a patch in target order
+struct PatchOps {
+	PatchOp *ops;
+	size_t count;
+	size_t capacity;
+	long long size;			// target size
+
+	PatchOps() : ops(nullptr), count(0), capacity(0), size(0) {}
+	~PatchOps() { free(ops); }
+
+	void Add(int type, long long len, long long from, const char *bytes) {
+		if (count==capacity) {
+			capacity = capacity ? capacity*2 : 256;
+			ops = (PatchOp*)realloc(ops, sizeof(PatchOp) * capacity);
+		}
+		PatchOp &op = ops[count++];
+		op.type = type;
+		op.pos = size;
+		op.len = len;
+		op.from = from;
+		op.bytes = bytes;
+		size += len;
 	}
-	mask = m;
-	return ret;
-}
+	// back to an earlier count
+	void Undo(size_t mark) {
+		count = mark;
+		size = count ? ops[count-1].pos + ops[count-1].len : 0;
+	}
+	// index of the instruction that writes a target position
+	size_t Find(long long pos) const {
+		size_t lo = 0, hi = count-1;
+		while (lo<hi) {
+			size_t mid = (lo+hi+1)>>1;
+			if (ops[mid].pos<=pos)
+				lo = mid;
+			else
+				hi = mid-1;
+		}
+		return lo;
+	}
+	bool Read(const char *diff, size_t diff_size, long long source_size);
+};
 
-// Decode a bit stream
-size_t Decode(char *out, const char *source, const char *diff)
+// Read the instructions of a patch, false if it is not valid for a source of source_size
+// or has delta copies or is decoded backward (they are not composed)
+bool PatchOps::Read(const char *diff, size_t diff_size, long long source_size)
 {
-	int bitSizeCnt[2];
-	const unsigned char *bitSize[2];
-	const char *buf[3];
-	const char *end;
-	const char *start = out;
-	const unsigned char *du = (const unsigned char*)diff;
-
-	bitSizeCnt[0] = *du & 0xf;
-	bitSizeCnt[1] = (*du++>>4) &0xf;
-	bitSize[0] = du;
-	du += (int)(1U<<bitSizeCnt[0]);
-	bitSize[1] = du;
-	du += (int)(1U<<bitSizeCnt[1]);
-	unsigned int inject_size = 0;
-	if (*du & 0x80) {
-		inject_size = ((int(du[0]&0x7f)<<8) | int(du[1]))<<16;
-		du += 2;
-	}
-	inject_size |= ((unsigned char)(du[0])<<8) | (unsigned char)du[1];
-	du += 2;
-	buf[0] = (const char*)du;
-	buf[1] = source;
-	buf[2] = out;
-	du += inject_size;
-	end = (const char*)du;
+	DiffHeader hdr;
+	if (!hdr.Read(diff, diff_size) || hdr.instructions>hdr.diff_end || hdr.delta || hdr.backward)
+		return false;
+	const char *inject = hdr.inject;
+	const unsigned char *du = hdr.instructions;
 	unsigned char mask = 0x80;
+	long long src = 0, trg = 0;
 	for (;;) {
+		if (du>=hdr.diff_end)
+			return inject>=hdr.inject_end;
 		int buffer = DecodeBit(&du, mask);
-		if (!buffer && buf[0]>=end)
+		if (!buffer && inject>=hdr.inject_end)
 			break;
-		int lbits = DecodeBits(&du, mask, bitSizeCnt[0]);
-		int length = DecodeBits(&du, mask, bitSize[0][lbits]);
-		if (buffer) {
-			int obits = DecodeBits(&du, mask, bitSizeCnt[1]);
-			int offset = DecodeBits(&du, mask, bitSize[1][obits]);
-			if (DecodeBit(&du, mask))
-				offset = ~offset;
-			if (DecodeBit(&du, mask))
-				buffer = 2;
-			buf[buffer] += offset;
+		long long len = DecodeBits(&du, mask, hdr.lenBits[DecodeBits(&du, mask, hdr.lenIdxBits)]);
+		if (!buffer) {
+			if (len>hdr.inject_end-inject)
+				return false;
+			if (len)
+				Add(Encoder::E8I_INJ, len, 0, inject);
+			inject += len;
+			continue;
+		}
+		long long offs = DecodeBits(&du, mask, hdr.offBits[DecodeBits(&du, mask, hdr.offIdxBits)]);
+		if (DecodeBit(&du, mask))
+			offs = ~offs;
+		if (DecodeBit(&du, mask)) {
+			trg += offs;
+			if (trg<0 || trg>=size)
+				return false;
+			if (len)
+				Add(Encoder::E8I_TRG, len, trg, nullptr);
+			trg += len;
+		} else {
+			src += offs;
+			if (src<0 || src+len>source_size)
+				return false;
+			if (len)
+				Add(Encoder::E8I_SRC, len, src, nullptr);
+			src += len;
 		}
-		const char *read = buf[buffer];
-		for (int move=length; move; --move)
-			*out++ = *read++;
-		buf[buffer] = read;
 	}
-	return out-start;
+	return true;
 }
 
-// Get size of a bit stream without the source
-size_t GetLength(const char *diff, size_t diff_size)
+// Add the instructions of first that write middle[b, e) to out. The second
+// patch copies middle[base..] to out at out_base, so bytes that first copies
+// from middle[base..] are copied from what out already has.
+bool ComposeCopy(PatchOps &out, const PatchOps &first, long long b, long long e,
+				 long long base, long long out_base, int depth)
 {
-	int bitSizeCnt[2];
-	const unsigned char *bitSize[2];
-	const unsigned char *inject;
-	const unsigned char *end;
-	const unsigned char *du = (const unsigned char*)diff;
-
-	if (diff_size<6)
-		return 0;
-
-	bitSizeCnt[0] = *du & 0xf;
-	bitSizeCnt[1] = (*du++>>4) & 0xf;
-	bitSize[0] = du;
-	du += (int)(1U<<bitSizeCnt[0]);
-	bitSize[1] = du;
-	du += (int)(1U<<bitSizeCnt[1]);
-	unsigned int inject_size = 0;
-	if (*du & 0x80) {
-		inject_size = ((int(du[0]&0x7f)<<8) | int(du[1]))<<16;
-		du += 2;
-	}
-	inject_size |= ((unsigned char)(du[0])<<8) | (unsigned char)du[1];
-	du += 2;
-	inject = du;
-	du += inject_size;
-	end = du;
-
-	if (size_t(du-(unsigned char*)diff) >= diff_size)
-		return 0;
-
-	size_t target_size = 0;
-
-	unsigned char mask = 0x80;
-	//	int num = 0;
-	for (;;) {
-		int buffer = DecodeBit(&du, mask);
-		if (!buffer && inject>=end)
-			break;
-		int len = DecodeBits(&du, mask, bitSize[0][DecodeBits(&du, mask, bitSizeCnt[0])]);
-		if (buffer)
-			DecodeBits(&du, mask, bitSize[1][DecodeBits(&du, mask, bitSizeCnt[1])]+2);
-		else
-			inject += len;
-		target_size += len;
+	if (depth>E8_COMPOSE_DEPTH)
+		return false;
+	for (size_t i = first.Find(b); b<e; i++) {
+		const PatchOp &op = first.ops[i];
+		long long skip = b-op.pos;
+		long long len = (op.pos+op.len<e ? op.pos+op.len : e) - b;
+		if (op.type==Encoder::E8I_INJ)
+			out.Add(Encoder::E8I_INJ, len, 0, op.bytes+skip);
+		else if (op.type==Encoder::E8I_SRC)
+			out.Add(Encoder::E8I_SRC, len, op.from+skip, nullptr);
+		else {
+			// bytes read from before base are followed back
+			long long from = op.from+skip;
+			long long follow = base + (op.pos-op.from) - b;
+			follow = follow<0 ? 0 : (follow>len ? len : follow);
+			if (follow && !ComposeCopy(out, first, from, from+follow, base, out_base, depth+1))
+				return false;
+			if (follow<len)
+				out.Add(Encoder::E8I_TRG, len-follow, out_base + from+follow - base, nullptr);
+		}
+		b += len;
 	}
-	return target_size;
+	return true;
 }
 
-// Names of buffers for creating a csv report
-const char *aBufferNames[] = {
-	"Inject",
-	"Source",
-	"Target"
-};
-
-// Create a spreadsheet of instructions from a bit stream
-bool GetStats(const char *filename, const char *source, size_t source_size, const char *diff, size_t diff_size)
+// Combine a patch from source to middle (first) and a patch from middle to
+// target (second) into the instructions of encode, ready for Optimize and
+// Generate. reencoded is the number of target bytes encoded again.
+bool Compose(Encoder &encode, const char *source, size_t source_size, const char *first_diff, size_t first_size,
+			 const char *second_diff, size_t second_size, size_t &reencoded)
 {
-	size_t out_size = GetLength(diff, diff_size);
-	if (!out_size)
+	PatchOps first, second, out;
+	if (!first.Read(first_diff, first_size, (long long)source_size) ||
+		!second.Read(second_diff, second_size, first.size))
 		return false;
 
-	if (FILE *f = fopen(filename, "w")) {
-		int bitSizeCnt[2];
-		char *start = (char*)malloc(out_size);
-		char *out = start;
-		const unsigned char *bitSize[2];
-		const char *buf[3], *orig[3];
-		const char *end;
-		const unsigned char *du = (const unsigned char*)diff;
+	char *middle = nullptr;		// decoded if a copy is encoded again
+	reencoded = 0;
+	for (size_t i=0; i<second.count; i++) {
+		const PatchOp &op = second.ops[i];
+		if (op.type!=Encoder::E8I_SRC) {
+			out.Add(op.type, op.len, op.from, op.bytes);
+			continue;
+		}
+		size_t mark = out.count;
+		bool composed = ComposeCopy(out, first, op.from, op.from+op.len, op.from, op.pos, 0);
+		size_t pieces = out.count-mark;
+		if (composed && (pieces<=1 || pieces*E8_COMPOSE_PIECE<=(size_t)op.len))
+			continue;
 
-		fprintf(f, "name,target,offset,length,data\n");
-		bitSizeCnt[0] = *du & 0xf;
-		bitSizeCnt[1] = (*du++>>4) &0xf;
-		bitSize[0] = du;
-		du += (int)(1U<<bitSizeCnt[0]);
-		bitSize[1] = du;
-		du += (int)(1U<<bitSizeCnt[1]);
-		unsigned int inject_size = 0;
-		if (*du & 0x80) {
-			inject_size = ((int(du[0]&0x7f)<<8) | int(du[1]))<<16;
-			du += 2;
+		// encode the copy again from the middle file
+		out.Undo(mark);
+		if (!middle) {
+			middle = (char*)malloc(first.size ? size_t(first.size) : 1);
+			Decode(middle, source, first_diff, first_size);
 		}
-		inject_size |= ((unsigned char)(du[0])<<8) | (unsigned char)du[1];
-		du += 2;
-		orig[0] = buf[0] = (const char*)du;
-		orig[1] = buf[1] = source;
-		orig[2] = buf[2] = out;
-		du += inject_size;
-		end = (const char*)du;
-		unsigned char mask = 0x80;
-		for (;;) {
-			int buffer = DecodeBit(&du, mask);
-			if (!buffer && buf[0]>=end)
-				break;
-			int lbits =DecodeBits(&du, mask, bitSizeCnt[0]);
-			int length = DecodeBits(&du, mask, bitSize[0][lbits]);
-			int offs = -1;
-			if (buffer) {
-				int obits = DecodeBits(&du, mask, bitSizeCnt[1]);
-				offs = DecodeBits(&du, mask, bitSize[1][obits]);
-				if (DecodeBit(&du, mask))
-					offs = ~offs;
-				if (DecodeBit(&du, mask))
-					buffer = 2;
-				buf[buffer] += offs;
-			}
-			const char *data = out, *bufptr = buf[buffer];
-			if (source) {
-				if (buffer==1 && size_t(buf[1]+length-source)>source_size) {
-					printf("Source file is not valid (not large enough)\n");
-					source = nullptr;
-				} else if ((out+length)>(start+out_size)) {
-				} else {
-					const char *read = buf[buffer];
-					for (int move=length; move; --move)
-						*out++ = *read++;
-					buf[buffer] = read;
-				}
+		const char *part = middle + op.from;
+		Encoder local;
+		local.engine = encode.engine;
+		local.level = encode.level;
+		local.Build(source, source_size, part, size_t(op.len));
+		long long src = 0, trg = 0, pos = 0;
+		size_t value = 0;
+		for (const char *instr = local.instructions; instr<local.next_instr; instr++) {
+			long long len = local.Value(value++);
+			if (*instr==Encoder::E8I_INJ)
+				out.Add(Encoder::E8I_INJ, len, 0, part+pos);
+			else if (*instr==Encoder::E8I_SRC) {
+				src += local.Value(value++);
+				out.Add(Encoder::E8I_SRC, len, src, nullptr);
+				src += len;
 			} else {
-				out += length;
-				buf[buffer] += length;
+				trg += local.Value(value++);
+				out.Add(Encoder::E8I_TRG, len, op.pos + trg, nullptr);
+				trg += len;
 			}
-			char info[33], *pi=info, bufOffs[17];
-			if (source) {
-				int il = length<16 ? length : 16;
-				for (int i=0; i<il; i++) {
-					*pi++ = data[i]<=' ' ? '.' : data[i];
-					if (data[i]=='"')
-						*pi++ = '"';
-				}
-				*pi = 0;
-			} else
-				info[0] = 0;
-			if (buffer)
-				snprintf(bufOffs, sizeof(bufOffs), "0x%x", (int)(bufptr-orig[buffer]));
-			else
-				bufOffs[0] = 0;
-			fprintf(f, "%s,0x%x,%s,0x%x,\"%s\"\n", aBufferNames[buffer], (int)(out-length-start), bufOffs, length, info);
+			pos += len;
 		}
-		// clean up
-		free(start);
-		fclose(f);
-		return true;
+		reencoded += size_t(op.len);
 	}
-	return false;
-}
-
 
-// Read a binary file
-const char* LoadFile(const char *name, size_t &size)
-{
-	if (FILE *f = fopen(name, "rb")) {
-		fseek(f, 0, SEEK_END);
-		size = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		if (void *data = malloc(size)) {
-			fread(data, size, 1, f);
-			fclose(f);
-			return (const char*)data;
+	// add the instructions with neighbouring runs joined, injected bytes are
+	// gathered in one run and source copies too short to save bits are injected
+	encode.Begin(source_size, size_t(out.size) > 2*out.count ? size_t(out.size) : 2*out.count);
+	char *run = (char*)malloc(out.size ? size_t(out.size) : 1);
+	size_t run_size = 0;
+	long long src = 0, trg = 0;
+	for (size_t i=0; i<out.count; ) {
+		PatchOp op = out.ops[i++];
+		while (i<out.count && out.ops[i].type==op.type && (op.type==Encoder::E8I_INJ ?
+				out.ops[i].bytes==op.bytes+op.len : out.ops[i].from==op.from+op.len))
+			op.len += out.ops[i++].len;
+		if (op.type==Encoder::E8I_SRC && MatchSaving(op.from-src, op.len)<=0) {
+			op.type = Encoder::E8I_INJ;
+			op.bytes = source + op.from;
+		}
+		if (op.type==Encoder::E8I_INJ) {
+			memcpy(run + run_size, op.bytes, size_t(op.len));
+			run_size += size_t(op.len);
+			continue;
+		}
+		if (run_size) {
+			encode.AddInject(run, run_size);
+			run_size = 0;
+		}
+		if (op.type==Encoder::E8I_SRC) {
+			encode.AddCopy(Encoder::E8I_SRC, op.len, op.from-src);
+			src = op.from+op.len;
+		} else {
+			encode.AddCopy(Encoder::E8I_TRG, op.len, op.from-trg);
+			trg = op.from+op.len;
 		}
-		fclose(f);
 	}
-	return nullptr;
-
+	if (run_size)
+		encode.AddInject(run, run_size);
+	free(run);
+	free(middle);
+	return true;
 }
 
 // command line options
@@ -851,6 +7490,10 @@ const char *aCmdLineOpt[] = {
 	"encode",
 	"decode",
 	"stats",
+	"bench",
+	"emulate",
+	"batch",
+	"compose",
 	nullptr
 };
 
@@ -858,6 +7501,10 @@ enum CMD_OPT {
 	CMD_ENCODE,
 	CMD_DECODE,
 	CMD_STATS,
+	CMD_BENCH,
+	CMD_EMULATE,
+	CMD_BATCH,
+	CMD_COMPOSE,
 
 	CMD_NUM
 };
@@ -869,10 +7516,32 @@ enum CMD_REF {
 	REF_TARGET,
 	REF_DIFF,
 	REF_STATS,
+	REF_DECODER,
+	REF_DIFF2,			// second patch and result of -compose
+	REF_RESULT,
+	REF_JSON,			// statistics as json
 
 	REF_COUNT
 };
 
+// Output sink for decoding without a target file
+bool DiscardOutput(void *, const char *, size_t)
+{
+	return true;
+}
+
+// Parse a size in bytes with an optional k or m suffix
+size_t ParseSize(const char *str)
+{
+	char *end = nullptr;
+	size_t size = (size_t)strtoull(str, &end, 10);
+	if (end && (*end=='k' || *end=='K'))
+		size <<= 10;
+	else if (end && (*end=='m' || *end=='M'))
+		size <<= 20;
+	return size;
+}
+
 // If string is a file, return extension
 const char *GetExt(const char *str)
 {
@@ -890,9 +7559,114 @@ int main(int argc, const char * argv[]) {
 	const char *aFiles[REF_COUNT] = { nullptr };
 
 	CMD_OPT cmd = CMD_NUM;
+	MatchEngine engine = ENGINE_COUNT;
+	int level = 0;
+	bool optimal = false;
+	int threads = 1;
+	size_t window = E8_DEFAULT_WINDOW;
+	size_t block_size = 0;
+	bool map = true;
+	bool large = false;
+	bool suite = false;
+	bool profiling = false;
+	bool checksum = false;
+	bool verify = true;
+	bool in_place = false;
+	bool delta = false;
+	const char *bench_case = nullptr;
+	const char *cache_dir = nullptr;
+	const char **aSources = (const char**)malloc(sizeof(const char*) * argc);
+	int num_refs = 0;				// reference files after the source
+	EmuCpu cpu = CPU_COUNT;
+	const CycleModel *cycle_model = nullptr;
+	const AddressWindow *limits = nullptr;
+	double cycle_weight = E8_CYCLE_WEIGHT;
+	long long budget = 0;
 	for (int i=1; i<argc; i++) {
 		const char *arg = argv[i];
-		if (*arg=='-') {
+		if (*arg=='-' && arg[1]>='1' && arg[1]<='9' && !arg[2]) {
+			level = arg[1]-'0';
+		} else if (*arg=='-' && strcasecmp(arg+1, "optimal")==0) {
+			optimal = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "nomap")==0) {
+			map = false;
+		} else if (*arg=='-' && strcasecmp(arg+1, "large")==0) {
+			large = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "suite")==0) {
+			suite = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "profile")==0) {
+			profiling = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "checksum")==0) {
+			checksum = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "noverify")==0) {
+			verify = false;
+		} else if (*arg=='-' && strcasecmp(arg+1, "inplace")==0) {
+			in_place = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "delta")==0) {
+			delta = true;
+		} else if (*arg=='-' && strcasecmp(arg+1, "case")==0 && (i+1)<argc) {
+			bench_case = argv[++i];
+		} else if (*arg=='-' && strcasecmp(arg+1, "ref")==0 && (i+1)<argc) {
+			aSources[1 + num_refs++] = argv[++i];
+		} else if (*arg=='-' && strcasecmp(arg+1, "cache")==0 && (i+1)<argc) {
+			cache_dir = argv[++i];
+		} else if (*arg=='-' && strcasecmp(arg+1, "cpu")==0 && (i+1)<argc) {
+			for (int c=0; c<CPU_COUNT; c++) {
+				if (strcasecmp(aCpuNames[c], argv[i+1])==0)
+					cpu = (EmuCpu)c;
+			}
+			if (cpu==CPU_COUNT) {
+				printf("Unknown cpu \"%s\"\n", argv[i+1]);
+				return 1;
+			}
+			i++;
+		} else if (*arg=='-' && strcasecmp(arg+1, "cycles")==0 && (i+1)<argc) {
+			for (const CycleModel *m = aCycleModels; m->cpu; m++) {
+				if (strcasecmp(m->cpu, argv[i+1])==0)
+					cycle_model = m;
+			}
+			if (!cycle_model) {
+				printf("Unknown cpu \"%s\"\n", argv[i+1]);
+				return 1;
+			}
+			i++;
+		} else if (*arg=='-' && strcasecmp(arg+1, "limits")==0 && (i+1)<argc) {
+			for (const AddressWindow *w = aAddressWindows; w->name; w++) {
+				if (strcasecmp(w->name, argv[i+1])==0)
+					limits = w;
+			}
+			if (!limits) {
+				printf("Unknown decoder limits \"%s\"\n", argv[i+1]);
+				return 1;
+			}
+			i++;
+		} else if (*arg=='-' && strcasecmp(arg+1, "weight")==0 && (i+1)<argc) {
+			cycle_weight = atof(argv[++i]);
+		} else if (*arg=='-' && strcasecmp(arg+1, "budget")==0 && (i+1)<argc) {
+			budget = strtoll(argv[++i], nullptr, 10);
+		} else if (*arg=='-' && strcasecmp(arg+1, "window")==0 && (i+1)<argc) {
+			window = ParseSize(argv[++i]);
+			if (window<E8_MIN_WINDOW)
+				window = E8_MIN_WINDOW;
+		} else if (*arg=='-' && strcasecmp(arg+1, "blocks")==0 && (i+1)<argc) {
+			block_size = ParseSize(argv[++i]);
+			if (block_size<E8_MIN_WINDOW)
+				block_size = E8_MIN_WINDOW;
+		} else if (*arg=='-' && strcasecmp(arg+1, "threads")==0 && (i+1)<argc) {
+			threads = atoi(argv[++i]);
+			if (threads<1)
+				threads = 1;
+		} else if (*arg=='-' && strcasecmp(arg+1, "engine")==0 && (i+1)<argc) {
+			for (int e=0; e<ENGINE_COUNT; e++) {
+				if (strcasecmp(aEngineNames[e], argv[i+1])==0)
+					engine = (MatchEngine)e;
+			}
+			if (engine==ENGINE_COUNT) {
+				printf("Unknown match engine \"%s\"\n", argv[i+1]);
+				return 1;
+			}
+			i++;
+		} else if (*arg=='-') {
 			for (int c=0; c<CMD_NUM && cmd==CMD_NUM; c++) {
 				if (strcasecmp(aCmdLineOpt[c], arg+1)==0)
 					cmd = (CMD_OPT)c;
@@ -901,8 +7675,12 @@ int main(int argc, const char * argv[]) {
 			const char *ext = GetExt(arg);
 			if (strcasecmp(ext, ".csv")==0)
 				aFiles[REF_STATS] = arg;
+			else if (strcasecmp(ext, ".json")==0)
+				aFiles[REF_JSON] = arg;
 			else if (strcasecmp(ext, ".8bd")==0)
-				aFiles[REF_DIFF] = arg;
+				aFiles[!aFiles[REF_DIFF] ? REF_DIFF : (!aFiles[REF_DIFF2] ? REF_DIFF2 : REF_RESULT)] = arg;
+			else if (strcasecmp(ext, ".s")==0 || strcasecmp(ext, ".asm")==0)
+				aFiles[REF_DECODER] = arg;
 			else if (!aFiles[REF_SOURCE])
 				aFiles[REF_SOURCE] = arg;
 			else if (!aFiles[REF_TARGET])
@@ -912,64 +7690,276 @@ int main(int argc, const char * argv[]) {
 		}
 	}
 
+	if (budget && !cycle_model) {
+		printf("-budget needs a cpu, use -cycles <6502|z80|68k>\n");
+		return 1;
+	}
+	if (in_place && block_size) {
+		printf("-inplace can't be used with -blocks\n");
+		return 1;
+	}
+	if (delta && block_size) {
+		printf("-delta can't be used with -blocks\n");
+		return 1;
+	}
+	if (delta && limits && !limits->delta) {
+		printf("The %s decoder does not read delta copies\n", limits->name);
+		return 1;
+	}
+
 	if (cmd==CMD_NUM ||
 		(cmd==CMD_ENCODE && !aFiles[REF_TARGET]) ||
 		(cmd==CMD_DECODE && (!aFiles[REF_SOURCE] || !aFiles[REF_DIFF])) ||
-		(cmd==CMD_STATS && !aFiles[REF_DIFF])) {
+		(cmd==CMD_STATS && (!aFiles[REF_DIFF] || (!aFiles[REF_STATS] && !aFiles[REF_JSON]))) ||
+		(cmd==CMD_EMULATE && !aFiles[REF_DECODER]) ||
+		(cmd==CMD_BATCH && !aFiles[REF_SOURCE]) ||
+		(cmd==CMD_COMPOSE && (!aFiles[REF_SOURCE] || !aFiles[REF_RESULT]))) {
 		printf("Create a binary patch in a format sensible for 8 bit decoding\n"
 			   "Usage: (arguments in brackets are optional)\n"
-			   "%s -%s <source> <target> [<result.8bd>] [<stats.csv>]\n"
+			   "%s -%s <source> <target> [<result.8bd>] [<stats.csv>] [<stats.json>]\n"
 			   "%s -%s <source> <target> <result.8bd>\n"
-			   "%s -%s [<source>] <result.8bd> <stats.csv>\n",
+			   "%s -%s [<source>] <result.8bd> [<stats.csv>] [<stats.json>]\n"
+			   "%s -%s [<source>] [<result.8bd>] [-suite [<results.csv>]]\n"
+			   "%s -%s <decoder.s> [<source> <target>|<result.8bd>] [<results.csv>]\n"
+			   "%s -%s <manifest> [<summary.csv>]\n"
+			   "%s -%s <source> <first.8bd> <second.8bd> <result.8bd>\n"
+			   "Encode options:\n"
+			   " -engine <pairs|suffix|string|chain>: method for finding matches\n"
+			   " -1 .. -9: fast .. thorough search limits of the chain engine\n"
+			   " -optimal: shortest path parse priced by the bucket tables (slower)\n"
+			   " -threads <n>: find matches on n threads (same result as 1 thread)\n"
+			   " -large: large file format with 64 bit values (automatic above 2 GB)\n"
+			   " -cycles <6502|z80|68k>: trade patch size for estimated decode cycles\n"
+			   " -weight <bits>: bits of patch one decode cycle is worth (default 0.0625)\n"
+			   " -budget <cycles>: smallest patch estimated to decode within the budget\n"
+			   " -cache <dir>: save source indexes in dir and reuse them for the same source\n"
+			   " -ref <file>: another reference file after the source (repeat for more),\n"
+			   "  also given to -decode and -stats in the same order\n"
+			   " -profile: print the time, cpu time and memory of each encode phase\n"
+			   "  and the number of match candidates visited\n"
+			   " -checksum: add the sizes and CRC-32 of the source and target after the\n"
+			   "  patch (ignored by the decoders, checked by -decode)\n"
+			   " -noverify: don't decode the patch and compare it with the target\n"
+			   " -blocks <size>[k|m]: split the target into blocks that decode on their own\n"
+			   "  (encoded and decoded on -threads threads)\n"
+			   " -inplace: patch that can be decoded over the source (also for -decode and\n"
+			   "  -emulate)\n"
+			   " -limits <6502-64k|z80-64k|68k-flat>: only offsets and lengths the decoder\n"
+			   "  can use, inputs that don't fit are rejected\n"
+			   " -delta: source copies may relocate words for code rebuilt at another\n"
+			   "  address (delta format, read by the 6502 decoder, also for -emulate and\n"
+			   "  -bench)\n"
+			   "Decode options:\n"
+			   " -window <size>[k|m]: output kept in memory while decoding (default 16m)\n"
+			   " patches with a checksum are rejected if the source doesn't match and the\n"
+			   " output is checked, without a target the patch is only checked\n"
+			   " -threads <n>: decode n blocks of a block container at a time\n"
+			   "Bench options:\n"
+			   " -suite: encode and decode generated inputs with each engine, csv results\n"
+			   "  are printed and written to <results.csv> if given\n"
+			   "Emulate options:\n"
+			   " runs 8BitDiff_6502.s, 8BitDiff_z80.s or 8BitDiff_68k.s on an emulated cpu\n"
+			   " and counts cycles, the generated inputs are used without a source\n"
+			   " -cpu <6502|z80|68k>: cpu if not in the decoder file name\n"
+			   " targets are encoded with the -limits of the cpu unless others are given\n"
+			   "Batch options:\n"
+			   " each manifest line is <source> <target> <result.8bd>, the pairs are encoded\n"
+			   " on -threads threads and each source is indexed once, encode options apply\n"
+			   "Compose options:\n"
+			   " combines a patch from source to middle and a patch from middle to target\n"
+			   " into one patch from source to target, -engine and -1..-9 are used for\n"
+			   " copies that are encoded again\n"
+			   "Other options:\n"
+			   " -nomap: read input files into memory instead of mapping them\n",
 			   argv[0], aCmdLineOpt[CMD_ENCODE],
 			   argv[0], aCmdLineOpt[CMD_DECODE],
-			   argv[0], aCmdLineOpt[CMD_STATS]);
+			   argv[0], aCmdLineOpt[CMD_STATS],
+			   argv[0], aCmdLineOpt[CMD_BENCH],
+			   argv[0], aCmdLineOpt[CMD_EMULATE],
+			   argv[0], aCmdLineOpt[CMD_BATCH],
+			   argv[0], aCmdLineOpt[CMD_COMPOSE]);
 		return 0;
 	}
 
-	size_t source_size = 0;
-	const char *source = aFiles[REF_SOURCE] ? LoadFile(aFiles[REF_SOURCE], source_size) : nullptr;
-	if (!source && aFiles[REF_SOURCE]) {
-		printf("Could not open \"%s\"\n", aFiles[0]);
-		return 1;
+	if (cmd==CMD_BATCH)
+		return BatchEncode(aFiles[REF_SOURCE], aFiles[REF_STATS],
+						   engine,
+						   level, optimal, cycle_model, cycle_weight, threads, map, cache_dir, checksum) ? 0 : 1;
+
+	// the encoder indexes all of the source and target, decoding only copies parts of the source
+	// -profile times the encode from loading the input files
+	EncodeProfile profile;
+	profiling = profiling && cmd==CMD_ENCODE;
+	if (profiling)
+		profile.Start();
+
+	// with -ref the source is the source file followed by each reference file
+	SourceSet sources;
+	InputFile targetFile, diffFile;
+	aSources[0] = aFiles[REF_SOURCE];
+	if (aFiles[REF_SOURCE]) {
+		int loaded = LoadSources(sources, aSources, 1 + num_refs, cmd==CMD_ENCODE ? ACCESS_ALL : ACCESS_RANDOM, map);
+		if (loaded<1+num_refs) {
+			printf("Could not open \"%s\"\n", aSources[loaded]);
+			return 1;
+		}
 	}
+	const char *source = sources.data;
+	size_t source_size = sources.size;
 
-	size_t target_size = 0;
-	const char *target = (cmd!=CMD_DECODE && cmd!=CMD_STATS && aFiles[REF_TARGET]) ?
-							LoadFile(aFiles[REF_TARGET], target_size) : nullptr;
-	if (!target && (cmd!=CMD_STATS && cmd!=CMD_DECODE && aFiles[REF_TARGET])) {
-		free((void*)source);
+	if (cmd!=CMD_DECODE && cmd!=CMD_STATS && aFiles[REF_TARGET] &&
+		!targetFile.Load(aFiles[REF_TARGET], ACCESS_ALL, map)) {
 		printf("Could not open \"%s\"\n", aFiles[1]);
 		return 1;
 	}
+	const char *target = targetFile.data;
+	size_t target_size = targetFile.size;
+	if (profiling)
+		profile.Stop(PROFILE_LOAD);
 
 	if (cmd==CMD_ENCODE) {
+		// inputs that can't fit the decoder are rejected before encoding
+		unsigned long long limits_memory = 0;
+		if (limits) {
+			size_t block = block_size && block_size<target_size ? block_size : target_size;
+			limits_memory = in_place ? (source_size>block ? source_size : block) : source_size+block;
+			if (limits->memory && limits_memory>limits->memory) {
+				printf("The source and target (%lld bytes) don't fit in the %lld bytes of %s\n",
+					   limits_memory, limits->memory, limits->name);
+				return 1;
+			}
+			if (large || source_size>E8_LARGE_LIMIT || target_size>E8_LARGE_LIMIT) {
+				printf("The %s decoder does not read the large file format\n", limits->name);
+				return 1;
+			}
+		}
 		Encoder encode;
-		encode.Build(source, source_size, target, target_size);
-		encode.Optimize();
+		encode.limits = limits;
+		if (engine!=ENGINE_COUNT)
+			encode.engine = engine;
+		if (level)
+			encode.level = level;
+		encode.threads = threads;
+		encode.large = large;
+		encode.cycle_model = cycle_model;
+		encode.cycle_weight = cycle_weight;
+		// the cached index must stay mapped until the encoder is done with it
+		InputFile cacheFile;
+		MatchFinder *source_index = nullptr;
+		if (profiling)
+			encode.profile = &profile;
+		if (cache_dir) {
+			bool hit;
+			if (profiling)
+				profile.Start();
+			source_index = CachedMatchFinder(cache_dir, cacheFile, encode.engine, encode.level,
+											 source, source_size, map, hit);
+			if (profiling)
+				profile.Stop(PROFILE_INDEX);
+			if (!source_index)
+				printf("The %s engine index is not cached\n", aEngineNames[encode.engine]);
+			encode.source_index = source_index;
+		}
+		if (cycle_model && budget)
+			encode.BuildBudget(source, source_size, target, target_size, budget, optimal);
+		else {
+			if (optimal)
+				encode.BuildOptimal(source, source_size, target, target_size);
+			else
+				encode.Build(source, source_size, target, target_size);
+			encode.Optimize();
+		}
+		if (in_place) {
+			size_t regular = encode.Measure(), copies, bytes;
+			encode.InPlace(source, source_size, target, target_size, optimal, copies, bytes);
+			encode.Optimize();
+			size_t size = encode.Measure();
+			printf("In place%s: %lld source copies (%lld bytes) injected, %lld bytes larger than a regular patch (%+.1f%%)\n",
+				   encode.backward ? " (decoded backward)" : "",
+				   (long long)copies, (long long)bytes, (long long)size - (long long)regular,
+				   regular ? 100.0 * ((double)size - (double)regular) / regular : 0.0);
+		}
+		if (delta) {
+			size_t regular = encode.Measure(), copies, bytes;
+			encode.Delta(source, source_size, target, target_size, in_place, copies, bytes);
+			encode.Optimize();
+			size_t size = encode.Measure();
+			if (encode.backward)
+				printf("Delta: the in place patch is decoded backward, it has no delta copies\n");
+			else if (!encode.delta)
+				printf("Delta: no delta copies make the patch smaller, it is a regular patch\n");
+			else {
+				for (int d=0; d<encode.delta_table.count; d++)
+					printf("Delta: words move by $%04x\n", encode.delta_table.add[d]);
+				printf("Delta: %lld delta copies cover %lld more bytes, %lld bytes smaller than a regular patch (%+.1f%%)\n",
+					   (long long)copies, (long long)bytes, (long long)regular - (long long)size,
+					   regular ? 100.0 * ((double)size - (double)regular) / regular : 0.0);
+			}
+		}
+		// the blocks are encoded from the same source index
+		char *blocks = nullptr;
+		size_t blocks_size = 0;
+		double blocks_ms = 0.0;
+		if (block_size) {
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+			blocks = EncodeBlocks(encode, optimal, source, source_size, target, target_size,
+								  block_size, threads, blocks_size);
+			blocks_ms = std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now()-begin).count() / 1000.0;
+		}
+		encode.source_index = nullptr;
+		delete source_index;
+		if (cycle_model)
+			printf("Estimated %s decode: %lld cycles (%.1f per byte)\n", cycle_model->cpu, encode.Cycles(),
+				   target_size ? double(encode.Cycles()) / target_size : 0.0);
+		PatchStats stats;
+		if (block_size && (aFiles[REF_STATS] || aFiles[REF_JSON])) {
+			printf("Statistics are not written for blocks\n");
+			aFiles[REF_STATS] = aFiles[REF_JSON] = nullptr;
+		}
+		if (aFiles[REF_JSON]) {
+			stats.Begin((long long)target_size);
+			encode.stats = &stats;
+		}
 		encode.Generate();
+		if (blocks) {
+			size_t count = target_size ? (target_size-1)/block_size+1 : 0;
+			long long cost = (long long)blocks_size - (long long)encode.result_size;
+			printf("%lld blocks of %lld bytes in %lld bytes (%.1f ms), %lld bytes as one stream, "
+				   "the blocks cost %lld bytes (%+.1f%%)\n",
+				   (long long)count, (long long)block_size, (long long)blocks_size, blocks_ms,
+				   (long long)encode.result_size, cost,
+				   encode.result_size ? 100.0 * cost / encode.result_size : 0.0);
+			free(encode.result);
+			encode.result = blocks;
+			encode.result_size = blocks_size;
+		} else if (limits) {
+			if (limits->memory && (limits_memory+encode.result_size)>limits->memory) {
+				printf("The source, target and patch (%lld bytes) don't fit in the %lld bytes of %s\n",
+					   limits_memory+encode.result_size, limits->memory, limits->name);
+				return 1;
+			}
+			if (encode.inject_size>limits->max_inject) {
+				printf("The patch injects %lld bytes, more than the %lld bytes %s can hold\n",
+					   (long long)encode.inject_size, (long long)limits->max_inject, limits->name);
+				return 1;
+			}
+		}
 
-		// check result!
-		char *buf = (char*)malloc(target_size);
-		size_t decode_size = Decode(buf, source, encode.result);
-
-		int compare = memcmp(target, buf, target_size);
-		if (compare) {
+		// check result! the patch is decoded a window at a time and compared with the target
+		if (profiling)
+			profile.Start();
+		if (checksum)
+			encode.AddTrailer(source, source_size, target, target_size);
+		size_t first_diff = 0;
+		bool same = !verify || VerifyPatch(source, source_size, target, target_size, encode.result, encode.result_size, first_diff, threads);
+		if (profiling)
+			profile.Stop(PROFILE_VERIFY);
+		if (!same) {
 			printf("You have encountered a bug in the program.\n"
-				   "memcmp(target, decode, target_size) = %d (%d / %d)\n",
-				   compare, (int)target_size, (int)decode_size);
-			int errors = 0;
-			for (size_t o=0; o<target_size; o++) {
-				unsigned char t = (unsigned char)target[o];
-				unsigned char b = (unsigned char)buf[o];
-				if (t!=b) {
-					printf("Byte 0x%x differs (0x%02x != 0x%02x)\n", (int)o, (unsigned char)target[o], (unsigned char)buf[o]);
-					if (errors++>33) {
-						printf(".. too many errors ..\n");
-						break;
-					}
-				}
-			}
+				   "The patch does not decode to the target, first difference at byte 0x%llx of 0x%llx\n",
+				   (unsigned long long)first_diff, (unsigned long long)target_size);
+			return 1;
 		} else if (aFiles[REF_DIFF]) {
 			if (FILE *f = fopen(aFiles[REF_DIFF], "wb")) {
 				fwrite(encode.result, encode.result_size, 1, f);
@@ -977,40 +7967,233 @@ int main(int argc, const char * argv[]) {
 			}
 		}
 		if (aFiles[REF_STATS]) {
-			if (!GetStats(aFiles[REF_STATS], source, source_size, encode.result, encode.result_size))
+			if (!GetStats(aFiles[REF_STATS], sources, encode.result, encode.result_size))
 				printf("Could not generate stats from diff\n");
 		}
-		free(buf);
+		if (aFiles[REF_JSON] && !stats.Write(aFiles[REF_JSON]))
+			printf("Could not write \"%s\"\n", aFiles[REF_JSON]);
+		if (sources.count>1)
+			PrintSourceUse(sources, encode.result, encode.result_size);
+		if (profiling)
+			PrintProfile(profile, encode);
 		encode.Reset();
 	} else if (cmd==CMD_DECODE) {
-		size_t diff_size = 0;
-		if (const char *diff = LoadFile(aFiles[REF_DIFF], diff_size)) {
-			if (size_t target_size = GetLength(diff, diff_size)) {
-				target = (const char*)malloc(target_size);
-				Decode((char*)target, source, diff);
-				if (aFiles[REF_TARGET]) {
-					if (FILE *f = fopen(aFiles[REF_TARGET], "wb")) {
-						fwrite(target, target_size, 1, f);
-						fclose(f);
-					}
+		if (diffFile.Load(aFiles[REF_DIFF], ACCESS_SEQUENTIAL, map)) {
+			const char *diff = diffFile.data;
+			size_t diff_size = diffFile.size;
+			// a patch with a checksum is only applied to the source it was made from
+			PatchTrailer trailer;
+			bool checked = trailer.Read(diff, diff_size);
+			if (checked) {
+				unsigned int crc = Crc32(0, source, source_size);
+				if (trailer.source_size!=source_size || trailer.source_crc!=crc) {
+					printf("The source does not match %s (%lld bytes, crc32 %08x, the patch is for %lld bytes, crc32 %08x)\n",
+						   aFiles[REF_DIFF], (long long)source_size, crc, (long long)trailer.source_size, trailer.source_crc);
+					return 1;
 				}
-				free((void*)diff);
+			}
+			// stream the output to the target file with a window of recent output in memory
+			FILE *f = aFiles[REF_TARGET] ? fopen(aFiles[REF_TARGET], "w+b") : nullptr;
+			if (f || !aFiles[REF_TARGET]) {
+				FileSink file(f);
+				CallbackSink discard(DiscardOutput, nullptr);
+				ChecksumSink output(f ? (DecodeSink&)file : (DecodeSink&)discard);
+				long long decoded;
+				if (in_place) {
+					// the source is copied to a buffer that the patch is decoded over
+					size_t size = GetLength(diff, diff_size);
+					char *buffer = (char*)malloc((size>source_size ? size : source_size) + 1);
+					memcpy(buffer, source, source_size);
+					decoded = DecodeInPlace(buffer, diff, diff_size)==size && output.Write(buffer, size) ? (long long)size : -1;
+					free(buffer);
+				} else
+					decoded = DecodePatch(output, source, source_size, diff, diff_size, window, threads);
+				if (f)
+					fclose(f);
+				if (decoded<0) {
+					printf("Could not decode diff file %s\n", aFiles[REF_DIFF]);
+					return 1;
+				} else if (checked && ((unsigned long long)decoded!=trailer.target_size || output.crc!=trailer.target_crc)) {
+					printf("The output of %s does not match the checksum (%lld bytes, crc32 %08x, expected %lld bytes, crc32 %08x)\n",
+						   aFiles[REF_DIFF], decoded, output.crc, (long long)trailer.target_size, trailer.target_crc);
+					return 1;
+				} else if (!f)
+					printf("%s decodes to %lld bytes, crc32 %08x%s\n", aFiles[REF_DIFF], decoded, output.crc,
+						   checked ? " (matches the checksum)" : " (the patch has no checksum)");
 			} else
-				printf("Could not decode diff file %s\n", aFiles[REF_DIFF]);
+				printf("Could not open \"%s\"\n", aFiles[REF_TARGET]);
 		} else
 			printf("Could not open diff file %s\n", aFiles[REF_DIFF]);
+	} else if (cmd==CMD_BENCH && bench_case) {
+		if (!BenchCase(bench_case, engine!=ENGINE_COUNT ? engine : Encoder().engine,
+					   level ? level : E8_DEFAULT_LEVEL, optimal, delta, threads))
+			return 1;
+	} else if (cmd==CMD_BENCH && suite) {
+		BenchSuite(argv[0], aFiles[REF_STATS], level ? level : E8_DEFAULT_LEVEL, optimal, delta, threads);
+	} else if (cmd==CMD_BENCH) {
+		BenchCompare();
+		if (aFiles[REF_DIFF]) {
+			if (diffFile.Load(aFiles[REF_DIFF], ACCESS_SEQUENTIAL, map))
+				BenchDecode(source, diffFile.data, diffFile.size);
+			else
+				printf("Could not open diff file %s\n", aFiles[REF_DIFF]);
+		}
+	} else if (cmd==CMD_EMULATE) {
+		if (cpu==CPU_COUNT)
+			cpu = EmuCpuFromName(aFiles[REF_DECODER]);
+		InputFile decoderFile;
+		if (cpu==CPU_COUNT) {
+			printf("Use -cpu to select the cpu of \"%s\"\n", aFiles[REF_DECODER]);
+			return 1;
+		} else if (!decoderFile.Load(aFiles[REF_DECODER], ACCESS_ALL, map)) {
+			printf("Could not open \"%s\"\n", aFiles[REF_DECODER]);
+			return 1;
+		}
+		EmuDecoder *emu = CreateEmuDecoder(cpu);
+		bool verified = false;
+		// targets are encoded for what the decoder can address unless -limits is given
+		const AddressWindow *window = limits ? limits : &aAddressWindows[cpu];
+		if (emu->Assemble(decoderFile.data, decoderFile.size)) {
+			FILE *csv = aFiles[REF_STATS] ? fopen(aFiles[REF_STATS], "w") : nullptr;
+			printf("%s\n", aEmuColumns);
+			if (csv)
+				fprintf(csv, "%s\n", aEmuColumns);
+			if (aFiles[REF_DIFF]) {
+				if (diffFile.Load(aFiles[REF_DIFF], ACCESS_ALL, map))
+					verified = EmulateCase(csv, emu, cpu, aFiles[REF_DIFF], source, source_size, diffFile.data, diffFile.size, in_place);
+				else
+					printf("Could not open diff file %s\n", aFiles[REF_DIFF]);
+			} else if (aFiles[REF_TARGET]) {
+				Encoder encode;
+				if (engine!=ENGINE_COUNT)
+					encode.engine = engine;
+				if (level)
+					encode.level = level;
+				encode.cycle_model = cycle_model;
+				encode.cycle_weight = cycle_weight;
+				encode.limits = window;
+				if (cycle_model && budget)
+					encode.BuildBudget(source, source_size, target, target_size, budget, optimal);
+				else {
+					if (optimal)
+						encode.BuildOptimal(source, source_size, target, target_size);
+					else
+						encode.Build(source, source_size, target, target_size);
+					encode.Optimize();
+				}
+				if (in_place) {
+					size_t copies, bytes;
+					encode.InPlace(source, source_size, target, target_size, optimal, copies, bytes);
+					encode.Optimize();
+				}
+				if (delta) {
+					size_t copies, bytes;
+					encode.Delta(source, source_size, target, target_size, in_place, copies, bytes);
+					encode.Optimize();
+				}
+				encode.Generate();
+				verified = EmulateCase(csv, emu, cpu, aFiles[REF_TARGET], source, source_size, encode.result, encode.result_size, in_place);
+			} else
+				verified = EmulateCorpus(csv, emu, cpu, engine,
+										 level, optimal, cycle_model, cycle_weight, delta, in_place, window);
+			if (csv)
+				fclose(csv);
+		}
+		delete emu;
+		if (!verified)
+			return 1;
+	} else if (cmd==CMD_COMPOSE) {
+		InputFile secondFile;
+		if (!diffFile.Load(aFiles[REF_DIFF], ACCESS_ALL, map) || !secondFile.Load(aFiles[REF_DIFF2], ACCESS_ALL, map)) {
+			printf("Could not open \"%s\"\n", diffFile.data ? aFiles[REF_DIFF2] : aFiles[REF_DIFF]);
+			return 1;
+		}
+		Encoder encode;
+		if (engine!=ENGINE_COUNT)
+			encode.engine = engine;
+		if (level)
+			encode.level = level;
+		encode.large = large;
+		size_t reencoded = 0;
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		if (!Compose(encode, source, source_size, diffFile.data, diffFile.size,
+					 secondFile.data, secondFile.size, reencoded)) {
+			printf("Could not compose \"%s\" and \"%s\" from \"%s\"\n",
+				   aFiles[REF_DIFF], aFiles[REF_DIFF2], aFiles[REF_SOURCE]);
+			return 1;
+		}
+		encode.Optimize();
+		double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now()-begin).count() / 1000.0;
+
+		// apply both patches to check the result, and encode the target
+		// directly in case the copies broke up into more than that costs
+		size_t middle_size = GetLength(diffFile.data, diffFile.size);
+		size_t target_size = GetLength(secondFile.data, secondFile.size);
+		char *middle = (char*)malloc(middle_size ? middle_size : 1);
+		char *target = (char*)malloc(target_size ? target_size : 1);
+		char *check = (char*)malloc(target_size ? target_size : 1);
+		Decode(middle, source, diffFile.data, diffFile.size);
+		Decode(target, middle, secondFile.data, secondFile.size);
+		Encoder direct;
+		direct.engine = encode.engine;
+		direct.level = encode.level;
+		direct.large = large;
+		direct.Build(source, source_size, target, target_size);
+		direct.Optimize();
+		size_t composed_size = encode.Measure(), direct_size = direct.Measure();
+		if (direct_size<composed_size) {
+			encode.Swap(direct);
+			encode.Optimize();
+		}
+		PatchStats stats;
+		if (aFiles[REF_JSON]) {
+			stats.Begin((long long)target_size);
+			encode.stats = &stats;
+		}
+		encode.Generate();
+		size_t chain_size = diffFile.size + secondFile.size;
+		printf("Composed %d and %d byte patches into %d bytes in %.1f ms, %d bytes encoded again\n",
+			   (int)diffFile.size, (int)secondFile.size, (int)composed_size, ms, (int)reencoded);
+		printf("%.1f%% of the two patches, %.1f%% of encoding the target directly (%d bytes), "
+			   "the %s patch is written\n", chain_size ? 100.0 * composed_size / chain_size : 0.0,
+			   direct_size ? 100.0 * composed_size / direct_size : 0.0, (int)direct_size,
+			   direct_size<composed_size ? "direct" : "composed");
+		bool same = GetLength(encode.result, encode.result_size)==target_size &&
+			Decode(check, source, encode.result, encode.result_size)==target_size &&
+			memcmp(check, target, target_size)==0;
+		if (same && checksum)
+			encode.AddTrailer(source, source_size, target, target_size);
+		free(middle);
+		free(target);
+		free(check);
+		if (!same) {
+			printf("You have encountered a bug in the program.\n"
+				   "The composed patch does not decode to the same target\n");
+			return 1;
+		}
+		FILE *f = fopen(aFiles[REF_RESULT], "wb");
+		if (!f || fwrite(encode.result, encode.result_size, 1, f)!=1) {
+			printf("Could not write \"%s\"\n", aFiles[REF_RESULT]);
+			if (f)
+				fclose(f);
+			return 1;
+		}
+		fclose(f);
+		if (aFiles[REF_JSON] && !stats.Write(aFiles[REF_JSON]))
+			printf("Could not write \"%s\"\n", aFiles[REF_JSON]);
 	} else if (cmd==CMD_STATS) {
-		size_t diff_size = 0;
-		if (const char *diff = LoadFile(aFiles[REF_DIFF], diff_size)) {
-			if (!GetStats(aFiles[REF_STATS], source, source_size, diff, diff_size))
+		if (diffFile.Load(aFiles[REF_DIFF], ACCESS_SEQUENTIAL, map)) {
+			if (aFiles[REF_STATS] && !GetStats(aFiles[REF_STATS], sources, diffFile.data, diffFile.size))
 				printf("Could not generate stats from diff\n");
-			free((void*)diff);
+			if (aFiles[REF_JSON]) {
+				PatchStats stats;
+				if (!ReadStats(stats, diffFile.data, diffFile.size) || !stats.Write(aFiles[REF_JSON]))
+					printf("Could not write \"%s\"\n", aFiles[REF_JSON]);
+			}
+			if (sources.count>1)
+				PrintSourceUse(sources, diffFile.data, diffFile.size);
 		}
 	}
-
-	if (source)
-		free((void*)source);
-	if (target)
-		free((void*)target);
 	return 0;
 }